@@ -1,41 +1,48 @@
-﻿#include <chrono>
+﻿#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <sstream>
 #include <random>
+#include <thread>
 #include <time.h>
 #include "polyline.h"
+#include "paged_polyline.h"
+#include "compressed_polyline.h"
+#include "generator.h"
+#include "versioned_polyline.h"
+#include "query_service.h"
+#include "shared_index.h"
+#include "validation.h"
 #include "input_parser.h"
 
-// Generates a list of N points with coordinates between lb and up
-// used to generate test files
-void generate_points(size_t N_points, double lb, double ub, std::string out_name)
+// Generates a random walk of N points with steps uniformly distributed in [-step, step]
+// fixed seed makes the polyline reproducible, used by tests and benchmarks
+std::vector<Point3> random_walk(size_t N_points, double step, unsigned seed)
 {
-    std::uniform_real_distribution<double> unif(lb, ub);
-    std::default_random_engine re;
-    re.seed(std::chrono::system_clock::now().time_since_epoch().count());
+    std::uniform_real_distribution<double> unif(-step, step);
+    std::mt19937 re(seed);
 
-    std::ofstream out(out_name, std::ios::out);
-
-    size_t curr_p = 0;
-    while (curr_p < N_points)
+    std::vector<Point3> points;
+    points.reserve(N_points);
+    Point3 cur{ 0., 0., 0. };
+    for (size_t i = 0; i < N_points; ++i)
     {
-        double val = unif(re);
-        out << val << " ";
-        val = unif(re);
-        out << val << " ";
-         val = unif(re);
-        out << val << "\n";
-
-        ++curr_p;
+        points.push_back(cur);
+        cur = cur + Point3{ unif(re), unif(re), unif(re) };
     }
-    out.close();
+    return points;
 }
 
 std::vector<Point3> read_points(std::string filename)
 {
+    // binary files of the generator
+    if (std::filesystem::path(filename).extension() == ".bin")
+        return PolylineGenerator::read_binary(filename);
+
     std::ifstream in(filename, std::ios::in);
 
     if (!in.is_open())
@@ -57,12 +64,9 @@ std::vector<Point3> read_points(std::string filename)
     points.reserve(buf.str().size());
     double x, y, z;
 
-    while (!buf.eof())
-    {
-       buf >> x; buf >> y; buf >> z;
-
+    // a trailing newline must not repeat the last point
+    while (buf >> x >> y >> z)
         points.push_back(Point3{ x, y, z });
-    }
     points.shrink_to_fit();
     return points;
 }
@@ -236,15 +240,20 @@ namespace tests
         double min2 = std::numeric_limits<double>::max();
         for (auto& p_ln : points)
         {
-            int stop = 1;
             double dist2 = P.euc_dist(p_ln);
             if (min2 > dist2)
-                min2 = dist;
+                min2 = dist2;
         }
 
         output_segments(dist, ids, projs);
         if (!(projs[0] == Point3{ 0.0, 2.0, 4.0 }))
             throw std::runtime_error("Test point is segment node failed!");
+        // no segment is farther than its closest vertex
+        if (dist > min2)
+            throw std::runtime_error("Distance exceeds the distance to the closest vertex!");
+        std::string mismatch = Validator::compare(p, P);
+        if (!mismatch.empty())
+            throw std::runtime_error(mismatch);
 
     }
     // t 6
@@ -263,9 +272,9 @@ namespace tests
 
         std::cout << "Octree: " << finish1 << "\nGreedy: " << finish2 << "\n\n";
 
-        // This is not how one's supposed to make tests, though
-        if (!(std::get<0>(ret_oct) == std::get<0>(ret_greedy)))
-            throw std::runtime_error("Minimal distance obtained via octree equal to minimal distance by greedy search");
+        std::string mismatch = Validator::compare(*p, P);
+        if (!mismatch.empty())
+            throw std::runtime_error(mismatch);
     }
     // t 7
     // tests if the returned P projection actually belongs to segment
@@ -289,98 +298,2036 @@ namespace tests
         }
     }
 
-    int run_tests()
+    // the result must have the greedy minimal distance, contain all the greedy closest segments,
+    // and every returned segment must be at that distance 
+    // (greedy search may drop a tie when the distances differ by rounding)
+    void check_against_greedy(Polyline& p, Point3& P, const std::tuple<double, std::vector<size_t>, std::vector<Point3>>& result)
     {
-        int ret = EXIT_SUCCESS;
+        auto& [dist, ids, projs] = result;
+        auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(P);
 
-        try {
-            tests::test_example1();
+        if (!is_equal(dist, dist_greedy))
+            throw std::runtime_error("Minimal distance differs from greedy search!");
+        std::vector<size_t> sorted = ids;
+        std::sort(sorted.begin(), sorted.end());
+        if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end() || projs.size() != ids.size())
+            throw std::runtime_error("Repeated segments!");
+        for (auto id : ids_greedy)
+            if (std::find(ids.begin(), ids.end(), id) == ids.end())
+                throw std::runtime_error("Lost some segments!");
+        // ties are decided by the refined distances, the double ones may differ by the rounding error
+        for (auto id : ids)
+        {
+            auto s = p.get_segment(id);
+            double scale = std::max({ std::abs(P.x), std::abs(P.y), std::abs(P.z), std::abs(s->p1->x), std::abs(s->p1->y),
+                std::abs(s->p1->z), std::abs(s->p2->x), std::abs(s->p2->y), std::abs(s->p2->z) });
+            double slack = p.get_tie_policy().tolerance(dist) + 2. * ClosestSegments::ERROR_ULPS * std::numeric_limits<double>::epsilon() * scale;
+            if (std::abs(std::get<0>(s->euc_dist(P)) - dist) > slack)
+                throw std::runtime_error("Returned segment is not the closest one!");
         }
-        catch (std::runtime_error& e) {
-            std::cout << e.what() << "Example1 test failed!" << "\n";
-            return EXIT_FAILURE;
+    }
+
+    // t 8
+    // approximate search must stay within (1 + eps) of the greedy minimum
+    void test_approx_search()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 26);
+        Polyline p(points);
+        std::mt19937 re(1);
+        std::uniform_real_distribution<double> unif(-30., 30.);
+
+        for (double eps : { 0., 0.1, 1. })
+        {
+            for (size_t i = 0; i < 100; ++i)
+            {
+                Point3 P{ unif(re), unif(re), unif(re) };
+                auto [dist, ids, projs] = p.locate_point_approx(P, eps);
+                auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(P);
+
+                if (ids.size() != 1)
+                    throw std::runtime_error("Approximate search should return exactly one segment!");
+                if (dist < dist_greedy - 1e-9 || dist > (1. + eps) * dist_greedy + 1e-9)
+                    throw std::runtime_error("Approximate distance out of (1 + eps) bound!");
+                if (!is_equal(std::get<0>(p.get_segment(ids[0])->euc_dist(P)), dist))
+                    throw std::runtime_error("Approximate distance does not match the returned segment!");
+            }
         }
-        std::cout << "Example1 test passed!" << "\n\n";
-        
-        try {
-            tests::test_example2();
+    }
+
+    // t 9
+    // coarse-to-fine search over the simplification pyramid must be exact with zero tolerance
+    void test_pyramid_search()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 27);
+        Polyline p(points);
+        p.build_pyramid(0.1, 16);
+        std::mt19937 re(2);
+        std::uniform_real_distribution<double> unif(-30., 30.);
+
+        for (size_t i = 0; i < 100; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            auto [dist, ids, projs] = p.locate_point_coarse(P);
+            auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(P);
+            std::sort(ids.begin(), ids.end());
+
+            if (!is_equal(dist, dist_greedy) || ids != ids_greedy)
+                throw std::runtime_error("Pyramid search result differs from greedy search!");
+
+            auto [dist_tol, ids_tol, projs_tol] = p.locate_point_coarse(P, 0.5);
+            if (dist_tol < dist_greedy || dist_tol > dist_greedy + 0.5)
+                throw std::runtime_error("Pyramid search distance out of tolerance!");
         }
-        catch (std::runtime_error& e) {
-            std::cout << e.what() << "Example2 test failed!" << "\n";
-            return EXIT_FAILURE;
+
+        // all the ties are found
+        std::filesystem::path cwd = std::filesystem::current_path();
+        std::vector<Point3> square = read_points(cwd.string() + "/tests/example2.txt");
+        Polyline p_square(square);
+        p_square.build_pyramid(0.01, 2);
+        Point3 P{ 1, 1, 1 };
+        if (std::get<1>(p_square.locate_point_coarse(P)).size() != 4)
+            throw std::runtime_error("Incorrect number of closest segments!");
+    }
+
+    // t 10
+    // cached results: repeats are served from the cache, near repeats remain exact
+    void test_query_cache()
+    {
+        std::vector<Point3> points = random_walk(4000, 1., 28);
+        Polyline p(points);
+        p.enable_cache(100, 0.5);
+        std::mt19937 re(3);
+        std::uniform_real_distribution<double> unif(-20., 20.);
+        std::uniform_real_distribution<double> shift(-0.01, 0.01);
+
+        for (size_t i = 0; i < 50; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            auto first = p.locate_point(P);
+            auto repeat = p.locate_point(P);
+            if (std::get<0>(first) != std::get<0>(repeat) || std::get<1>(first) != std::get<1>(repeat))
+                throw std::runtime_error("Cached result differs from the computed one!");
+
+            Point3 P_near = P + Point3{ shift(re), shift(re), shift(re) };
+            auto [dist, ids, projs] = p.locate_point(P_near);
+            auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(P_near);
+            std::sort(ids.begin(), ids.end());
+            if (!is_equal(dist, dist_greedy) || ids != ids_greedy)
+                throw std::runtime_error("Near repeat result differs from greedy search!");
         }
-        std::cout << "Example2 test passed!" << "\n\n";
 
-        try {
-            tests::test_example3();
+        auto metrics = p.cache_metrics();
+        if (metrics.hits != 50 || metrics.misses + metrics.near_hits != 100 || metrics.entries > 100 || !metrics.memory)
+            throw std::runtime_error("Incorrect cache metrics!");
+
+        // the cells of these points are out of the range of long long, they are cached exactly
+        QueryCache cache(10, 1e-300);
+        Point3 far{ 1e10, -1e10, 3. };
+        cache.store(far, std::make_tuple(1., std::vector<size_t>{ 7 }, std::vector<Point3>{ far }));
+        if (std::get<0>(cache.lookup(far)) != CacheLookup::HIT || std::get<0>(cache.lookup(far + Point3{ 1e-6, 0., 0. })) != CacheLookup::MISS)
+            throw std::runtime_error("Points out of the quantization range are not cached exactly!");
+    }
+
+    // t 11
+    // hash grid index against greedy search, inside and outside the polyline BBox (also above the topmost vertex)
+    void test_hash_grid()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 29);
+        Polyline p(points, IndexType::HASH_GRID);
+        std::mt19937 re(4);
+        std::uniform_real_distribution<double> unif(-60., 60.);
+
+        for (size_t i = 0; i < 200; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            // every other query is a polyline vertex, which has two closest segments
+            if (i % 2)
+                P = points[1 + i * 97 % (points.size() - 2)];
+            auto [dist, ids, projs] = p.locate_point(P);
+            auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(P);
+            std::sort(ids.begin(), ids.end());
+
+            if (!is_equal(dist, dist_greedy) || ids != ids_greedy)
+                throw std::runtime_error("Hash grid result differs from greedy search!");
         }
-        catch (std::runtime_error& e) {
-            std::cout << e.what() << "Example3 test failed!" << "\n";
-            return EXIT_FAILURE;
+
+        // the ring search outside the grid stops at the reach, not at the last ring
+        Point3 top = *std::max_element(points.begin(), points.end(), [](auto& a, auto& b) { return a.z < b.z; });
+        for (double h : { 0.5, 5., 50., 500. })
+        {
+            Point3 P = top + Point3{ 0.3, -0.2, h };
+            check_against_greedy(p, P, p.locate_point(P));
+        }
+    }
+
+    // t 12
+    // intra-query parallel search against greedy search
+    void test_parallel_search()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 30);
+        Polyline p(points);
+        p.enable_parallel(4);
+        std::mt19937 re(5);
+        std::uniform_real_distribution<double> unif(-60., 60.);
+
+        for (size_t i = 0; i < 100; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            if (i % 2)
+                P = points[1 + i * 97 % (points.size() - 2)];
+            check_against_greedy(p, P, p.locate_point_parallel(P));
         }
-        std::cout << "Example3 test passed!" << "\n\n";
 
+        // an exception of a task reaches the waiting thread, after the other tasks, and the pool stays usable
+        TaskPool pool(4);
+        std::atomic<size_t> done{ 0 };
+        bool thrown = false;
         try {
-            tests::test_point_is_segment_node();
+            pool.parallel_for(0, 1000, 10, [&](size_t i) {
+                if (i == 537)
+                    throw std::runtime_error("task failed");
+                ++done;
+                });
         }
-        catch (std::runtime_error& e) {
-            std::cout << e.what() << "Point is segment node test failed!" << "\n";
-            return EXIT_FAILURE;
+        catch (std::runtime_error&) {
+            thrown = true;
         }
-        std::cout << "Point is segment node test passed!" << "\n\n";
+        // the rest of the chunk [530, 540) is skipped
+        if (!thrown || done != 997)
+            throw std::runtime_error("Task exception is not propagated!");
+        done = 0;
+        pool.parallel_for(0, 1000, 10, [&](size_t) { ++done; });
+        if (done != 1000)
+            throw std::runtime_error("Pool is broken by a task exception!");
+    }
+
+    // t 13
+    // compaction reduces memory, keeps the results and forbids insertions
+    void test_compact()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 31);
+        Polyline p(points);
+        std::mt19937 re(6);
+        std::uniform_real_distribution<double> unif(-60., 60.);
+        std::vector<Point3> queries(100);
+        std::vector<std::tuple<double, std::vector<size_t>, std::vector<Point3>>> before;
+        for (auto& P : queries)
+        {
+            P = Point3{ unif(re), unif(re), unif(re) };
+            before.push_back(p.locate_point_approx(P, 0.));
+        }
+
+        MemoryUsage usage = p.memory_usage();
+        p.compact();
+        MemoryUsage usage_compact = p.memory_usage();
+        std::cout << "memory: " << usage.total() << " -> " << usage_compact.total() << " bytes\n";
+        if (usage_compact.total() >= usage.total() || usage_compact.vertices != usage.vertices)
+            throw std::runtime_error("Compaction did not reduce memory!");
+
+        for (size_t i = 0; i < queries.size(); ++i)
+        {
+            auto after = p.locate_point_approx(queries[i], 0.);
+            if (std::get<0>(after) != std::get<0>(before[i]) || std::get<1>(after) != std::get<1>(before[i]))
+                throw std::runtime_error("Compaction changed the result!");
+        }
+    }
+
+    // t 14
+    // polyline to polyline distance against all pairs of segments, Hausdorff distance on simple cases
+    void test_polyline_distance()
+    {
+        std::vector<Point3> points_a = random_walk(1500, 1., 32);
+        std::vector<Point3> points_b = random_walk(1500, 1., 33);
+        for (auto& pt : points_b)
+            pt = pt + Point3{ 10., 0., 0. };
+        Polyline a(points_a), b(points_b);
+
+        double min_brute = std::numeric_limits<double>::max();
+        for (size_t i = 0; i + 1 < points_a.size(); ++i)
+            for (size_t j = 0; j + 1 < points_b.size(); ++j)
+                min_brute = std::min(min_brute, std::get<0>(a.get_segment(i)->seg_dist(*b.get_segment(j))));
+
+        SegmentPair closest = a.distance_to(b);
+        a.enable_parallel(4);
+        SegmentPair closest_parallel = a.distance_to(b);
+        if (!is_equal(closest.dist, min_brute) || !is_equal(closest_parallel.dist, min_brute))
+            throw std::runtime_error("Polyline distance differs from brute force!");
+        if (!is_equal(closest.p1.euc_dist(closest.p2), closest.dist))
+            throw std::runtime_error("Closest points do not match the distance!");
+
+        // h(A -> B) = 1, h(B -> A) = |(2, 1, 0) - (1, 0, 0)|
+        std::vector<Point3> seg_a{ Point3{ 0, 0, 0 }, Point3{ 1, 0, 0 } };
+        std::vector<Point3> seg_b{ Point3{ 0, 1, 0 }, Point3{ 2, 1, 0 } };
+        Polyline pa(seg_a), pb(seg_b);
+        if (fabs(pa.hausdorff_to(pb) - sqrt(2.)) > 1e-8 || fabs(pb.hausdorff_to(pa) - sqrt(2.)) > 1e-8)
+            throw std::runtime_error("Incorrect Hausdorff distance!");
+
+        // the maximum is reached inside a segment: the middle of the hypotenuse is sqrt(2)/2 away from the legs
+        std::vector<Point3> legs{ Point3{ 0, 1, 0 }, Point3{ 0, 0, 0 }, Point3{ 1, 0, 0 } };
+        std::vector<Point3> hypotenuse{ Point3{ 0, 1, 0 }, Point3{ 1, 0, 0 } };
+        Polyline p_legs(legs), p_hyp(hypotenuse);
+        if (fabs(p_hyp.hausdorff_to(p_legs) - sqrt(0.5)) > 1e-8 || a.hausdorff_to(a) > 1e-8)
+            throw std::runtime_error("Incorrect Hausdorff distance!");
+    }
+
+    // t 15
+    // self contacts against all pairs of segments
+    void test_self_contacts()
+    {
+        std::vector<Point3> square{ Point3{ 0, 0, 0 }, Point3{ 2, 0, 0 }, Point3{ 2, 2, 0 }, Point3{ 0, 2, 0 }, Point3{ 0, 0, 0 } };
+        Polyline p_square(square);
+        if (p_square.find_self_contacts(1.).size() != 0)
+            throw std::runtime_error("Adjacent segments reported as contacts!");
+        auto contacts = p_square.find_self_contacts(2.);
+        if (contacts.size() != 2 || contacts[0].id1 != 0 || contacts[0].id2 != 2 || contacts[1].id1 != 1 || contacts[1].id2 != 3)
+            throw std::runtime_error("Incorrect contacts of the square sides!");
+
+        std::vector<Point3> points = random_walk(3000, 1., 34);
+        Polyline p(points);
+        const double tol = 0.3;
+        std::vector<std::pair<size_t, size_t>> brute;
+        for (size_t i = 0; i + 1 < points.size(); ++i)
+            for (size_t j = i + 2; j + 1 < points.size(); ++j)
+                if (std::get<0>(p.get_segment(i)->seg_dist(*p.get_segment(j))) <= tol)
+                    brute.push_back(std::make_pair(i, j));
+
+        for (size_t n_threads : { 0, 4 })
+        {
+            if (n_threads)
+                p.enable_parallel(n_threads);
+            auto found = p.find_self_contacts(tol);
+            if (found.size() != brute.size())
+                throw std::runtime_error("Incorrect number of self contacts!");
+            for (size_t k = 0; k < found.size(); ++k)
+                if (found[k].id1 != brute[k].first || found[k].id2 != brute[k].second || found[k].dist > tol)
+                    throw std::runtime_error("Incorrect self contact!");
+        }
+    }
+
+    // t 16
+    // corridor of a path against all pairs of segments
+    void test_corridor()
+    {
+        std::vector<Point3> points = random_walk(3000, 1., 35);
+        Polyline p(points);
+        std::vector<Point3> path = random_walk(50, 2., 36);
+        const double r = 1.5;
+
+        std::vector<std::pair<size_t, size_t>> brute;
+        for (size_t q = 0; q + 1 < path.size(); ++q)
+        {
+            Segment s_query{ &path[q], &path[q + 1], q };
+            for (size_t i = 0; i + 1 < points.size(); ++i)
+                if (std::get<0>(p.get_segment(i)->seg_dist(s_query)) <= r)
+                    brute.push_back(std::make_pair(q, i));
+        }
+
+        auto hits = p.corridor(path, r);
+        if (hits.size() != brute.size())
+            throw std::runtime_error("Incorrect number of segments in the corridor!");
+        for (size_t k = 0; k < hits.size(); ++k)
+        {
+            if (hits[k].id2 != brute[k].first || hits[k].id1 != brute[k].second)
+                throw std::runtime_error("Incorrect segment in the corridor!");
+            if (!is_equal(hits[k].p1.euc_dist(hits[k].p2), hits[k].dist) || hits[k].dist > r)
+                throw std::runtime_error("Incorrect closest points in the corridor!");
+        }
+
+        // capsule of a single segment is the same as the first path segment
+        auto capsule = p.corridor(path[0], path[1], r);
+        size_t first = std::count_if(brute.begin(), brute.end(), [](auto& b) { return b.first == 0; });
+        if (capsule.size() != first)
+            throw std::runtime_error("Incorrect number of segments in the capsule!");
+
+        // limited enumeration: a limit not exceeded changes nothing, an exceeded one gives one hit more
+        auto limited = p.corridor(path[0], path[1], r, first);
+        if (limited.size() != first || (first && limited.back().id1 != capsule.back().id1))
+            throw std::runtime_error("Limited capsule differs from the full one!");
+        if (p.corridor(path[0], path[1], 1e6, 100).size() != 101)
+            throw std::runtime_error("Capsule enumeration is not stopped!");
+    }
+
+    // t 17
+    // chainages of projections and the inverse lookups
+    void test_linear_referencing()
+    {
+        std::vector<Point3> points{ {0, 0, 0}, {3, 0, 0}, {3, 4, 0}, {3, 4, 0}, {3, 4, 2} };
+        Polyline p(points);
+        if (!is_equal(p.length(), 9.))
+            throw std::runtime_error("Incorrect polyline length!");
+
+        Point3 P{ 5, 2, 0 };
+        auto [d, ids, projs, s] = p.locate_point_linear(P);
+        if (ids.size() != 1 || ids[0] != 1 || !is_equal(s[0], 5.))
+            throw std::runtime_error("Incorrect chainage of the projection!");
+        if (!(p.point_at(s[0]) == projs[0]) || !(p.point_at(0.) == Point3{ 0, 0, 0 }) || !(p.point_at(9.) == Point3{ 3, 4, 2 }))
+            throw std::runtime_error("Incorrect point at chainage!");
+        if (!(p.point_at(8.) == Point3{ 3, 4, 1 }))
+            throw std::runtime_error("Incorrect point at chainage after a zero length segment!");
+
+        auto range = p.range_between(1., 8.);
+        // vertices are kept as they are, the repeated one included
+        std::vector<Point3> expected{ {1, 0, 0}, {3, 0, 0}, {3, 4, 0}, {3, 4, 0}, {3, 4, 1} };
+        if (range.size() != expected.size() || !std::equal(range.begin(), range.end(), expected.begin()))
+            throw std::runtime_error("Incorrect range between chainages!");
+        auto reversed = p.range_between(8., 1.);
+        if (!std::equal(reversed.rbegin(), reversed.rend(), expected.begin()))
+            throw std::runtime_error("Incorrect reversed range between chainages!");
+
+        // batch lookup, sorted and shuffled
+        std::vector<Point3> walk = random_walk(5000, 1., 37);
+        Polyline p_walk(walk);
+        std::mt19937 re(38);
+        std::uniform_real_distribution<double> unif(0., p_walk.length());
+        std::vector<double> chainages(200000);
+        for (auto& c : chainages)
+            c = unif(re);
+        for (int sorted = 0; sorted < 2; ++sorted)
+        {
+            if (sorted)
+                std::sort(chainages.begin(), chainages.end());
+            auto batch = p_walk.points_at(chainages);
+            for (size_t i = 0; i < chainages.size(); i += 97)
+                if (!(batch[i] == p_walk.point_at(chainages[i])))
+                    throw std::runtime_error("Incorrect batch point at chainage!");
+        }
+
+        bool thrown = false;
+        try { p.point_at(9.5); }
+        catch (std::runtime_error&) { thrown = true; }
+        if (!thrown)
+            throw std::runtime_error("Chainage out of the polyline is not rejected!");
+    }
+
+    // t 18
+    // flat policy trees against greedy search, for spatial and planar polylines
+    void test_policy_trees()
+    {
+        std::mt19937 re(39);
+        std::uniform_real_distribution<double> unif(-40., 40.);
+        for (int planar = 0; planar < 2; ++planar)
+        {
+            std::vector<Point3> points = random_walk(20000, 1., 40);
+            if (planar)
+                for (auto& pt : points)
+                    pt.z = 3.;
+            std::vector<Point3> copy = points;
+            SpatialTree<TreePolicy<float, 16, 3>> tree_f3(copy);
+            SpatialTree<TreePolicy<float, 16, 2>> tree_f2(copy);
+            SpatialTree<TreePolicy<double, 16, 3>> tree_d3(copy);
+            Polyline p_oct(points, IndexType::FLAT_OCTREE);
+            points = copy;
+            Polyline p_quad(points, IndexType::FLAT_QUADTREE);
 
+            for (size_t i = 0; i < 200; ++i)
+            {
+                Point3 P{ unif(re), unif(re), unif(re) };
+                if (i % 2)
+                    P = copy[1 + i * 97 % (copy.size() - 2)];
+                check_against_greedy(p_oct, P, p_oct.locate_point(P));
+                check_against_greedy(p_oct, P, p_quad.locate_point(P));
+                check_against_greedy(p_oct, P, tree_f3.locate_point(P));
+                check_against_greedy(p_oct, P, tree_f2.locate_point(P));
+                check_against_greedy(p_oct, P, tree_d3.locate_point(P));
+            }
+        }
+    }
+
+    // t 19
+    // out-of-core polyline with a budget of a few pages against greedy search
+    void test_paged_polyline()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 41);
+        std::string filename = (std::filesystem::temp_directory_path() / "test_paged_polyline.bin").string();
+        PagedFileWriter::write(points, filename, 500);
+        Polyline p(points);
+
+        PagedPolyline paged(filename, 0);
+        if (paged.get_points_count() != 20000 || paged.get_pages_count() != 40)
+            throw std::runtime_error("Incorrect paged file layout!");
+        paged.set_memory_budget(4 * 501 * sizeof(Point3));
+
+        std::mt19937 re(42);
+        std::uniform_real_distribution<double> unif(-40., 40.);
+        for (size_t i = 0; i < 200; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            // page boundaries included
+            if (i % 2)
+                P = *p.get_segment(i * 250 % 19999)->p1;
+            check_against_greedy(p, P, paged.locate_point(P));
+        }
+
+        auto stats = paged.page_stats();
+        if (stats.faults == 0 || stats.evictions == 0 || stats.resident_pages > 4 || stats.hits + stats.faults < 200)
+            throw std::runtime_error("Incorrect page statistics!");
+        std::filesystem::remove(filename);
+    }
+
+    // t 20
+    // compressed vertices: quantization error, exact search over the decoded polyline
+    void test_compressed_polyline()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 43);
+        // long jumps force the wider deltas in some blocks
+        for (size_t i = 5000; i < points.size(); ++i)
+            points[i] = points[i] + Point3{ 100., 0., 0. };
+        const double quantum = 1e-3;
+        CompressedPolyline compressed(points, quantum);
+
+        std::vector<Point3> decoded = compressed.decode();
+        if (decoded.size() != points.size())
+            throw std::runtime_error("Incorrect number of decoded vertices!");
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            Point3 diff = decoded[i] - points[i];
+            if (std::max({ std::fabs(diff.x), std::fabs(diff.y), std::fabs(diff.z) }) > 0.5 * quantum * (1. + 1e-9))
+                throw std::runtime_error("Decoded vertex is out of the quantization error!");
+            if (i % 101 == 0 && !(compressed.vertex(i) == decoded[i]))
+                throw std::runtime_error("Incorrect single vertex decoding!");
+        }
+        if (compressed.memory() * 2 > points.size() * sizeof(Point3))
+            throw std::runtime_error("Vertices are not compressed!");
+
+        Polyline p(decoded);
+        std::mt19937 re(44);
+        std::uniform_real_distribution<double> unif(-40., 140.);
+        for (size_t i = 0; i < 200; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            if (i % 2)
+                P = *p.get_segment(i * 97 % 19999)->p1;
+            check_against_greedy(p, P, compressed.locate_point(P));
+        }
+    }
+
+    // t 21
+    // moving vertices: small motions are refitted, large ones rebuild subtrees, results stay exact
+    void test_update_vertices()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 45);
+        std::vector<Point3> frame = points;
+        Polyline p(points);
+        p.enable_cache(100);
+        std::mt19937 re(46);
+        std::uniform_real_distribution<double> unif(-40., 40.);
+
+        for (size_t f = 1; f <= 6; ++f)
+        {
+            // a wave along the polyline, the whole second half is shifted away in the frame 5 and back in the frame 6
+            for (size_t i = 0; i < frame.size(); ++i)
+            {
+                frame[i] = points[i] + Point3{ 0.3 * std::sin(0.01 * i + f), 0.3 * std::cos(0.02 * i + f), 0. };
+                if (f == 5 && i >= frame.size() / 2)
+                    frame[i] = frame[i] + Point3{ 150., 0., 0. };
+            }
+            size_t rebuilt = p.update_vertices(frame);
+            if ((f <= 4) != (rebuilt == 0))
+                throw std::runtime_error("Unexpected number of rebuilt subtrees!");
+
+            for (size_t i = 0; i < 50; ++i)
+            {
+                Point3 P{ unif(re), unif(re), unif(re) };
+                if (i % 2)
+                    P = frame[1 + i * 397 % (frame.size() - 2)];
+                check_against_greedy(p, P, p.locate_point(P));
+                // a single segment only from the approximate search
+                if (!is_equal(std::get<0>(p.locate_point_approx(P, 0.)), std::get<0>(p.locate_point_greedy(P))))
+                    throw std::runtime_error("Approximate search differs from greedy search after the update!");
+            }
+        }
+        if (!is_equal(p.length(), Polyline(frame).length()))
+            throw std::runtime_error("Chainages are not updated!");
+    }
+
+    // t 22
+    // generator: reproducible for any number of threads, continuous across the chunks, file round trips
+    void test_generator()
+    {
+        const size_t N = 2 * PolylineGenerator::CHUNK + 1000;
+        for (auto model : { GeneratorModel::UNIFORM, GeneratorModel::RANDOM_WALK, GeneratorModel::CLUSTERED_TRACKS,
+            GeneratorModel::HELIX, GeneratorModel::ROAD_GRID, GeneratorModel::DUPLICATES })
+        {
+            GeneratorParams params;
+            params.model = model;
+            params.n_points = N;
+            params.seed = 47;
+            params.n_threads = 1;
+            auto serial = PolylineGenerator(params).generate();
+            params.n_threads = 3;
+            auto parallel = PolylineGenerator(params).generate();
+            if (serial.size() != N || std::memcmp(serial.data(), parallel.data(), N * sizeof(Point3)) != 0)
+                throw std::runtime_error("Generated polyline depends on the number of threads!");
+            params.seed = 48;
+            if (std::memcmp(serial.data(), PolylineGenerator(params).generate().data(), N * sizeof(Point3)) == 0)
+                throw std::runtime_error("Generated polyline does not depend on the seed!");
+
+            if (model != GeneratorModel::UNIFORM && model != GeneratorModel::CLUSTERED_TRACKS)
+            {
+                size_t c = PolylineGenerator::CHUNK;
+                if (serial[c].euc_dist(serial[c - 1]) > 10. * serial[c - 1].euc_dist(serial[c - 2]) + 1.)
+                    throw std::runtime_error("Generated polyline is broken between chunks!");
+            }
+            if (model == GeneratorModel::ROAD_GRID && std::any_of(serial.begin(), serial.end(), [](auto& p) { return p.z != 0.; }))
+                throw std::runtime_error("Road grid is not planar!");
+        }
+
+        GeneratorParams params;
+        params.model = GeneratorModel::DUPLICATES;
+        params.n_points = 20000;
+        params.seed = 49;
+        auto points = PolylineGenerator(params).generate();
+        size_t repeated = 0;
+        for (size_t i = 1; i < points.size(); ++i)
+            repeated += points[i].x == points[i - 1].x && points[i].y == points[i - 1].y && points[i].z == points[i - 1].z;
+        if (repeated < points.size() / 20)
+            throw std::runtime_error("Too few repeated vertices!");
+
+        std::string bin_name = (std::filesystem::temp_directory_path() / "test_generator.bin").string();
+        std::string txt_name = (std::filesystem::temp_directory_path() / "test_generator.txt").string();
+        PolylineGenerator::write_binary(points, bin_name);
+        auto from_bin = PolylineGenerator::read_binary(bin_name);
+        if (from_bin.size() != points.size() || std::memcmp(from_bin.data(), points.data(), points.size() * sizeof(Point3)) != 0)
+            throw std::runtime_error("Binary file round trip failed!");
+        PolylineGenerator::write_text(points, txt_name);
+        std::ifstream in(txt_name);
+        Point3 p;
+        size_t n = 0;
+        while (in >> p.x >> p.y >> p.z)
+        {
+            if (n >= points.size() || p.x != points[n].x || p.y != points[n].y || p.z != points[n].z)
+                throw std::runtime_error("Text file round trip failed!");
+            ++n;
+        }
+        in.close();
+        if (n != points.size())
+            throw std::runtime_error("Text file round trip lost some points!");
+        std::filesystem::remove(bin_name);
+        std::filesystem::remove(txt_name);
+
+        // repeated vertices are ties of two or more segments
+        Polyline poly(from_bin, IndexType::FLAT_OCTREE);
+        for (size_t i = 1; i < 2000; i += 7)
+            check_against_greedy(poly, points[i], poly.locate_point(points[i]));
+    }
+
+    // t 23
+    // packet traversal of a query batch, against greedy search, for every packet size
+    void test_packet_search()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 50);
+        std::vector<Point3> copy = points;
+        Polyline p(points);
+        std::mt19937 re(51);
+        std::uniform_real_distribution<double> unif(-60., 60.);
+        std::vector<Point3> queries(600);
+        for (size_t i = 0; i < queries.size(); ++i)
+            queries[i] = i % 3 ? Point3{ unif(re), unif(re), unif(re) } : copy[1 + i * 31 % (copy.size() - 2)];
+
+        for (size_t packet : { 1, 4, 8, 16 })
+        {
+            auto results = p.locate_points(queries, packet);
+            for (size_t i = 0; i < queries.size(); ++i)
+                check_against_greedy(p, queries[i], results[i]);
+        }
+        p.enable_parallel(2);
+        auto results = p.locate_points(queries, 16);
+        for (size_t i = 0; i < queries.size(); ++i)
+            check_against_greedy(p, queries[i], results[i]);
+
+        // planar polyline: every segment lies on the split planes z = const, so it is stored in several nodes
+        GeneratorParams params;
+        params.model = GeneratorModel::ROAD_GRID;
+        params.n_points = 20000;
+        params.seed = 54;
+        std::vector<Point3> roads = PolylineGenerator(params).generate();
+        Polyline p_roads(roads);
+        std::uniform_real_distribution<double> unif_roads(-1., 1.);
+        for (size_t i = 0; i < queries.size(); ++i)
+            queries[i] = roads[i * 31 % roads.size()] + (i % 2 ? Point3{ unif_roads(re), unif_roads(re), 0. } : Point3{});
+        results = p_roads.locate_points(queries, 16);
+        for (size_t i = 0; i < queries.size(); ++i)
+            check_against_greedy(p_roads, queries[i], results[i]);
+    }
+
+    // t 24
+    // distance field: interpolation within its error bound, the tolerance in the band, exact search by the cell candidates
+    void test_distance_field()
+    {
+        std::vector<Point3> points = random_walk(2000, 1., 52);
+        Polyline p(points);
+        AABBox box{ Point3{ -6., -6., -6. }, Point3{ 6., -2., 6. } };
+        DistanceFieldParams params;
+        params.tolerance = 0.3;
+        params.band = 1.;
+        params.max_error = 2.;
+        params.max_depth = 8;
+        p.enable_parallel(2);
+        p.build_distance_field(box, params);
+
+        std::mt19937 re(53);
+        std::uniform_real_distribution<double> unif(-7., 7.);
+        for (size_t i = 0; i < 3000; ++i)
+        {
+            Point3 P{ unif(re), unif(re) * 0.5 - 4., unif(re) };
+            auto exact = p.locate_point_greedy(P);
+            auto sample = p.field_distance(P);
+            if (std::abs(sample.distance - std::get<0>(exact)) > sample.error + 1e-9)
+                throw std::runtime_error("Field distance is out of its error bound!");
+            if (box.is_inside(P) && std::get<0>(exact) < params.band && sample.error > params.tolerance)
+                throw std::runtime_error("Field is too coarse in the band!");
+            if (!box.is_inside(P) && sample.error <= box.euc_dist(P))
+                throw std::runtime_error("Field error does not grow outside the box!");
+            check_against_greedy(p, P, p.locate_point_field(P));
+        }
+
+        // a vertex is a tie of two segments
+        for (size_t i = 1; i < points.size() - 1; i += 7)
+            if (box.is_inside(points[i]))
+                check_against_greedy(p, points[i], p.locate_point_field(points[i]));
+
+        p.update_vertices(points);
+        bool thrown = false;
         try {
-            tests::test_point_outside_bbox();
+            p.field_distance(points[0]);
         }
-        catch (std::runtime_error& e) {
-            std::cout << e.what() << "Point outside polyline boundary box test failed!" << "\n";
-            return EXIT_FAILURE;
+        catch (std::runtime_error&) {
+            thrown = true;
         }
-        std::cout << "Point outside polyline boundary box test passed!" << "\n\n";
+        if (!thrown)
+            throw std::runtime_error("Distance field survived the vertex update!");
+    }
 
-        // not unit tests, probably, should not be here
-        ret = user_cycle(tests::test_projection_in_segment,
-            "PointInSegment test failed!");
-        
-        ret = user_cycle(tests::test_against_greedy,
-            "Test against greedy failed!");
-       
-        return ret;
+    // the result of a version search must have the greedy minimal distance and contain all the greedy closest segments
+    bool matches_greedy(const PolylineVersion& v, Point3& P)
+    {
+        auto [dist, ids, projs] = v.locate_point(P);
+        auto [dist_greedy, ids_greedy, projs_greedy] = v.locate_point_greedy(P);
+        if (!is_equal(dist, dist_greedy))
+            return false;
+        for (auto id : ids_greedy)
+            if (std::find(ids.begin(), ids.end(), id) == ids.end())
+                return false;
+        return true;
     }
 
-}
-///____________________________________________________________________________________
+    // t 25
+    // versioned polyline: a pinned version outlives the updates, readers racing with a writer get exact results
+    // on their snapshots, and the replaced versions are deleted once released
+    void test_versioned_polyline()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 54);
+        VersionedPolyline vp(points);
+        std::mt19937 re(55);
+        std::uniform_real_distribution<double> unif(-40., 40.), shift(-3., 3.);
 
-int main(int argc, char** argv)
-{
-    std::filesystem::path cwd = std::filesystem::current_path();
-    std::cout << cwd.string();
-    int test = -1;
-    InputParser input(argc, argv);
-    // option t to run tests
-    if (input.cmdOptionExists("t"))
+        {
+            VersionedPolyline::Reader reader(vp);
+            auto snap = reader.pin();
+            std::vector<Point3> moved(300);
+            for (size_t i = 0; i < moved.size(); ++i)
+                moved[i] = points[1000 + i] + Point3{ 200., 0., 0. };
+            vp.update_vertices(1000, moved);
+            if (!(snap->vertex(1000) == points[1000]) || snap->number() != 1)
+                throw std::runtime_error("Pinned version has changed!");
+            if (vp.retired_count() != 1)
+                throw std::runtime_error("Pinned version was deleted!");
+            for (size_t i = 0; i < 50; ++i)
+            {
+                Point3 P{ unif(re), unif(re), unif(re) };
+                if (!matches_greedy(*snap, P))
+                    throw std::runtime_error("Pinned version search differs from greedy search!");
+            }
+            auto snap2 = std::move(snap);
+        }
+        if (vp.retired_count() != 0)
+            throw std::runtime_error("Released version was not deleted!");
+
+        std::vector<Point3> expected = points;
+        for (size_t i = 0; i < 300; ++i)
+            expected[1000 + i] = points[1000 + i] + Point3{ 200., 0., 0. };
+        std::atomic<bool> done{ false };
+        std::atomic<size_t> failures{ 0 }, checked{ 0 };
+        auto read = [&](unsigned seed)
+        {
+            VersionedPolyline::Reader reader(vp);
+            std::mt19937 rr(seed);
+            uint64_t last = 0;
+            while (!done.load() || checked.load() < 100)
+            {
+                auto snap = reader.pin();
+                if (snap->number() < last)
+                    ++failures;
+                last = snap->number();
+                Point3 P{ unif(rr), unif(rr), unif(rr) };
+                if (!matches_greedy(*snap, P))
+                    ++failures;
+                ++checked;
+            }
+        };
+        std::thread r1(read, 1), r2(read, 2);
+
+        std::uniform_int_distribution<size_t> start(0, points.size() - 1), length(1, 200);
+        for (size_t k = 0; k < 40; ++k)
+        {
+            size_t first = start(re);
+            std::vector<Point3> moved(std::min(length(re), points.size() - first));
+            for (size_t i = 0; i < moved.size(); ++i)
+                moved[i] = expected[first + i] = expected[first + i] + Point3{ shift(re), shift(re), shift(re) };
+            vp.update_vertices(first, moved);
+            if (k == 20)
+                vp.reindex();
+        }
+        done = true;
+        r1.join();
+        r2.join();
+        if (failures.load() != 0)
+            throw std::runtime_error("Reader got an inconsistent version!");
+
+        VersionedPolyline::Reader reader(vp);
+        auto snap = reader.pin();
+        if (snap->number() != 43)
+            throw std::runtime_error("Wrong number of versions!");
+        for (size_t i = 0; i < expected.size(); ++i)
+            if (!(snap->vertex(i) == expected[i]))
+                throw std::runtime_error("Updates are lost!");
+        for (size_t i = 0; i < 100; ++i)
+        {
+            Point3 P{ unif(re), unif(re), unif(re) };
+            if (!matches_greedy(*snap, P))
+                throw std::runtime_error("Final version search differs from greedy search!");
+        }
+    }
+
+    // sorted ids of the closest segments
+    std::vector<size_t> closest_ids(const std::tuple<double, std::vector<size_t>, std::vector<Point3>>& result)
     {
-        test = std::atoi(input.getCmdOption("t").c_str());
-        std::cout << "Runnig tests \n\n";
-        tests::run_tests();
+        auto ids = std::get<1>(result);
+        std::sort(ids.begin(), ids.end());
+        return ids;
     }
-    else
+
+    // t 26
+    // tie policies: symmetric ties far from the origin and ties of cyclic images are found, the relative tolerance ties the distances
+    // the exact policy separates, the octree and the other indexes agree with greedy search under every policy
+    void test_tie_policy()
+    {
+        // segments 0 and 2 are mirrored by swapping x and y around q, their distances to q are exactly equal
+        const double o = 1048576.;
+        Point3 q{ o, o, o };
+        std::vector<Point3> mirrored{ q + Point3{ -1000., -3000., 200. }, q + Point3{ -1000., 3000., 500. },
+            q + Point3{ 3000., -1000., 500. }, q + Point3{ -3000., -1000., 200. } };
+        for (auto policy : { TiePolicy::ulps(64.), TiePolicy::relative_to(1e-9), TiePolicy::exact() })
+        {
+            for (auto index : { IndexType::OCTREE, IndexType::HASH_GRID, IndexType::FLAT_OCTREE })
+            {
+                Polyline p(mirrored, index);
+                p.set_tie_policy(policy);
+                if (closest_ids(p.locate_point(q)) != std::vector<size_t>{ 0, 2 } ||
+                    closest_ids(p.locate_point_greedy(q)) != std::vector<size_t>{ 0, 2 })
+                    throw std::runtime_error("Symmetric tie is missed!");
+            }
+        }
+
+        // segments and their images under the cycle (x, y, z) -> (y, z, x) around a query on its axis:
+        // the distances are exactly equal, though their double-double values may differ
+        std::mt19937 re_cycle(58);
+        std::uniform_real_distribution<double> unif_cycle(-1000., 1000.);
+        const double c = 12.5;
+        Point3 axis{ c, c, c };
+        for (size_t i = 0; i < 2000; ++i)
+        {
+            Point3 a{ c + unif_cycle(re_cycle), c + unif_cycle(re_cycle), c + unif_cycle(re_cycle) };
+            Point3 b{ c + unif_cycle(re_cycle), c + unif_cycle(re_cycle), c + unif_cycle(re_cycle) };
+            Point3 a_cycle{ a.y, a.z, a.x }, b_cycle{ b.y, b.z, b.x };
+            for (auto policy : { TiePolicy::exact(), TiePolicy::ulps(1.), TiePolicy{} })
+            {
+                ClosestSegments closest(policy, axis, 1000.);
+                auto [d, proj] = Segment{ &a, &b, 0 }.euc_dist(axis);
+                auto [d_cycle, proj_cycle] = Segment{ &a_cycle, &b_cycle, 1 }.euc_dist(axis);
+                closest.add(d, &a, &b, 0, proj);
+                closest.add(d_cycle, &a_cycle, &b_cycle, 1, proj_cycle);
+                if (closest_ids(closest.resolve()) != std::vector<size_t>{ 0, 1 })
+                    throw std::runtime_error("Tie of the cyclic images is missed!");
+            }
+        }
+
+        // distances 1 and 1 + 1e-10
+        std::vector<Point3> close{ { -1., -5., 0. }, { -1., 5., 0. }, { 1. + 1e-10, 5., 0. }, { 1. + 1e-10, -5., 0. } };
+        Point3 origin{ 0., 0., 0. };
+        Polyline p_close(close);
+        p_close.set_tie_policy(TiePolicy::relative_to(1e-9));
+        if (closest_ids(p_close.locate_point(origin)) != std::vector<size_t>{ 0, 2 } ||
+            closest_ids(p_close.locate_point_greedy(origin)) != std::vector<size_t>{ 0, 2 })
+            throw std::runtime_error("Relative tolerance tie is missed!");
+        p_close.set_tie_policy(TiePolicy::exact());
+        if (closest_ids(p_close.locate_point(origin)) != std::vector<size_t>{ 0 } ||
+            closest_ids(p_close.locate_point_greedy(origin)) != std::vector<size_t>{ 0 })
+            throw std::runtime_error("Exact policy ties different distances!");
+
+        // vertices (ties of the adjacent segments) and points near them, on a walk shifted far from the origin
+        std::vector<Point3> points = random_walk(5000, 1., 56);
+        for (auto& v : points)
+            v = v + Point3{ 1e6, -1e6, 1e6 };
+        std::mt19937 re(57);
+        std::uniform_real_distribution<double> unif(-0.05, 0.05);
+        std::vector<Point3> queries;
+        for (size_t i = 1; i < points.size(); i += 50)
+        {
+            queries.push_back(points[i]);
+            queries.push_back(points[i] + Point3{ unif(re), unif(re), unif(re) });
+        }
+        for (auto policy : { TiePolicy{}, TiePolicy::ulps(64.), TiePolicy::exact() })
+        {
+            for (auto index : { IndexType::OCTREE, IndexType::HASH_GRID, IndexType::FLAT_OCTREE })
+            {
+                Polyline p(points, index);
+                p.set_tie_policy(policy);
+                for (auto& P : queries)
+                {
+                    auto result = p.locate_point(P);
+                    auto greedy = p.locate_point_greedy(P);
+                    if (closest_ids(result) != closest_ids(greedy) || std::get<0>(result) != std::get<0>(greedy))
+                        throw std::runtime_error("Index search differs from greedy search under the tie policy!");
+                }
+            }
+        }
+
+        // every other exact search, the policy is set after the pyramid and the field are built
+        std::string filename = (std::filesystem::temp_directory_path() / "test_tie_policy.bin").string();
+        PagedFileWriter::write(points, filename, 500);
+        PagedPolyline paged(filename);
+        CompressedPolyline compressed(points, 1e-3);
+        std::vector<Point3> decoded = compressed.decode();
+        Polyline p_decoded(decoded);
+        Polyline p(points);
+        p.enable_parallel(2);
+        p.build_pyramid(0.5);
+        DistanceFieldParams params;
+        params.tolerance = 0.3;
+        params.band = 1.;
+        params.max_error = 2.;
+        params.max_depth = 6;
+        p.build_distance_field(AABBox{ points[0] - Point3{ 8., 8., 8. }, points[0] + Point3{ 8., 8., 8. } }, params);
+        auto same = [](const std::tuple<double, std::vector<size_t>, std::vector<Point3>>& result,
+            const std::tuple<double, std::vector<size_t>, std::vector<Point3>>& greedy)
+        {
+            return closest_ids(result) == closest_ids(greedy) && std::get<0>(result) == std::get<0>(greedy);
+        };
+        for (auto policy : { TiePolicy{}, TiePolicy::ulps(64.), TiePolicy::exact() })
+        {
+            p.set_tie_policy(policy);
+            paged.set_tie_policy(policy);
+            compressed.set_tie_policy(policy);
+            p_decoded.set_tie_policy(policy);
+            auto batch = p.locate_points(queries);
+            for (size_t i = 0; i < queries.size(); ++i)
+            {
+                Point3 P = queries[i];
+                auto greedy = p.locate_point_greedy(P);
+                if (!same(batch[i], greedy) || !same(p.locate_point_parallel(P), greedy) || !same(p.locate_point_coarse(P), greedy) ||
+                    !same(p.locate_point_field(P), greedy) || !same(paged.locate_point(P), greedy))
+                    throw std::runtime_error("Exact search differs from greedy search under the tie policy!");
+                if (!same(compressed.locate_point(P), p_decoded.locate_point_greedy(P)))
+                    throw std::runtime_error("Compressed search differs from greedy search under the tie policy!");
+            }
+        }
+        std::filesystem::remove(filename);
+    }
+
+    // coroutine started eagerly and awaited by no one
+    struct Detached
+    {
+        struct promise_type
+        {
+            Detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    // t 27
+    // query service: results of futures, callbacks and coroutines from several producers match greedy search,
+    // queries are coalesced into batches, a lone query is flushed by the timeout, try_submit fails at capacity,
+    // coroutines awaiting several queries each complete at capacity 1 despite a throwing completion
+    void test_query_service()
     {
+        std::vector<Point3> points = random_walk(5000, 1., 59);
+        Polyline p(points);
+        std::mt19937 re(60);
+        std::uniform_real_distribution<double> unif(-40., 40.);
+        std::vector<Point3> queries(400);
+        for (auto& P : queries)
+            P = Point3{ unif(re), unif(re), unif(re) };
+
+        // callbacks and coroutines complete on the executor threads
+        std::atomic<size_t> completed{ 0 }, wrong{ 0 };
+        auto check = [&](const Point3& P, const QueryService::Result& result)
+        {
+            Point3 Q = P;
+            if (!is_equal(std::get<0>(result), std::get<0>(p.locate_point_greedy(Q))))
+                ++wrong;
+            ++completed;
+        };
+        auto query = [&](QueryService& service, Point3 P) -> Detached
+        {
+            auto result = co_await service.locate(P);
+            check(P, result);
+        };
+        {
+            QueryServiceParams params;
+            params.max_batch = 32;
+            params.max_delay = std::chrono::milliseconds(50);
+            params.capacity = 64;
+            params.n_threads = 2;
+            QueryService service(p, params);
+
+            std::vector<std::future<QueryService::Result>> futures(queries.size());
+            auto produce = [&](size_t first)
+            {
+                for (size_t i = first; i < queries.size(); i += 4)
+                    futures[i] = service.submit(queries[i]);
+            };
+            std::vector<std::thread> producers;
+            for (size_t t = 0; t < 4; ++t)
+                producers.emplace_back(produce, t);
+            for (auto& t : producers)
+                t.join();
+            for (size_t i = 0; i < queries.size(); ++i)
+                check_against_greedy(p, queries[i], futures[i].get());
+            if (service.queries_count() != queries.size() || service.batches_count() * 4 > queries.size())
+                throw std::runtime_error("Queries are not coalesced into batches!");
+
+            for (auto& P : queries)
+            {
+                service.submit(P, [&check, P](QueryService::Result&& result) { check(P, result); });
+                query(service, P);
+            }
+            // the service completes the accepted queries when destroyed
+        }
+        if (completed.load() != 2 * queries.size() || wrong.load() != 0)
+            throw std::runtime_error("Callback or coroutine results are lost or wrong!");
+
+        QueryServiceParams params;
+        params.max_batch = 1000;
+        params.max_delay = std::chrono::milliseconds(2);
+        params.capacity = 4;
+        params.n_threads = 1;
+        QueryService service(p, params);
+        auto lone = service.submit(queries[0]);
+        if (lone.wait_for(std::chrono::seconds(10)) != std::future_status::ready)
+            throw std::runtime_error("Lone query is not flushed by the timeout!");
+
+        // a flush is due in an hour only, so the queries stay accepted
+        QueryServiceParams slow = params;
+        slow.max_delay = std::chrono::hours(1);
+        QueryService slow_service(p, slow);
+        std::atomic<size_t> done{ 0 };
+        auto count = [&](std::exception_ptr, QueryService::Result&&) { ++done; };
+        for (size_t i = 0; i < slow.capacity; ++i)
+            if (!slow_service.try_submit(queries[i], count))
+                throw std::runtime_error("Query is rejected below capacity!");
+        if (slow_service.try_submit(queries[0], count))
+            throw std::runtime_error("Query is accepted beyond capacity!");
+        slow_service.flush();
+        auto start = std::chrono::steady_clock::now();
+        while (!slow_service.try_submit(queries[0], count))
+        {
+            if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
+                throw std::runtime_error("Capacity is not released after flush!");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        slow_service.flush();
+        while (done.load() != slow.capacity + 1)
+        {
+            if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
+                throw std::runtime_error("Flushed queries are not completed!");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // more coroutines than the capacity, each awaits a chain of queries on the single worker,
+        // a throwing completion does not lose the rest of the queries
+        std::atomic<size_t> chained{ 0 };
+        completed = 0;
+        auto chain = [&](QueryService& service, Point3 P) -> Detached
+        {
+            for (size_t k = 0; k < 3; ++k)
+            {
+                auto result = co_await service.locate(P);
+                check(P, result);
+            }
+            ++chained;
+        };
+        QueryServiceParams tight = params;
+        tight.max_delay = std::chrono::milliseconds(1);
+        tight.capacity = 1;
+        QueryService tight_service(p, tight);
+        tight_service.submit(queries[0], [](QueryService::Result&&) { throw std::runtime_error("Completion failure!"); });
+        for (size_t i = 0; i < 8; ++i)
+            chain(tight_service, queries[i]);
+        start = std::chrono::steady_clock::now();
+        while (chained.load() != 8)
+        {
+            if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
+                throw std::runtime_error("Chained coroutine queries are not completed!");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (completed.load() != 24 || wrong.load() != 0)
+            throw std::runtime_error("Chained coroutine results are lost or wrong!");
+    }
+
+    // t 28
+    // shared index: readers attached to the segment (mapped at other addresses) get the results of the builder
+    // and of the flat octree, the name is taken until the builder is destroyed, attaching to a missing name fails
+    void test_shared_index()
+    {
+        std::vector<Point3> points = random_walk(20000, 1., 61);
+        Polyline p(points, IndexType::FLAT_OCTREE);
+        std::string name = "tt_shared_index_test_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+        std::mt19937 re(62);
+        std::uniform_real_distribution<double> unif(-60., 60.);
+        {
+            SharedIndex builder(name, points);
+            bool taken = false;
+            try {
+                SharedIndex twin(name, points);
+            }
+            catch (std::runtime_error&) {
+                taken = true;
+            }
+            if (!taken)
+                throw std::runtime_error("Shared index is built twice under the same name!");
+
+            SharedIndex reader(name), other_reader(name);
+            if (reader.is_owner() || !builder.is_owner() || reader.size() < builder.size())
+                throw std::runtime_error("Wrong shared index attachment!");
+            for (size_t i = 0; i < 200; ++i)
+            {
+                Point3 P = i % 2 ? Point3{ unif(re), unif(re), unif(re) } : points[i * 50];
+                auto expected = p.locate_point(P);
+                for (auto* index : { &builder, &reader, &other_reader })
+                {
+                    auto result = index->locate_point(P);
+                    if (std::get<0>(result) != std::get<0>(expected) || std::get<1>(result) != std::get<1>(expected))
+                        throw std::runtime_error("Shared index search differs from flat octree search!");
+                }
+                check_against_greedy(p, P, reader.locate_point(P));
+            }
+        }
+
+        bool missing = false;
+        try {
+            SharedIndex reader(name);
+        }
+        catch (std::runtime_error&) {
+            missing = true;
+        }
+        if (!missing)
+            throw std::runtime_error("Shared index outlives its builder!");
+    }
+    // t 29
+    // validation: a small seeded run of every model and index finds nothing and does not depend on the threads,
+    // minimization keeps exactly the vertices the failure needs
+    void test_validation()
+    {
+        ValidationParams params;
+        params.n_queries = 3000;
+        params.n_points = 2000;
+        params.n_threads = 1;
+        ValidationReport single = Validator(params).run();
+        params.n_threads = 4;
+        ValidationReport report = Validator(params).run();
+        if (report.total_queries() != params.n_queries || report.queries != single.queries || report.failed != single.failed)
+            throw std::runtime_error("Validation depends on the threads!");
+        for (size_t k = 0; k < QUERY_KINDS; ++k)
+            if (report.queries[k] == 0)
+                throw std::runtime_error(std::string("No queries of kind ") + Validator::kind_name(QueryKind(k)));
+        if (report.total_failed() != 0)
+        {
+            Validator::write_failure(report.failures.front(), std::cout);
+            throw std::runtime_error("Validation found failures!");
+        }
+
+        // fails while both marked vertices are in the polyline
+        std::vector<Point3> points = random_walk(1000, 1., 63);
+        Point3 a = points[137], b = points[802];
+        auto fails = [&](std::vector<Point3>& pts) {
+            return std::find(pts.begin(), pts.end(), a) != pts.end() && std::find(pts.begin(), pts.end(), b) != pts.end();
+        };
+        auto minimized = Validator::minimize(points, fails);
+        if (minimized.size() != 2 || !(minimized[0] == a) || !(minimized[1] == b))
+            throw std::runtime_error("Failure is not minimized!");
+    }
+    // t 30
+    // leaf box blocks: lane distances are the box distances, empty lanes are never reached,
+    // and the exact searches over dense leaves (before and after a vertex update) agree with greedy search
+    void test_box_blocks()
+    {
+        std::mt19937 re(64);
+        std::uniform_real_distribution<double> unif(-10., 10.);
+        for (size_t i = 0; i < 1000; ++i)
+        {
+            BoxBlock block;
+            std::array<AABBox, BoxBlock::LANES - 1> boxes;
+            for (size_t s = 0; s < boxes.size(); ++s)
+            {
+                boxes[s] = AABBox::of(Point3{ unif(re), unif(re), unif(re) }, Point3{ unif(re), unif(re), unif(re) });
+                block.set(s, boxes[s]);
+            }
+            Point3 P{ unif(re), unif(re), unif(re) };
+            std::array<double, BoxBlock::LANES> d2;
+            double nearest = block.dist2(P, d2);
+            double expected = std::numeric_limits<double>::max();
+            for (size_t s = 0; s < boxes.size(); ++s)
+            {
+                double d = boxes[s].euc_dist(P);
+                expected = std::min(expected, d * d);
+                if (std::abs(std::sqrt(d2[s]) - d) > 1e-12 * (1. + d))
+                    throw std::runtime_error("Lane distance differs from box distance!");
+            }
+            if (d2[BoxBlock::LANES - 1] != std::numeric_limits<double>::infinity() || std::abs(nearest - expected) > 1e-12 * (1. + expected))
+                throw std::runtime_error("Wrong block distance!");
+        }
+
+        // short steps: thousands of segments per leaf
+        std::vector<Point3> points = random_walk(30000, 0.01, 65);
+        Polyline p(points);
+        std::uniform_real_distribution<double> near(-0.05, 0.05);
+        for (size_t f = 0; f < 2; ++f)
+        {
+            for (size_t i = 0; i < 300; ++i)
+            {
+                Point3 P = points[i * 97 % points.size()];
+                if (i % 3)
+                    P = P + Point3{ near(re), near(re), near(re) };
+                std::string mismatch = Validator::compare(p, P);
+                if (!mismatch.empty())
+                    throw std::runtime_error(mismatch);
+            }
+            // the boxes of the leaves follow the moved vertices
+            for (size_t i = 0; i < points.size(); ++i)
+                points[i] = points[i] + Point3{ 0.02 * std::sin(0.01 * i), 0.02 * std::cos(0.01 * i), 0. };
+            p.update_vertices(points);
+        }
+    }
+
+    int run_tests()
+    {
+        int ret = EXIT_SUCCESS;
+
+        try {
+            tests::test_example1();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Example1 test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Example1 test passed!" << "\n\n";
+        
+        try {
+            tests::test_example2();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Example2 test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Example2 test passed!" << "\n\n";
+
+        try {
+            tests::test_example3();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Example3 test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Example3 test passed!" << "\n\n";
+
+        try {
+            tests::test_point_is_segment_node();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Point is segment node test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Point is segment node test passed!" << "\n\n";
+
+        try {
+            tests::test_point_outside_bbox();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Point outside polyline boundary box test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Point outside polyline boundary box test passed!" << "\n\n";
+
+        try {
+            tests::test_approx_search();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Approximate search test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Approximate search test passed!" << "\n\n";
+
+        try {
+            tests::test_pyramid_search();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Pyramid search test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Pyramid search test passed!" << "\n\n";
+
+        try {
+            tests::test_query_cache();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Query cache test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Query cache test passed!" << "\n\n";
+
+        try {
+            tests::test_hash_grid();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Hash grid test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Hash grid test passed!" << "\n\n";
+
+        try {
+            tests::test_parallel_search();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Parallel search test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Parallel search test passed!" << "\n\n";
+
+        try {
+            tests::test_compact();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Compaction test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Compaction test passed!" << "\n\n";
+
+        try {
+            tests::test_polyline_distance();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Polyline distance test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Polyline distance test passed!" << "\n\n";
+
+        try {
+            tests::test_self_contacts();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Self contacts test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Self contacts test passed!" << "\n\n";
+
+        try {
+            tests::test_corridor();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Corridor test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Corridor test passed!" << "\n\n";
+
+        try {
+            tests::test_linear_referencing();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Linear referencing test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Linear referencing test passed!" << "\n\n";
+
+        try {
+            tests::test_policy_trees();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Policy trees test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Policy trees test passed!" << "\n\n";
+
+        try {
+            tests::test_paged_polyline();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Paged polyline test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Paged polyline test passed!" << "\n\n";
+
+        try {
+            tests::test_compressed_polyline();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Compressed polyline test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Compressed polyline test passed!" << "\n\n";
+
+        try {
+            tests::test_update_vertices();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Update vertices test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Update vertices test passed!" << "\n\n";
+
+        try {
+            tests::test_generator();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Generator test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Generator test passed!" << "\n\n";
+
+        try {
+            tests::test_packet_search();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Packet search test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Packet search test passed!" << "\n\n";
+
+        try {
+            tests::test_distance_field();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Distance field test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Distance field test passed!" << "\n\n";
+
+        try {
+            tests::test_versioned_polyline();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Versioned polyline test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Versioned polyline test passed!" << "\n\n";
+
+        try {
+            tests::test_tie_policy();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Tie policy test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Tie policy test passed!" << "\n\n";
+
+        try {
+            tests::test_query_service();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Query service test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Query service test passed!" << "\n\n";
+
+        try {
+            tests::test_shared_index();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Shared index test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Shared index test passed!" << "\n\n";
+
+        try {
+            tests::test_validation();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Validation test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Validation test passed!" << "\n\n";
+
+        try {
+            tests::test_box_blocks();
+        }
+        catch (std::runtime_error& e) {
+            std::cout << e.what() << "Box blocks test failed!" << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Box blocks test passed!" << "\n\n";
+
+        // not unit tests, probably, should not be here
+        ret = user_cycle(tests::test_projection_in_segment,
+            "PointInSegment test failed!");
+        
+        ret = user_cycle(tests::test_against_greedy,
+            "Test against greedy failed!");
+       
+        return ret;
+    }
+
+}
+///____________________________________________________________________________________
+
+namespace benchmarks
+{
+    // average time of a query (in microseconds) over the given points
+    double time_queries(std::function< void(Point3& P) > foo, std::vector<Point3>& queries)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (auto& P : queries)
+            foo(P);
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / queries.size();
+    }
+
+    // latency versus eps for the approximate search
+    void bench_approx(Polyline& p, std::vector<Point3>& queries)
+    {
+        std::cout << "Approximate search, " << queries.size() << " queries:\n";
+        std::vector<double> exact(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i)
+            exact[i] = std::get<0>(p.locate_point_approx(queries[i], 0.));
+
+        for (double eps : { 0., 0.01, 0.1, 0.5, 1., 2. })
+        {
+            double max_ratio = 1.;
+            double t = time_queries([&](Point3& P) { p.locate_point_approx(P, eps); }, queries);
+            for (size_t i = 0; i < queries.size(); ++i)
+                max_ratio = std::max(max_ratio, std::get<0>(p.locate_point_approx(queries[i], eps)) / exact[i]);
+            std::cout << "eps = " << eps << ": " << t << " us, max dist ratio " << max_ratio << "\n";
+        }
+        std::cout << "\n";
+    }
+
+    // coarse-to-fine pyramid search on a dense polyline
+    void bench_pyramid(Polyline& p, std::vector<Point3>& queries)
+    {
+        auto start = std::chrono::steady_clock::now();
+        p.build_pyramid(0.25);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Pyramid search, construction: " << elapsed.count() << " s\n";
+
+        std::cout << "octree (eps = 0): " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        for (double tol : { 0., 0.5, 2., 8. })
+            std::cout << "tolerance = " << tol << ": " << time_queries([&](Point3& P) { p.locate_point_coarse(P, tol); }, queries) << " us\n";
+        std::cout << "\n";
+    }
+
+    // hash grid versus octree, for queries close to the polyline and for uniform ones
+    void bench_hash_grid(std::vector<Point3>& points, Polyline& p, std::vector<Point3>& queries)
+    {
+        auto start = std::chrono::steady_clock::now();
+        Polyline p_grid(points, IndexType::HASH_GRID);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Hash grid, construction (with octree): " << elapsed.count() << " s\n";
+
+        std::mt19937 re(8);
+        std::uniform_real_distribution<double> noise(-2., 2.);
+        std::vector<Point3> near_queries(queries.size());
+        for (size_t i = 0; i < near_queries.size(); ++i)
+            near_queries[i] = points[i * 7919 % points.size()] + Point3{ noise(re), noise(re), noise(re) };
+        // ring search is slow far from the polyline, so fewer uniform queries
+        std::vector<Point3> far_queries(queries.begin(), queries.begin() + std::min(queries.size(), size_t(100)));
+        // above the topmost vertex, outside the grid
+        Point3 top = *std::max_element(points.begin(), points.end(), [](auto& a, auto& b) { return a.z < b.z; });
+        std::vector<Point3> outside_queries(100);
+        for (size_t i = 0; i < outside_queries.size(); ++i)
+            outside_queries[i] = top + Point3{ noise(re), noise(re), 2. + double(i) };
+
+        std::cout << "near queries, octree: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, near_queries)
+            << " us, hash grid: " << time_queries([&](Point3& P) { p_grid.locate_point(P); }, near_queries) << " us\n";
+        std::cout << "uniform queries, octree: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, far_queries)
+            << " us, hash grid: " << time_queries([&](Point3& P) { p_grid.locate_point(P); }, far_queries) << " us\n";
+        std::cout << "queries outside the bounds, octree: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, outside_queries)
+            << " us, hash grid: " << time_queries([&](Point3& P) { p_grid.locate_point(P); }, outside_queries) << " us\n";
+        std::cout << "\n";
+    }
+
+    // single query latency versus number of threads
+    void bench_parallel(Polyline& p, std::vector<Point3>& queries)
+    {
+        std::cout << "Parallel search:\n";
+        std::cout << "serial: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        for (size_t n_threads = 1; n_threads <= std::thread::hardware_concurrency(); n_threads *= 2)
+        {
+            p.enable_parallel(n_threads);
+            std::cout << n_threads << " threads: " << time_queries([&](Point3& P) { p.locate_point_parallel(P); }, queries) << " us\n";
+        }
+        std::cout << "\n";
+    }
+
+    void print_memory(const MemoryUsage& usage)
+    {
+        std::cout << "vertices " << usage.vertices << ", nodes " << usage.nodes << ", node lists " << usage.node_lists
+            << ", segments " << usage.segments << ", total " << usage.total() << " bytes\n";
+    }
+
+    // memory and query time before and after compaction
+    void bench_compact(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        Polyline p(points);
+        std::cout << "Compaction:\nbuilt: ";
+        print_memory(p.memory_usage());
+        std::cout << "query " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        p.compact();
+        std::cout << "compacted: ";
+        print_memory(p.memory_usage());
+        std::cout << "query " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n\n";
+    }
+
+    // batch chainage to point lookups, sorted and random
+    void bench_points_at(Polyline& p)
+    {
+        std::mt19937 re(9);
+        std::uniform_real_distribution<double> unif(0., p.length());
+        std::vector<double> chainages(4000000);
+        for (auto& c : chainages)
+            c = unif(re);
+        std::cout << "Batch point at chainage, " << chainages.size() << " chainages:\n";
+        for (int sorted = 0; sorted < 2; ++sorted)
+        {
+            if (sorted)
+                std::sort(chainages.begin(), chainages.end());
+            auto start = std::chrono::steady_clock::now();
+            p.points_at(chainages);
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << (sorted ? "sorted: " : "random: ") << elapsed.count() / chainages.size() << " ns per point\n";
+        }
+        std::cout << "\n";
+    }
+
+    template<typename Policy>
+    void bench_tree(const std::string& name, std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        auto start = std::chrono::steady_clock::now();
+        SpatialTree<Policy> tree(points);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << name << ": construction " << elapsed.count() << " s, " << tree.memory() << " bytes, depth " << tree.get_depth()
+            << ", query " << time_queries([&](Point3& P) { tree.locate_point(P); }, queries) << " us\n";
+    }
+
+    // explicit instantiations of the flat policy tree, on the spatial and on a planar copy of the polyline
+    void bench_policy_trees(std::vector<Point3>& points, Polyline& p, std::vector<Point3>& queries)
+    {
+        std::vector<Point3> planar = points;
+        for (auto& pt : planar)
+            pt.z = 0.;
+        for (auto* pts : { &points, &planar })
+        {
+            std::vector<Point3> pts_queries = queries;
+            if (pts == &planar)
+                for (auto& q : pts_queries)
+                    q.z = 0.;
+            std::cout << (pts == &points ? "Policy trees, spatial polyline:\n" : "Policy trees, planar polyline:\n");
+            if (pts == &points)
+                std::cout << "octree (eps = 0): " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+            bench_tree<TreePolicy<double, 8, 3>>("double, 8, 3D", *pts, pts_queries);
+            bench_tree<TreePolicy<double, 16, 3>>("double, 16, 3D", *pts, pts_queries);
+            bench_tree<TreePolicy<float, 16, 3>>("float, 16, 3D", *pts, pts_queries);
+            // a quadtree does not prune along z, so it is for planar polylines only
+            if (pts == &planar)
+            {
+                bench_tree<TreePolicy<double, 8, 2>>("double, 8, 2D", *pts, pts_queries);
+                bench_tree<TreePolicy<float, 16, 2>>("float, 16, 2D", *pts, pts_queries);
+            }
+        }
+        std::cout << "\n";
+    }
+
+    // out-of-core queries versus page size, with the budget of a tenth of the vertices
+    void bench_paged(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        std::string filename = (std::filesystem::temp_directory_path() / "bench_paged_polyline.bin").string();
+        std::vector<Point3> some_queries(queries.begin(), queries.begin() + std::min(queries.size(), size_t(1000)));
+        std::cout << "Paged polyline, budget " << points.size() * sizeof(Point3) / 10 << " bytes:\n";
+        for (size_t page_vertices : { 1024, 4096, 16384 })
+        {
+            PagedFileWriter::write(points, filename, page_vertices);
+            PagedPolyline paged(filename, points.size() * sizeof(Point3) / 10);
+            double t = time_queries([&](Point3& P) { paged.locate_point(P); }, some_queries);
+            auto stats = paged.page_stats();
+            std::cout << page_vertices << " vertices per page: " << t << " us, hit rate " << stats.hit_rate()
+                << ", " << double(stats.bytes_read) / some_queries.size() << " bytes read per query\n";
+        }
+        std::filesystem::remove(filename);
+        std::cout << "\n";
+    }
+
+    // compression ratio and query time versus quantization step
+    void bench_compressed(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        std::cout << "Compressed polyline, " << points.size() * sizeof(Point3) << " bytes of vertices:\n";
+        for (double quantum : { 1e-6, 1e-4, 1e-2 })
+        {
+            auto start = std::chrono::steady_clock::now();
+            CompressedPolyline compressed(points, quantum);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "quantum " << quantum << ": construction " << elapsed.count() << " s, " << compressed.memory() << " bytes (x"
+                << double(points.size() * sizeof(Point3)) / compressed.memory() << "), query "
+                << time_queries([&](Point3& P) { compressed.locate_point(P); }, queries) << " us\n";
+        }
+        std::cout << "\n";
+    }
+
+    // per-frame cost of moving all the vertices, against the construction
+    void bench_update_vertices(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        auto start = std::chrono::steady_clock::now();
+        Polyline p(points);
+        std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+        std::cout << "Update vertices, construction: " << build.count() << " s\n";
+
+        std::vector<Point3> frame(points.size());
+        for (size_t f = 1; f <= 3; ++f)
+        {
+            for (size_t i = 0; i < points.size(); ++i)
+                frame[i] = points[i] + Point3{ 0.2 * std::sin(0.001 * i + f), 0.2 * std::cos(0.001 * i + f), 0. };
+            start = std::chrono::steady_clock::now();
+            size_t rebuilt = p.update_vertices(frame);
+            std::chrono::duration<double> update = std::chrono::steady_clock::now() - start;
+            std::cout << "frame " << f << ": " << update.count() << " s, " << rebuilt << " subtrees rebuilt, query "
+                << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        }
+        std::cout << "\n";
+    }
+
+    // exact search over dense leaves: with the box blocks (locate_point) against the branch-and-bound search
+    // computing the distance of every segment of the visited nodes (locate_point_approx, eps = 0)
+    void bench_box_blocks(std::vector<Point3>& points, Polyline& p, std::vector<Point3>& queries)
+    {
+        std::mt19937 re(10);
+        std::uniform_real_distribution<double> noise(-2., 2.);
+        std::vector<Point3> near_queries(queries.size());
+        for (size_t i = 0; i < near_queries.size(); ++i)
+            near_queries[i] = points[i * 7919 % points.size()] + Point3{ noise(re), noise(re), noise(re) };
+
+        std::cout << "Leaf box blocks:\n";
+        std::cout << "uniform queries, blocks: " << time_queries([&](Point3& P) { p.locate_point(P); }, queries)
+            << " us, every segment: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        std::cout << "near queries, blocks: " << time_queries([&](Point3& P) { p.locate_point(P); }, near_queries)
+            << " us, every segment: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, near_queries) << " us\n\n";
+    }
+
+    // generation and writing speed, and the octree and the flat tree on every model
+    void bench_models(size_t N_points, size_t N_queries)
+    {
+        std::cout << "Generator models, " << N_points << " points:\n";
+        std::string filename = (std::filesystem::temp_directory_path() / "bench_generator").string();
+        for (auto [model, name] : std::vector<std::pair<GeneratorModel, std::string>>{ { GeneratorModel::UNIFORM, "uniform" },
+            { GeneratorModel::RANDOM_WALK, "walk" }, { GeneratorModel::CLUSTERED_TRACKS, "tracks" }, { GeneratorModel::HELIX, "helix" },
+            { GeneratorModel::ROAD_GRID, "roads" }, { GeneratorModel::DUPLICATES, "duplicates" } })
+        {
+            GeneratorParams params;
+            params.model = model;
+            params.n_points = N_points;
+            params.scale = model == GeneratorModel::UNIFORM ? 100. : 1.;
+            auto start = std::chrono::steady_clock::now();
+            auto points = PolylineGenerator(params).generate();
+            std::chrono::duration<double> generated = std::chrono::steady_clock::now() - start;
+            PolylineGenerator::write_text(points, filename + ".txt");
+            std::chrono::duration<double> text = std::chrono::steady_clock::now() - start - generated;
+            PolylineGenerator::write_binary(points, filename + ".bin");
+            std::chrono::duration<double> binary = std::chrono::steady_clock::now() - start - generated - text;
+
+            // queries around the vertices, few of them since the uniform model is slow for any tree
+            std::mt19937 re(10);
+            std::uniform_real_distribution<double> noise(-2. * params.scale, 2. * params.scale);
+            std::vector<Point3> queries(std::min(N_queries, size_t(200)));
+            for (size_t i = 0; i < queries.size(); ++i)
+                queries[i] = points[i * 7919 % points.size()] + Point3{ noise(re), noise(re), noise(re) };
+            std::vector<Point3> copy = points;
+            Polyline p(points);
+            SpatialTree<FlatOctree> tree(copy);
+            std::cout << name << ": generation " << generated.count() << " s, text " << text.count() << " s, binary " << binary.count()
+                << " s, octree " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries)
+                << " us, flat tree " << time_queries([&](Point3& P) { tree.locate_point(P); }, queries) << " us\n";
+        }
+        std::filesystem::remove(filename + ".txt");
+        std::filesystem::remove(filename + ".bin");
+        std::cout << "\n";
+    }
+
+    // throughput of a dense query batch: independent queries against packets of different sizes
+    void bench_packets(std::vector<Point3>& points, Polyline& p, size_t N_queries)
+    {
+        std::mt19937 re(11);
+        std::uniform_real_distribution<double> noise(-3., 3.);
+        std::vector<Point3> queries(N_queries * 10);
+        for (auto& q : queries)
+            q = points[re() % points.size()] + Point3{ noise(re), noise(re), noise(re) };
+
+        std::cout << "Packet search, " << queries.size() << " dense queries:\n";
+        std::cout << "independent: " << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        for (size_t packet : { 1, 4, 8, 16 })
+        {
+            auto start = std::chrono::steady_clock::now();
+            p.locate_points(queries, packet);
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "packets of " << packet << ": " << elapsed.count() / queries.size() << " us\n";
+        }
+        std::cout << "\n";
+    }
+
+    // distance field over a working volume in the middle of the polyline: build cost, memory, lookups against the index
+    void bench_distance_field(std::vector<Point3>& points, Polyline& p, size_t N_queries)
+    {
+        Point3 c = points[points.size() / 2];
+        AABBox box{ c - Point3{ 4., 4., 4. }, c + Point3{ 4., 4., 4. } };
+        std::mt19937 re(12);
+        std::uniform_real_distribution<double> unif(-4., 4.);
+        std::vector<Point3> queries(N_queries);
+        for (auto& q : queries)
+            q = c + Point3{ unif(re), unif(re), unif(re) };
+
+        std::cout << "Distance field over a box of 8, octree: "
+            << time_queries([&](Point3& P) { p.locate_point_approx(P, 0.); }, queries) << " us\n";
+        for (double tolerance : { 0.5, 0.25 })
+        {
+            DistanceFieldParams params;
+            params.tolerance = tolerance;
+            params.band = 1.;
+            params.max_error = 2.;
+            auto start = std::chrono::steady_clock::now();
+            p.build_distance_field(box, params);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "tolerance " << tolerance << ": construction " << elapsed.count() << " s, interpolation "
+                << time_queries([&](Point3& P) { p.field_distance(P); }, queries) << " us, exact "
+                << time_queries([&](Point3& P) { p.locate_point_field(P); }, queries) << " us\n";
+        }
+        std::cout << "\n";
+    }
+
+    // copy-on-write updates against reindexing, snapshot queries alone and racing with a writer
+    void bench_versioned(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        VersionedPolyline vp(points);
+        std::cout << "Versioned polyline:\n";
+        for (size_t n : { 1, 64, 1024 })
+        {
+            std::vector<Point3> moved(points.begin() + points.size() / 2, points.begin() + points.size() / 2 + n);
+            for (auto& v : moved)
+                v = v + Point3{ 0.1, 0., 0. };
+            auto start = std::chrono::steady_clock::now();
+            vp.update_vertices(points.size() / 2, moved);
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "update of " << n << " vertices: " << elapsed.count() << " us\n";
+        }
+        auto start = std::chrono::steady_clock::now();
+        vp.reindex();
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "reindex: " << elapsed.count() << " us\n";
+
+        VersionedPolyline::Reader reader(vp);
+        std::cout << "query: " << time_queries([&](Point3& P) { reader.pin()->locate_point(P); }, queries) << " us\n";
+        std::atomic<bool> done{ false };
+        std::atomic<size_t> updates{ 0 };
+        std::thread writer([&]() {
+            std::vector<Point3> moved(points.begin(), points.begin() + 64);
+            for (size_t k = 0; !done.load(); ++k, ++updates)
+            {
+                size_t first = k * 7919 % (points.size() - moved.size());
+                std::copy(points.begin() + first, points.begin() + first + moved.size(), moved.begin());
+                vp.update_vertices(first, moved);
+            }
+            });
+        std::cout << "query with a writer: " << time_queries([&](Point3& P) { reader.pin()->locate_point(P); }, queries) << " us";
+        done = true;
+        writer.join();
+        std::cout << " (" << updates.load() << " updates meanwhile)\n\n";
+    }
+
+    // tie policies on random queries (no ties, the double filter alone) and on vertices (ties, refined in double-double)
+    void bench_ties(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        std::vector<Point3> vertices;
+        for (size_t i = 1; vertices.size() < queries.size() && i + 1 < points.size(); i += 7)
+            vertices.push_back(points[i]);
+        std::cout << "Tie policies (random queries / vertices):\n";
+        for (auto [name, policy] : { std::make_pair("absolute eps (default)", TiePolicy{}), std::make_pair("64 ulps", TiePolicy::ulps(64.)),
+            std::make_pair("relative 1e-9", TiePolicy::relative_to(1e-9)), std::make_pair("exact", TiePolicy::exact()) })
+        {
+            for (auto index : { IndexType::OCTREE, IndexType::FLAT_OCTREE })
+            {
+                Polyline p(points, index);
+                p.set_tie_policy(policy);
+                std::cout << name << (index == IndexType::OCTREE ? ", octree: " : ", flat octree: ")
+                    << time_queries([&](Point3& P) { p.locate_point(P); }, queries) << " / "
+                    << time_queries([&](Point3& P) { p.locate_point(P); }, vertices) << " us\n";
+            }
+        }
+        std::cout << "\n";
+    }
+
+    // query service: throughput and mean latency of the queries of two producers,
+    // for flushes on every query, on small batches and on large batches
+    void bench_query_service(Polyline& p, std::vector<Point3>& queries)
+    {
+        std::cout << "Query service (2 producers):\n";
+        for (auto [max_batch, delay] : { std::make_pair(size_t(1), 0), std::make_pair(size_t(16), 100), std::make_pair(size_t(256), 1000) })
+        {
+            std::atomic<double> latency{ 0. };
+            size_t batches = 0;
+            auto start = std::chrono::steady_clock::now();
+            {
+                QueryServiceParams params;
+                params.max_batch = max_batch;
+                params.max_delay = std::chrono::microseconds(delay);
+                QueryService service(p, params);
+                auto produce = [&](size_t first)
+                {
+                    for (size_t i = first; i < queries.size(); i += 2)
+                        service.submit(queries[i], [&latency, submitted = std::chrono::steady_clock::now()](QueryService::Result&&) {
+                            latency.fetch_add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - submitted).count());
+                            });
+                };
+                std::thread t1(produce, 0), t2(produce, 1);
+                t1.join();
+                t2.join();
+                batches = service.batches_count();
+            }
+            std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "batch " << max_batch << ", delay " << delay << " us: " << elapsed.count() / queries.size()
+                << " us per query, latency " << latency.load() / queries.size() << " us, " << batches << " batches\n";
+        }
+        std::cout << "\n";
+    }
+
+    // shared index: building into the segment against attaching to it, queries against the own flat octree
+    void bench_shared_index(std::vector<Point3>& points, std::vector<Point3>& queries)
+    {
+        std::string name = "tt_shared_index_bench_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+        std::cout << "Shared index:\n";
+        auto start = std::chrono::steady_clock::now();
+        SharedIndex builder(name, points);
+        std::chrono::duration<double, std::milli> built = std::chrono::steady_clock::now() - start;
+        start = std::chrono::steady_clock::now();
+        SharedIndex reader(name);
+        std::chrono::duration<double, std::milli> attached = std::chrono::steady_clock::now() - start;
+        std::cout << "build: " << built.count() << " ms, attach: " << attached.count() << " ms, segment: "
+            << builder.size() / 1024 / 1024 << " MB\n";
+
+        Polyline flat(points, IndexType::FLAT_OCTREE);
+        std::cout << "query, own flat octree: " << time_queries([&](Point3& P) { flat.locate_point(P); }, queries) << " us\n";
+        std::cout << "query, attached: " << time_queries([&](Point3& P) { reader.locate_point(P); }, queries) << " us\n\n";
+    }
+
+    int run_benchmarks(size_t N_points, size_t N_queries)
+    {
+        std::cout << "Random walk polyline of " << N_points << " points\n";
+        std::vector<Point3> points = random_walk(N_points, 1., 42);
+        Polyline p(points);
+
+        double span = p.get_max_span();
+        std::mt19937 re(7);
+        std::uniform_real_distribution<double> unif(-0.5 * span, 0.5 * span);
+        std::vector<Point3> queries(N_queries);
+        for (auto& q : queries)
+            q = Point3{ unif(re), unif(re), unif(re) };
+
+        bench_approx(p, queries);
+        bench_pyramid(p, queries);
+        bench_hash_grid(points, p, queries);
+        bench_parallel(p, queries);
+        bench_compact(points, queries);
+        bench_packets(points, p, N_queries);
+        bench_distance_field(points, p, N_queries);
+        bench_versioned(points, queries);
+        bench_ties(points, queries);
+        bench_box_blocks(points, p, queries);
+        bench_query_service(p, queries);
+        bench_shared_index(points, queries);
+        bench_points_at(p);
+        bench_policy_trees(points, p, queries);
+        bench_paged(points, queries);
+        bench_compressed(points, queries);
+        bench_update_vertices(points, queries);
+        bench_models(N_points, N_queries);
+        return EXIT_SUCCESS;
+    }
+}
+
+///____________________________________________________________________________________
+
+int main(int argc, char** argv)
+{
+    std::filesystem::path cwd = std::filesystem::current_path();
+    std::cout << cwd.string();
+    int test = -1;
+    InputParser input(argc, argv);
+    // option t to run tests
+    if (input.cmdOptionExists("t"))
+    {
+        test = std::atoi(input.getCmdOption("t").c_str());
+        std::cout << "Runnig tests \n\n";
+        tests::run_tests();
+    }
+    else
+    {
+        // option b to run benchmarks on a random walk polyline
+        if (input.cmdOptionExists("b"))
+        {
+            size_t N = std::atoi(input.getCmdOption("b").c_str());
+            return benchmarks::run_benchmarks(N > 1 ? N : 1000000, 10000);
+        }
+        // option v to validate the indexes against greedy search on generated polylines
+        if (input.cmdOptionExists("v"))
+        {
+            ValidationParams params;
+            size_t N = std::atoi(input.getCmdOption("v").c_str());
+            if (N > 0)
+                params.n_queries = N;
+            std::cout << "Enter number of points of generated polylines and seed:\n";
+            std::cin >> params.n_points;
+            std::cin >> params.seed;
+            ValidationReport report = Validator(params).run(&std::cout);
+            for (size_t k = 0; k < QUERY_KINDS; ++k)
+                std::cout << Validator::kind_name(QueryKind(k)) << ": " << report.failed[k] << " of " << report.queries[k] << " queries failed\n";
+            for (size_t i = 0; i < report.failures.size(); ++i)
+            {
+                // the polyline of the failure may be loaded back in the interactive mode
+                std::string filename = "validation_failure_" + std::to_string(i) + ".txt";
+                Validator::write_failure(report.failures[i], std::cout);
+                PolylineGenerator::write_text(report.failures[i].points, filename);
+                std::cout << "polyline written to " << filename << "\n";
+            }
+            return report.total_failed() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
         // option g to generate test file
         if (input.cmdOptionExists("g"))
         {
-            size_t N;
-            double min = 0, max = 0;
+            GeneratorParams params;
+            std::string model;
+            std::cout << "Enter model of generated polyline (uniform, walk, tracks, helix, roads, duplicates):\n";
+            std::cin >> model;
+            params.model = PolylineGenerator::model_from_name(model);
             std::cout << "Enter number of points generated polyline:\n";
-            std::cin >> N;
-            std::cout << "Enter lower and upper bounds for point coordinates:\n";
-            std::cin >> min;
-            std::cin >> max;
+            std::cin >> params.n_points;
+            std::cout << "Enter scale (step length, radius or half-size of the box) and seed:\n";
+            std::cin >> params.scale;
+            std::cin >> params.seed;
             std::string filename;
-            std::cout << "Enter name of .txt file for generated polyline:\n";
+            std::cout << "Enter name of .txt (or binary .bin) file for generated polyline:\n";
             std::cin >> filename;
             std::cout << "Generating polyline...\n";
-            generate_points(N, min, max, filename);
+            auto points = PolylineGenerator(params).generate();
+            if (std::filesystem::path(filename).extension() == ".bin")
+                PolylineGenerator::write_binary(points, filename);
+            else
+                PolylineGenerator::write_text(points, filename);
             return EXIT_SUCCESS;
         }
         return user_cycle(clean_run);
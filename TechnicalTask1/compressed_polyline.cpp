@@ -0,0 +1,218 @@
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <queue>
+#include "compressed_polyline.h"
+#include "polyline.h"
+
+template<class D>
+static void append_deltas(std::vector<uint8_t>& data, const int64_t* q, size_t n)
+{
+	for (size_t i = 1; i < n; ++i)
+	{
+		D d = D(q[i] - q[i - 1]);
+		size_t pos = data.size();
+		data.resize(pos + sizeof(D));
+		std::memcpy(data.data() + pos, &d, sizeof(D));
+	}
+}
+
+// plain loop over a packed array, left to the compiler to vectorize the loads and the widening
+template<class D>
+static void prefix_sum(const uint8_t* src, size_t n, int64_t base, int64_t* out)
+{
+	std::array<D, CompressedPolyline::BLOCK> d;
+	std::memcpy(d.data(), src, (n - 1) * sizeof(D));
+	out[0] = base;
+	for (size_t i = 1; i < n; ++i)
+		out[i] = out[i - 1] + d[i - 1];
+}
+
+CompressedPolyline::CompressedPolyline(const std::vector<Point3>& points, double quantum) : n_points(points.size()), quantum(quantum)
+{
+	if (points.size() < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	if (!(quantum > 0))
+		throw std::runtime_error("Quantization step must be positive!");
+
+	origin = points[0];
+	for (auto& p : points)
+		origin = Point3{ std::min(origin.x, p.x), std::min(origin.y, p.y), std::min(origin.z, p.z) };
+
+	std::array<std::array<int64_t, BLOCK + 1>, 3> q;
+	size_t n_blocks = (n_points - 2) / BLOCK + 1;
+	blocks.reserve(n_blocks);
+	levels.emplace_back();
+	levels[0].reserve(n_blocks);
+	for (size_t b = 0; b < n_blocks; ++b)
+	{
+		size_t n = block_vertices(b);
+		int64_t max_delta = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto& p = points[b * BLOCK + i];
+			q[0][i] = std::llround((p.x - origin.x) / quantum);
+			q[1][i] = std::llround((p.y - origin.y) / quantum);
+			q[2][i] = std::llround((p.z - origin.z) / quantum);
+			for (size_t a = 0; a < 3; ++a)
+				if (i > 0)
+					max_delta = std::max(max_delta, std::abs(q[a][i] - q[a][i - 1]));
+		}
+		if (max_delta > std::numeric_limits<int32_t>::max())
+			throw std::runtime_error("Quantization step is too small for the segment lengths!");
+		if (data.size() > std::numeric_limits<uint32_t>::max())
+			throw std::runtime_error("Too many vertices for the compressed store!");
+
+		Block block{ uint32_t(data.size()), 4, { q[0][0], q[1][0], q[2][0] } };
+		if (max_delta <= std::numeric_limits<int8_t>::max())
+			block.width = 1;
+		else if (max_delta <= std::numeric_limits<int16_t>::max())
+			block.width = 2;
+		for (size_t a = 0; a < 3; ++a)
+		{
+			if (block.width == 1)
+				append_deltas<int8_t>(data, q[a].data(), n);
+			else if (block.width == 2)
+				append_deltas<int16_t>(data, q[a].data(), n);
+			else
+				append_deltas<int32_t>(data, q[a].data(), n);
+		}
+		blocks.push_back(block);
+
+		// box of the decoded vertices
+		std::array<double, 3> lo, hi;
+		for (size_t a = 0; a < 3; ++a)
+		{
+			auto [q_lo, q_hi] = std::minmax_element(q[a].begin(), q[a].begin() + n);
+			lo[a] = double(*q_lo) * quantum;
+			hi[a] = double(*q_hi) * quantum;
+		}
+		AABBox box{ origin + Point3{ lo[0], lo[1], lo[2] }, origin + Point3{ hi[0], hi[1], hi[2] } };
+		levels[0].push_back(box);
+	}
+	data.shrink_to_fit();
+
+	while (levels.back().size() > 1)
+	{
+		auto& lower = levels.back();
+		std::vector<AABBox> upper((lower.size() + 1) / 2);
+		for (size_t i = 0; i < upper.size(); ++i)
+		{
+			upper[i] = lower[2 * i];
+			if (2 * i + 1 < lower.size())
+			{
+				auto& r = lower[2 * i + 1];
+				upper[i].lMin = Point3{ std::min(upper[i].lMin.x, r.lMin.x), std::min(upper[i].lMin.y, r.lMin.y), std::min(upper[i].lMin.z, r.lMin.z) };
+				upper[i].rMax = Point3{ std::max(upper[i].rMax.x, r.rMax.x), std::max(upper[i].rMax.y, r.rMax.y), std::max(upper[i].rMax.z, r.rMax.z) };
+			}
+		}
+		levels.push_back(std::move(upper));
+	}
+}
+
+void CompressedPolyline::decode_ints(size_t b, std::array<std::array<int64_t, BLOCK + 1>, 3>& q) const
+{
+	const Block& block = blocks[b];
+	size_t n = block_vertices(b);
+	for (size_t a = 0; a < 3; ++a)
+	{
+		const uint8_t* src = data.data() + block.offset + a * (n - 1) * block.width;
+		if (block.width == 1)
+			prefix_sum<int8_t>(src, n, block.base[a], q[a].data());
+		else if (block.width == 2)
+			prefix_sum<int16_t>(src, n, block.base[a], q[a].data());
+		else
+			prefix_sum<int32_t>(src, n, block.base[a], q[a].data());
+	}
+}
+
+void CompressedPolyline::decode_block(size_t b, std::vector<Point3>& out) const
+{
+	std::array<std::array<int64_t, BLOCK + 1>, 3> q;
+	decode_ints(b, q);
+	size_t n = block_vertices(b);
+	out.resize(n);
+	for (size_t i = 0; i < n; ++i)
+		out[i] = origin + Point3{ double(q[0][i]), double(q[1][i]), double(q[2][i]) } * quantum;
+}
+
+Point3 CompressedPolyline::vertex(size_t i) const
+{
+	if (i >= n_points)
+		throw std::runtime_error("Vertex id is out of range!");
+	// the last vertex is stored only as the end of the last block
+	size_t b = std::min(i / BLOCK, blocks.size() - 1);
+	std::vector<Point3> v;
+	decode_block(b, v);
+	return v[i - b * BLOCK];
+}
+
+std::vector<Point3> CompressedPolyline::decode() const
+{
+	std::vector<Point3> points;
+	points.reserve(n_points);
+	std::vector<Point3> v;
+	for (size_t b = 0; b < blocks.size(); ++b)
+	{
+		decode_block(b, v);
+		// the first vertex of a block is the last one of the previous block
+		points.insert(points.end(), v.begin() + (b > 0), v.end());
+	}
+	return points;
+}
+
+size_t CompressedPolyline::memory() const
+{
+	size_t boxes = 0;
+	for (auto& l : levels)
+		boxes += l.capacity();
+	return blocks.capacity() * sizeof(Block) + data.capacity() + boxes * sizeof(AABBox);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> CompressedPolyline::locate_point(Point3& p)
+{
+	size_t top = levels.size() - 1;
+	auto& root = levels[top][0];
+	double scale = std::max({ std::abs(root.lMin.x), std::abs(root.lMin.y), std::abs(root.lMin.z),
+		std::abs(root.rMax.x), std::abs(root.rMax.y), std::abs(root.rMax.z) });
+	// the candidates are copied, so the decode buffer may be reused for the next block
+	ClosestSegments closest(ties, p, scale);
+	auto may_reach = [&](double lb) { return closest.may_reach(lb); };
+
+	// {lower bound, level, index}, nearest first
+	using Entry = std::tuple<double, size_t, size_t>;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+	queue.push(Entry{ root.euc_dist(p), top, 0 });
+
+	std::vector<Point3> v;
+	v.reserve(BLOCK + 1);
+	while (!queue.empty())
+	{
+		auto [lb, level, idx] = queue.top();
+		queue.pop();
+		if (!may_reach(lb))
+			break;
+
+		if (level > 0)
+		{
+			for (size_t c = 2 * idx; c < std::min(2 * idx + 2, levels[level - 1].size()); ++c)
+			{
+				double c_lb = levels[level - 1][c].euc_dist(p);
+				if (may_reach(c_lb))
+					queue.push(Entry{ c_lb, level - 1, c });
+			}
+			continue;
+		}
+
+		decode_block(idx, v);
+		for (size_t j = 0; j + 1 < v.size(); ++j)
+		{
+			size_t id = idx * BLOCK + j;
+			auto [d, p_proj] = Segment{ &v[j], &v[j + 1], id }.euc_dist(p);
+			closest.add(d, &v[j], &v[j + 1], id, p_proj);
+		}
+	}
+
+	return closest.resolve();
+}
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef COMPRESSED_POLYLINE_H
+#define COMPRESSED_POLYLINE_H
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+#include "octree_item.h"
+#include "tie_policy.h"
+
+// Polyline with compressed vertex storage:
+// coordinates are quantized to the grid of step quantum and stored in blocks of BLOCK segments,
+// each block is {base vertex, deltas of the following vertices} with the deltas packed into 8, 16 or 32 bits
+// (the smallest width holding all the deltas of the block), x deltas first, then y, then z;
+// block boxes form a binary tree used as the index, queries decode only the blocks they reach
+// results are exact for the decoded vertices, which are within quantum / 2 of the original ones (per coordinate)
+class CompressedPolyline
+{
+public:
+	static constexpr size_t BLOCK = 64;
+
+	CompressedPolyline(const std::vector<Point3>& points, double quantum);
+
+	// Best-first search over the block boxes
+	// returns:
+	//		mininmum distance,
+	//		ids of the closest segments,
+	//		projections onto closest segments
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p);
+
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+	size_t size() const { return n_points; }
+	Point3 vertex(size_t i) const;
+	std::vector<Point3> decode() const;
+	// vertices [b * BLOCK, b * BLOCK + BLOCK] (the last block may be shorter)
+	void decode_block(size_t b, std::vector<Point3>& out) const;
+
+	double get_quantum() const { return quantum; }
+	size_t blocks_count() const { return blocks.size(); }
+	const AABBox& block_bounds(size_t b) const { return levels[0][b]; }
+	size_t memory() const;
+
+private:
+	struct Block
+	{
+		// offset of the deltas in data
+		uint32_t offset;
+		uint8_t width;
+		std::array<int64_t, 3> base;
+	};
+
+	size_t n_points;
+	double quantum;
+	Point3 origin;
+	std::vector<Block> blocks;
+	std::vector<uint8_t> data;
+	// levels[0] - block boxes, levels[l][i] - union of levels[l - 1][2i] and levels[l - 1][2i + 1]
+	std::vector<std::vector<AABBox>> levels;
+	TiePolicy ties;
+
+	size_t block_vertices(size_t b) const { return std::min(BLOCK, n_points - 1 - b * BLOCK) + 1; }
+	// quantized coordinates of the block vertices, relative to origin, in units of quantum
+	void decode_ints(size_t b, std::array<std::array<int64_t, BLOCK + 1>, 3>& q) const;
+};
+
+#endif
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <unordered_map>
+#include "distance_field.h"
+#include "polyline.h"
+
+// lattice points are keyed by 21 bits per coordinate
+static const size_t KEY_BITS = 21;
+
+static uint64_t lattice_key(uint64_t ix, uint64_t iy, uint64_t iz)
+{
+	return ix | iy << KEY_BITS | iz << (2 * KEY_BITS);
+}
+
+DistanceField::DistanceField(Polyline& polyline, std::vector<Point3>& points, const AABBox& box, const DistanceFieldParams& params,
+	TaskPool* pool) : points(points), bounds(box), size(box.rMax - box.lMin), ties(polyline.get_tie_policy())
+{
+	if (!(size.x >= 0 && size.y >= 0 && size.z >= 0))
+		throw std::runtime_error("Distance field box is empty!");
+	if (!(params.tolerance > 0))
+		throw std::runtime_error("Distance field tolerance must be positive!");
+	if (params.max_depth + 1 > KEY_BITS)
+		throw std::runtime_error("Distance field depth must not exceed 20!");
+
+	scale = std::max({ std::abs(box.lMin.x), std::abs(box.lMin.y), std::abs(box.lMin.z),
+		std::abs(box.rMax.x), std::abs(box.rMax.y), std::abs(box.rMax.z) });
+	for (auto& v : points)
+		scale = std::max({ scale, std::abs(v.x), std::abs(v.y), std::abs(v.z) });
+	const double error = ClosestSegments::ERROR_ULPS * std::numeric_limits<double>::epsilon() * scale;
+
+	// lattice of the centers of the deepest cells: the corner of a depth-d cell (i, j, k) is (i, j, k) << (levels - d)
+	const size_t levels = params.max_depth + 1;
+	const double lattice_step = 1. / double(uint64_t(1) << levels);
+	auto lattice_point = [&](uint64_t ix, uint64_t iy, uint64_t iz)
+	{
+		return bounds.lMin + Point3{ size.x * double(ix) * lattice_step, size.y * double(iy) * lattice_step, size.z * double(iz) * lattice_step };
+	};
+
+	struct Cell
+	{
+		uint32_t node;
+		uint32_t i, j, k;
+		uint32_t depth;
+	};
+	std::unordered_map<uint64_t, double> samples;
+	std::vector<Cell> frontier{ Cell{ 0, 0, 0, 0, 0 } }, leaf_cells;
+	nodes.push_back(Node{ 0, 0 });
+
+	// level by level: the corners and the centers of the frontier cells are sampled in one batch,
+	// the centers of the split cells are the corners of their children
+	for (uint32_t d = 0; !frontier.empty(); ++d)
+	{
+		const size_t shift = levels - d;
+		std::vector<uint64_t> keys;
+		std::vector<Point3> queries;
+		auto request = [&](uint64_t ix, uint64_t iy, uint64_t iz)
+		{
+			uint64_t key = lattice_key(ix, iy, iz);
+			if (samples.emplace(key, 0.).second)
+			{
+				keys.push_back(key);
+				queries.push_back(lattice_point(ix, iy, iz));
+			}
+		};
+		for (auto& c : frontier)
+		{
+			for (uint64_t corner = 0; corner < 8; ++corner)
+				request(uint64_t(c.i + (corner & 1)) << shift, uint64_t(c.j + (corner >> 1 & 1)) << shift, uint64_t(c.k + (corner >> 2)) << shift);
+			request(uint64_t(2 * c.i + 1) << (shift - 1), uint64_t(2 * c.j + 1) << (shift - 1), uint64_t(2 * c.k + 1) << (shift - 1));
+		}
+		auto results = polyline.locate_points(queries);
+		for (size_t q = 0; q < keys.size(); ++q)
+			samples[keys[q]] = std::get<0>(results[q]);
+
+		const double half_diag = 0.5 * Vec3(size * std::ldexp(1., -int(d))).norm();
+		std::vector<Cell> next;
+		for (auto& c : frontier)
+		{
+			double center = samples[lattice_key(uint64_t(2 * c.i + 1) << (shift - 1), uint64_t(2 * c.j + 1) << (shift - 1),
+				uint64_t(2 * c.k + 1) << (shift - 1))];
+			double limit = center - half_diag < params.band ? params.tolerance : params.max_error;
+			if (d < params.max_depth && half_diag > limit)
+			{
+				nodes[c.node].child = uint32_t(nodes.size());
+				for (uint32_t idx = 0; idx < 8; ++idx)
+				{
+					next.push_back(Cell{ uint32_t(nodes.size()), 2 * c.i + (idx & 1), 2 * c.j + (idx >> 1 & 1), 2 * c.k + (idx >> 2), d + 1 });
+					nodes.push_back(Node{ 0, 0 });
+				}
+			}
+			else
+				leaf_cells.push_back(c);
+		}
+		max_level = d;
+		frontier = std::move(next);
+	}
+
+	// a closest segment s of a point x of the cell: dist(s, center) <= d(x) + half_diag <= d(center) + 2 half_diag
+	leaves.resize(leaf_cells.size());
+	std::vector<std::vector<SegmentPair>> candidates(leaf_cells.size());
+	auto fill_leaf = [&](size_t l)
+	{
+		auto& c = leaf_cells[l];
+		const size_t shift = levels - c.depth;
+		const double half_diag = 0.5 * Vec3(size * std::ldexp(1., -int(c.depth))).norm();
+		Leaf& leaf = leaves[l];
+		for (uint64_t corner = 0; corner < 8; ++corner)
+			leaf.corners[corner] = samples.at(lattice_key(uint64_t(c.i + (corner & 1)) << shift,
+				uint64_t(c.j + (corner >> 1 & 1)) << shift, uint64_t(c.k + (corner >> 2)) << shift));
+		leaf.error = half_diag;
+		leaf.count = NO_CANDIDATES;
+
+		uint64_t ix = uint64_t(2 * c.i + 1) << (shift - 1), iy = uint64_t(2 * c.j + 1) << (shift - 1), iz = uint64_t(2 * c.k + 1) << (shift - 1);
+		Point3 p = lattice_point(ix, iy, iz);
+		double r = samples.at(lattice_key(ix, iy, iz)) + 2. * half_diag;
+		// widened by the tie band (and the distance errors), the segments tied with the closest one are candidates too
+		leaf.radius = r + ties.tolerance(r) + 4. * error;
+		// a leaf with more candidates is not searched, so they are not enumerated either
+		candidates[l] = polyline.corridor(p, p, leaf.radius + 1e-9 * leaf.radius, params.max_candidates);
+	};
+	if (pool != nullptr)
+		pool->parallel_for(0, leaf_cells.size(), 16, fill_leaf);
+	else
+		for (size_t l = 0; l < leaf_cells.size(); ++l)
+			fill_leaf(l);
+
+	for (size_t l = 0; l < leaf_cells.size(); ++l)
+	{
+		nodes[leaf_cells[l].node].leaf = uint32_t(l);
+		if (candidates[l].empty() || candidates[l].size() > params.max_candidates)
+			continue;
+		leaves[l].first = uint32_t(ids.size());
+		leaves[l].count = uint32_t(candidates[l].size());
+		for (auto& h : candidates[l])
+			ids.push_back(uint32_t(h.id1));
+	}
+	nodes.shrink_to_fit();
+	ids.shrink_to_fit();
+}
+
+const DistanceField::Leaf& DistanceField::find_leaf(const Point3& q, Point3& t) const
+{
+	Point3 lo = bounds.lMin, s = size;
+	uint32_t node = 0;
+	while (nodes[node].child != 0)
+	{
+		s = s * 0.5;
+		Point3 mid = lo + s;
+		uint32_t idx = 0;
+		if (q.x >= mid.x) { idx |= 1; lo.x = mid.x; }
+		if (q.y >= mid.y) { idx |= 2; lo.y = mid.y; }
+		if (q.z >= mid.z) { idx |= 4; lo.z = mid.z; }
+		node = nodes[node].child + idx;
+	}
+	auto rel = [](double v, double low, double len) { return len > 0 ? std::clamp((v - low) / len, 0., 1.) : 0.; };
+	t = Point3{ rel(q.x, lo.x, s.x), rel(q.y, lo.y, s.y), rel(q.z, lo.z, s.z) };
+	return leaves[nodes[node].leaf];
+}
+
+FieldSample DistanceField::distance(const Point3& p) const
+{
+	Point3 q{ std::clamp(p.x, bounds.lMin.x, bounds.rMax.x), std::clamp(p.y, bounds.lMin.y, bounds.rMax.y),
+		std::clamp(p.z, bounds.lMin.z, bounds.rMax.z) };
+	Point3 t;
+	const Leaf& leaf = find_leaf(q, t);
+	auto& c = leaf.corners;
+	double x00 = c[0] + (c[1] - c[0]) * t.x, x10 = c[2] + (c[3] - c[2]) * t.x;
+	double x01 = c[4] + (c[5] - c[4]) * t.x, x11 = c[6] + (c[7] - c[6]) * t.x;
+	double y0 = x00 + (x10 - x00) * t.y, y1 = x01 + (x11 - x01) * t.y;
+	return FieldSample{ y0 + (y1 - y0) * t.z, leaf.error + p.euc_dist(q) };
+}
+
+bool DistanceField::locate_point(Point3& p, std::tuple<double, std::vector<size_t>, std::vector<Point3>>& result) const
+{
+	if (!bounds.is_inside(p))
+		return false;
+	Point3 t;
+	const Leaf& leaf = find_leaf(p, t);
+	if (leaf.count == NO_CANDIDATES)
+		return false;
+
+	ClosestSegments closest(ties, p, scale);
+	for (size_t k = leaf.first; k < leaf.first + leaf.count; ++k)
+	{
+		size_t id = ids[k];
+		auto [d, p_proj] = Segment{ &points[id], &points[id + 1], id }.euc_dist(p);
+		closest.add(d, &points[id], &points[id + 1], id, p_proj);
+	}
+	// p is within leaf.error of the cell center
+	if (closest.reach() + closest.error_bound() + leaf.error > leaf.radius)
+		return false;
+	result = closest.resolve();
+	return true;
+}
+
+size_t DistanceField::memory() const
+{
+	return sizeof(DistanceField) + nodes.capacity() * sizeof(Node) + leaves.capacity() * sizeof(Leaf) + ids.capacity() * sizeof(uint32_t);
+}
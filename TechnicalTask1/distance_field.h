@@ -0,0 +1,101 @@
+#pragma once
+#ifndef DISTANCE_FIELD_H
+#define DISTANCE_FIELD_H
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+#include "octree_item.h"
+#include "tie_policy.h"
+
+class Polyline;
+class TaskPool;
+
+struct DistanceFieldParams
+{
+	// max interpolation error inside the band
+	double tolerance = 0.01;
+	// cells are refined down to tolerance only where the distance may be below band,
+	// the rest stay as coarse as max_error allows
+	double band = std::numeric_limits<double>::infinity();
+	// max interpolation error outside the band
+	double max_error = std::numeric_limits<double>::infinity();
+	// candidate lists longer than this are not stored (exact queries of the cell go to the index)
+	size_t max_candidates = 256;
+	// at most 2^max_depth cells along an axis, max_depth <= 20
+	size_t max_depth = 10;
+};
+
+struct FieldSample
+{
+	double distance;
+	// |distance - exact distance| <= error
+	double error;
+};
+
+// Sparse adaptively refined distance field over a box:
+// an octree of cells, each leaf keeps the exact distances at its 8 corners and the ids of the segments
+// that may be the closest ones for any point of the cell: the segments within d(center) + diagonal of its center
+// the distance is 1-Lipschitz, so the trilinear interpolation is within half of the cell diagonal of it;
+// a cell is split while that bound exceeds tolerance (max_error outside the band) and it is above max_depth
+// the corners are shared by the neighbouring cells, every lattice point is sampled once
+class DistanceField
+{
+public:
+	// samples are taken from polyline (Polyline::locate_points), the candidates by Polyline::corridor,
+	// both over the pool if it is given; points - vertices of the polyline
+	DistanceField(Polyline& polyline, std::vector<Point3>& points, const AABBox& box, const DistanceFieldParams& params,
+		TaskPool* pool = nullptr);
+
+	// Trilinear interpolation in the leaf holding p,
+	// for p outside the box - at the closest box point, with the error grown by the distance to it
+	FieldSample distance(const Point3& p) const;
+	// Exact search among the candidates of the leaf holding p (ties under the tie policy)
+	// returns false (without touching the result) if p is outside the box, the leaf keeps no candidates
+	// or they may miss some ties (a policy wider than the one of the polyline at the construction)
+	bool locate_point(Point3& p, std::tuple<double, std::vector<size_t>, std::vector<Point3>>& result) const;
+
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+	const AABBox& get_bounds() const { return bounds; }
+	size_t leaves_count() const { return leaves.size(); }
+	size_t depth() const { return max_level; }
+	size_t memory() const;
+
+private:
+	struct Node
+	{
+		// first of the 8 children (z-major, then y, then x), 0 for a leaf
+		uint32_t child;
+		// leaf index
+		uint32_t leaf;
+	};
+	struct Leaf
+	{
+		std::array<double, 8> corners;
+		double error;
+		// the candidates are all the segments within radius of the cell center
+		double radius;
+		// candidates: ids[first, first + count), count = NO_CANDIDATES if not kept
+		uint32_t first;
+		uint32_t count;
+	};
+	static constexpr uint32_t NO_CANDIDATES = std::numeric_limits<uint32_t>::max();
+
+	std::vector<Point3>& points;
+	AABBox bounds;
+	Point3 size;
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+	std::vector<uint32_t> ids;
+	size_t max_level = 0;
+	TiePolicy ties;
+	// largest coordinate magnitude of the vertices and of the box, the scale of the distance errors
+	double scale = 0.;
+
+	// leaf holding q (q inside the box) and the position of q in it, in [0, 1]^3
+	const Leaf& find_leaf(const Point3& q, Point3& t) const;
+};
+
+#endif
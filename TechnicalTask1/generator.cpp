@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include "generator.h"
+#include "task_pool.h"
+
+static const char BINARY_MAGIC[4] = { 'P', 'L', 'B', '1' };
+static const double PI = 3.14159265358979323846;
+
+// splitmix64 step, decorrelates the seeds of neighbouring chunks
+static uint64_t mix_seed(uint64_t seed, uint64_t chunk)
+{
+	uint64_t z = seed + 0x9E3779B97F4A7C15ull * (chunk + 1);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// at most one thread per task, no pool for a single thread
+static std::unique_ptr<TaskPool> make_pool(size_t n_threads, size_t n_tasks)
+{
+	if (n_threads == 0)
+		n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	n_threads = std::min(n_threads, n_tasks);
+	return n_threads > 1 ? std::make_unique<TaskPool>(n_threads) : nullptr;
+}
+
+// runs foo(chunk) for every chunk, on the pool if any
+static void for_chunks(size_t n_chunks, TaskPool* pool, const std::function<void(size_t)>& foo)
+{
+	if (pool == nullptr || n_chunks == 1)
+	{
+		for (size_t c = 0; c < n_chunks; ++c)
+			foo(c);
+		return;
+	}
+	pool->parallel_for(0, n_chunks, 1, foo);
+}
+
+PolylineGenerator::PolylineGenerator(const GeneratorParams& params) : params(params)
+{
+	if (params.n_points < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	if (!(params.scale > 0))
+		throw std::runtime_error("Generator scale must be positive!");
+}
+
+bool PolylineGenerator::is_walk() const
+{
+	return params.model == GeneratorModel::RANDOM_WALK || params.model == GeneratorModel::ROAD_GRID ||
+		params.model == GeneratorModel::DUPLICATES;
+}
+
+void PolylineGenerator::generate_chunk(size_t chunk, Point3* out, size_t n) const
+{
+	std::mt19937_64 re(mix_seed(params.seed, chunk));
+	std::uniform_real_distribution<double> unif(-1., 1.);
+	std::normal_distribution<double> normal(0., 1.);
+	const double s = params.scale;
+
+	// uniformly distributed direction of length len
+	auto random_step = [&](double len)
+	{
+		double z = unif(re), phi = PI * unif(re), r = std::sqrt(1. - z * z);
+		return Point3{ r * std::cos(phi), r * std::sin(phi), z } * len;
+	};
+	auto step_length = [&]()
+	{
+		return params.step_sigma > 0 ? s * std::exp(params.step_sigma * normal(re)) : s;
+	};
+
+	switch (params.model)
+	{
+	case GeneratorModel::UNIFORM:
+		for (size_t i = 0; i < n; ++i)
+			out[i] = Point3{ unif(re), unif(re), unif(re) } * s;
+		break;
+
+	case GeneratorModel::RANDOM_WALK:
+	{
+		Point3 cur{ 0., 0., 0. };
+		for (size_t i = 0; i < n; ++i)
+		{
+			cur = cur + random_step(step_length());
+			out[i] = cur;
+		}
+		break;
+	}
+
+	case GeneratorModel::CLUSTERED_TRACKS:
+	{
+		// cluster centers are the same for all the chunks
+		std::mt19937_64 re_centers(params.seed);
+		std::uniform_real_distribution<double> area(-2000. * s, 2000. * s);
+		std::array<Point3, 16> centers;
+		for (auto& c : centers)
+			c = Point3{ area(re_centers), area(re_centers), 0.05 * area(re_centers) };
+
+		std::uniform_int_distribution<size_t> pick(0, centers.size() - 1), track_length(200, 2000);
+		size_t i = 0;
+		while (i < n)
+		{
+			auto& c = centers[pick(re)];
+			Point3 cur = c + Point3{ unif(re), unif(re), 0.1 * unif(re) } * (100. * s);
+			double heading = PI * unif(re), climb = 0.;
+			for (size_t k = track_length(re); k > 0 && i < n; --k, ++i)
+			{
+				heading += 0.05 * normal(re);
+				climb = 0.95 * climb + 0.01 * normal(re);
+				double len = step_length();
+				cur = cur + Point3{ std::cos(heading), std::sin(heading), climb } * len;
+				out[i] = cur;
+			}
+		}
+		break;
+	}
+
+	case GeneratorModel::HELIX:
+	{
+		const double turn = 2. * PI / 64.;
+		for (size_t i = 0; i < n; ++i)
+		{
+			double t = double(chunk * CHUNK + i) * turn;
+			out[i] = Point3{ s * std::cos(t), s * std::sin(t), 0.25 * s * t } + Point3{ unif(re), unif(re), unif(re) } * (1e-3 * s);
+		}
+		break;
+	}
+
+	case GeneratorModel::ROAD_GRID:
+	{
+		const size_t block = 10;
+		std::uniform_int_distribution<int> turn(-1, 1);
+		int dir = int(re() % 4);
+		Point3 cur{ 0., 0., 0. };
+		for (size_t i = 0; i < n; ++i)
+		{
+			// blocks are counted from the chunk start
+			if (i % block == 0)
+				dir = (dir + 4 + turn(re)) % 4;
+			Point3 along{ double((dir == 0) - (dir == 2)), double((dir == 1) - (dir == 3)), 0. };
+			cur = cur + along * s;
+			// lateral jitter of the measured position, not accumulated
+			Point3 jitter{ along.y, -along.x, 0. };
+			out[i] = cur + jitter * (0.02 * s * unif(re));
+		}
+		break;
+	}
+
+	case GeneratorModel::DUPLICATES:
+	{
+		std::uniform_real_distribution<double> prob(0., 1.);
+		Point3 cur{ 0., 0., 0. };
+		size_t i = 0;
+		while (i < n)
+		{
+			double r = prob(re);
+			if (r < params.duplicate_rate && i > 0)
+				cur = out[i - 1];
+			else if (r < 1.5 * params.duplicate_rate && i > 8)
+				// exact return to a recent vertex
+				cur = out[i - 2 - re() % 7];
+			else
+				cur = cur + random_step(step_length());
+			out[i++] = cur;
+		}
+		break;
+	}
+	}
+}
+
+std::vector<Point3> PolylineGenerator::generate() const
+{
+	size_t n = params.n_points;
+	size_t n_chunks = (n - 1) / CHUNK + 1;
+	std::vector<Point3> points(n);
+	auto pool = make_pool(params.n_threads, n_chunks);
+	for_chunks(n_chunks, pool.get(), [&](size_t c) {
+		generate_chunk(c, points.data() + c * CHUNK, std::min(CHUNK, n - c * CHUNK));
+		});
+
+	if (!is_walk())
+		return points;
+	// chunk c continues from the last vertex of the chunk c - 1
+	std::vector<Point3> offsets(n_chunks, Point3{ 0., 0., 0. });
+	for (size_t c = 1; c < n_chunks; ++c)
+		offsets[c] = offsets[c - 1] + points[c * CHUNK - 1];
+	for_chunks(n_chunks, pool.get(), [&](size_t c) {
+		for (size_t i = c * CHUNK; i < std::min((c + 1) * CHUNK, n); ++i)
+			points[i] = points[i] + offsets[c];
+		});
+	return points;
+}
+
+void PolylineGenerator::write_text(const std::vector<Point3>& points, const std::string& filename, size_t n_threads)
+{
+	std::ofstream out(filename, std::ios::out | std::ios::binary);
+	if (!out.is_open())
+		throw std::runtime_error("Cannot create file " + filename);
+
+	// chunks are formatted in parallel and written in order, a batch of chunks at a time
+	size_t n_chunks = (points.size() + CHUNK - 1) / CHUNK;
+	const size_t batch = 8;
+	auto pool = make_pool(n_threads, std::min(batch, n_chunks));
+	std::vector<std::string> text(std::min(batch, n_chunks));
+	for (size_t b = 0; b < n_chunks; b += batch)
+	{
+		size_t n_batch = std::min(batch, n_chunks - b);
+		for_chunks(n_batch, pool.get(), [&](size_t k) {
+			size_t c = b + k;
+			std::string& str = text[k];
+			str.resize(CHUNK * 3 * 25);
+			char* pos = str.data();
+			char* end = str.data() + str.size();
+			for (size_t i = c * CHUNK; i < std::min((c + 1) * CHUNK, points.size()); ++i)
+			{
+				for (double v : { points[i].x, points[i].y, points[i].z })
+				{
+					pos = std::to_chars(pos, end, v).ptr;
+					*pos++ = ' ';
+				}
+				pos[-1] = '\n';
+			}
+			str.resize(pos - str.data());
+			});
+		for (size_t k = 0; k < n_batch; ++k)
+			out.write(text[k].data(), text[k].size());
+	}
+	if (!out)
+		throw std::runtime_error("Cannot write file " + filename);
+}
+
+void PolylineGenerator::write_binary(const std::vector<Point3>& points, const std::string& filename)
+{
+	static_assert(sizeof(Point3) == 3 * sizeof(double), "Points are written as x y z doubles");
+	std::ofstream out(filename, std::ios::out | std::ios::binary);
+	if (!out.is_open())
+		throw std::runtime_error("Cannot create file " + filename);
+	unsigned long long n = points.size();
+	out.write(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+	out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+	out.write(reinterpret_cast<const char*>(points.data()), points.size() * sizeof(Point3));
+	if (!out)
+		throw std::runtime_error("Cannot write file " + filename);
+}
+
+std::vector<Point3> PolylineGenerator::read_binary(const std::string& filename)
+{
+	std::ifstream in(filename, std::ios::in | std::ios::binary);
+	if (!in.is_open())
+		throw std::runtime_error("No file: " + filename);
+	char magic[sizeof(BINARY_MAGIC)];
+	unsigned long long n = 0;
+	in.read(magic, sizeof(magic));
+	in.read(reinterpret_cast<char*>(&n), sizeof(n));
+	if (!in || std::memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0)
+		throw std::runtime_error("Not a binary polyline file: " + filename);
+	std::vector<Point3> points(n);
+	in.read(reinterpret_cast<char*>(points.data()), n * sizeof(Point3));
+	if (!in)
+		throw std::runtime_error("Truncated binary polyline file: " + filename);
+	return points;
+}
+
+GeneratorModel PolylineGenerator::model_from_name(const std::string& name)
+{
+	if (name == "uniform")
+		return GeneratorModel::UNIFORM;
+	if (name == "walk")
+		return GeneratorModel::RANDOM_WALK;
+	if (name == "tracks")
+		return GeneratorModel::CLUSTERED_TRACKS;
+	if (name == "helix")
+		return GeneratorModel::HELIX;
+	if (name == "roads")
+		return GeneratorModel::ROAD_GRID;
+	if (name == "duplicates")
+		return GeneratorModel::DUPLICATES;
+	throw std::runtime_error("Unknown model: " + name);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#ifndef GENERATOR_H
+#define GENERATOR_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "geo_units.h"
+
+using namespace geo_units;
+
+// Synthetic polyline models
+enum class GeneratorModel
+{
+	// independent uniform vertices in [-scale, scale]^3 (long criss-crossing segments)
+	UNIFORM,
+	// random directions, step lengths scale * lognormal(0, step_sigma)
+	RANDOM_WALK,
+	// GPS-like tracks of smoothly turning heading around a few cluster centers, joined by jumps
+	CLUSTERED_TRACKS,
+	// helix of radius scale, 64 vertices per turn, slightly jittered
+	HELIX,
+	// planar walk along the streets of a grid with blocks of 10 vertices spaced by scale
+	ROAD_GRID,
+	// random walk with repeated vertices and exact returns to earlier vertices (zero-length segments and ties)
+	DUPLICATES
+};
+
+struct GeneratorParams
+{
+	GeneratorModel model = GeneratorModel::RANDOM_WALK;
+	size_t n_points = 1000000;
+	uint64_t seed = 1;
+	double scale = 1.;
+	double step_sigma = 0.5;
+	// share of the repeated vertices for DUPLICATES
+	double duplicate_rate = 0.1;
+	// 0 - all hardware threads, the result does not depend on it
+	size_t n_threads = 0;
+};
+
+// Generation goes by chunks of CHUNK vertices, each with its own generator seeded from (seed, chunk index),
+// the walks are generated relative to the chunk start and shifted by the prefix sum of the chunk ends,
+// so the output is the same for any number of threads
+class PolylineGenerator
+{
+public:
+	static constexpr size_t CHUNK = size_t(1) << 16;
+
+	PolylineGenerator(const GeneratorParams& params);
+
+	std::vector<Point3> generate() const;
+
+	// "x y z" per line, shortest round-trip representation
+	static void write_text(const std::vector<Point3>& points, const std::string& filename, size_t n_threads = 0);
+	// {"PLB1", number of points (8 bytes), x y z doubles of every point}, native byte order
+	static void write_binary(const std::vector<Point3>& points, const std::string& filename);
+	static std::vector<Point3> read_binary(const std::string& filename);
+
+	static GeneratorModel model_from_name(const std::string& name);
+
+private:
+	GeneratorParams params;
+
+	// vertices of the chunk, relative to its start for the walk models
+	void generate_chunk(size_t chunk, Point3* out, size_t n) const;
+	bool is_walk() const;
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <cmath>
+#include "hash_grid.h"
+#include "polyline.h"
+
+HashGrid::HashGrid(std::vector<Point3>& points, AABBox bounds, double cell_size) : points(points), bounds(bounds), cell(cell_size)
+{
+	size_t n_seg = points.size() - 1;
+	if (cell <= 0)
+	{
+		std::vector<double> lengths(n_seg);
+		for (size_t i = 0; i < n_seg; ++i)
+			lengths[i] = points[i].euc_dist(points[i + 1]);
+		std::nth_element(lengths.begin(), lengths.begin() + n_seg / 2, lengths.end());
+		cell = lengths[n_seg / 2];
+	}
+
+	Point3 ext = bounds.rMax - bounds.lMin;
+	double span = std::max(std::max(ext.x, ext.y), ext.z);
+	// degenerate segment lengths: about one segment per cell
+	if (cell <= 0)
+		cell = span > 0 ? span / std::cbrt(double(n_seg)) : 1.;
+	// cell indices must fit the key
+	cell = std::max(cell, span / double((1 << 21) - 1));
+
+	dims = {
+		(long long)std::floor(ext.x / cell) + 1,
+		(long long)std::floor(ext.y / cell) + 1,
+		(long long)std::floor(ext.z / cell) + 1 };
+
+	table.reserve(2 * n_seg);
+	for (size_t i = 0; i < n_seg; ++i)
+		rasterize(i);
+}
+
+std::array<long long, 3> HashGrid::cell_of(const Point3& p) const
+{
+	std::array<double, 3> rel{ p.x - bounds.lMin.x, p.y - bounds.lMin.y, p.z - bounds.lMin.z };
+	std::array<long long, 3> c;
+	for (size_t a = 0; a < 3; ++a)
+		c[a] = std::clamp((long long)std::floor(rel[a] / cell), 0ll, dims[a] - 1);
+	return c;
+}
+
+AABBox HashGrid::cell_bounds(long long i, long long j, long long k) const
+{
+	Point3 lMin = bounds.lMin + Point3{ double(i), double(j), double(k) } * cell;
+	return AABBox{ lMin, lMin + Point3{ cell, cell, cell } };
+}
+
+void HashGrid::rasterize(size_t seg_id)
+{
+	Point3& a = points[seg_id];
+	Point3& b = points[seg_id + 1];
+	auto cur = cell_of(a);
+	auto last = cell_of(b);
+
+	auto add = [&](const std::array<long long, 3>& c)
+	{
+		blocks.insert(key(c[0] / BLOCK, c[1] / BLOCK, c[2] / BLOCK));
+		auto& ids = table[key(c[0], c[1], c[2])];
+		if (ids.empty() || ids.back() != seg_id)
+			ids.push_back(seg_id);
+	};
+
+	std::array<double, 3> org{ a.x - bounds.lMin.x, a.y - bounds.lMin.y, a.z - bounds.lMin.z };
+	std::array<double, 3> dir{ b.x - a.x, b.y - a.y, b.z - a.z };
+	std::array<long long, 3> step;
+	// parameter t along the segment of the next cell boundary crossing, and of the cell size
+	std::array<double, 3> t_max, t_delta;
+	for (size_t k = 0; k < 3; ++k)
+	{
+		if (dir[k] > 0)
+		{
+			step[k] = 1;
+			t_max[k] = ((cur[k] + 1) * cell - org[k]) / dir[k];
+			t_delta[k] = cell / dir[k];
+		}
+		else if (dir[k] < 0)
+		{
+			step[k] = -1;
+			t_max[k] = (cur[k] * cell - org[k]) / dir[k];
+			t_delta[k] = -cell / dir[k];
+		}
+		else
+		{
+			step[k] = 0;
+			t_max[k] = t_delta[k] = std::numeric_limits<double>::max();
+		}
+	}
+
+	add(cur);
+	long long max_steps = std::abs(last[0] - cur[0]) + std::abs(last[1] - cur[1]) + std::abs(last[2] - cur[2]);
+	for (long long n = 0; n < max_steps && cur != last; ++n)
+	{
+		size_t k = std::distance(t_max.begin(), std::min_element(t_max.begin(), t_max.end()));
+		cur[k] = std::clamp(cur[k] + step[k], 0ll, dims[k] - 1);
+		t_max[k] += t_delta[k];
+		add(cur);
+	}
+	// rounding may stop the walk short of the end cell
+	if (cur != last)
+		add(last);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> HashGrid::locate_point(Point3& p, double upper_bound)
+{
+	if (upper_bound < std::numeric_limits<double>::max())
+		upper_bound = upper_bound * (1. + 1e-12) + std::numeric_limits<double>::epsilon();
+	double scale = std::max({ std::abs(bounds.lMin.x), std::abs(bounds.lMin.y), std::abs(bounds.lMin.z),
+		std::abs(bounds.rMax.x), std::abs(bounds.rMax.y), std::abs(bounds.rMax.z) });
+	ClosestSegments closest(ties, p, scale, upper_bound);
+
+	auto visit = [&](long long i, long long j, long long k)
+	{
+		if (!closest.may_reach(cell_bounds(i, j, k).euc_dist(p)))
+			return;
+		auto it = table.find(key(i, j, k));
+		if (it == table.end())
+			return;
+
+		for (size_t id : it->second)
+		{
+			// segments crossing several cells are met more than once, resolve() keeps one
+			auto [d, p_proj] = Segment{ &points[id], &points[id + 1], id }.euc_dist(p);
+			closest.add(d, &points[id], &points[id + 1], id, p_proj);
+		}
+	};
+
+	// calls visit for the cells (or blocks) at Chebyshev distance r from c, within [0, lim)
+	auto for_shell = [](const std::array<long long, 3>& c, long long r, const std::array<long long, 3>& lim, auto&& visit)
+	{
+		for (long long i = std::max(c[0] - r, 0ll); i <= std::min(c[0] + r, lim[0] - 1); ++i)
+		{
+			for (long long j = std::max(c[1] - r, 0ll); j <= std::min(c[1] + r, lim[1] - 1); ++j)
+			{
+				if (std::abs(i - c[0]) == r || std::abs(j - c[1]) == r)
+				{
+					for (long long k = std::max(c[2] - r, 0ll); k <= std::min(c[2] + r, lim[2] - 1); ++k)
+						visit(i, j, k);
+				}
+				else
+				{
+					if (c[2] - r >= 0)
+						visit(i, j, c[2] - r);
+					if (c[2] + r < lim[2])
+						visit(i, j, c[2] + r);
+				}
+			}
+		}
+	};
+	// true if all the cells (or blocks) of [0, lim) outside the cube of radius r (in units of size) around c are out of reach:
+	// only the faces with cells beyond them count (c is the clamped cell of p, so a query outside the grid
+	// is beyond the closed faces only), the segments there lie in the part of the polyline box beyond the face
+	auto outside_is_farther = [&](const std::array<long long, 3>& c, long long r, double size, const std::array<long long, 3>& lim)
+	{
+		std::array<double, 3> lo{ bounds.lMin.x, bounds.lMin.y, bounds.lMin.z }, hi{ bounds.rMax.x, bounds.rMax.y, bounds.rMax.z };
+		auto beyond_dist = [&](size_t a, bool lower, double face)
+		{
+			auto b_lo = lo, b_hi = hi;
+			if (lower)
+				b_hi[a] = std::max(std::min(b_hi[a], face), b_lo[a]);
+			else
+				b_lo[a] = std::min(std::max(b_lo[a], face), b_hi[a]);
+			return AABBox{ Point3{ b_lo[0], b_lo[1], b_lo[2] }, Point3{ b_hi[0], b_hi[1], b_hi[2] } }.euc_dist(p);
+		};
+		bool open = false;
+		double lb = std::numeric_limits<double>::max();
+		for (size_t a = 0; a < 3; ++a)
+		{
+			if (c[a] - r > 0)
+			{
+				open = true;
+				lb = std::min(lb, beyond_dist(a, true, lo[a] + double(c[a] - r) * size));
+			}
+			if (c[a] + r < lim[a] - 1)
+			{
+				open = true;
+				lb = std::min(lb, beyond_dist(a, false, lo[a] + double(c[a] + r + 1) * size));
+			}
+		}
+		return !open || !closest.may_reach(lb);
+	};
+
+	auto c0 = cell_of(p);
+	long long r_max = *std::max_element(dims.begin(), dims.end());
+	for (long long r = 0; r < BLOCK && r <= r_max; ++r)
+	{
+		for_shell(c0, r, dims, visit);
+		if (outside_is_farther(c0, r, cell, dims))
+			return closest.resolve();
+	}
+
+	// continue with the rings of blocks, skipping the cells visited above
+	std::array<long long, 3> b0{ c0[0] / BLOCK, c0[1] / BLOCK, c0[2] / BLOCK };
+	std::array<long long, 3> b_dims{ (dims[0] - 1) / BLOCK + 1, (dims[1] - 1) / BLOCK + 1, (dims[2] - 1) / BLOCK + 1 };
+	long long R_max = *std::max_element(b_dims.begin(), b_dims.end());
+	auto visit_block = [&](long long bi, long long bj, long long bk)
+	{
+		Point3 lMin = bounds.lMin + Point3{ double(bi), double(bj), double(bk) } * (cell * BLOCK);
+		if (!closest.may_reach(AABBox{ lMin, lMin + Point3{ 1., 1., 1. } * (cell * BLOCK) }.euc_dist(p)))
+			return;
+		if (!blocks.count(key(bi, bj, bk)))
+			return;
+
+		for (long long i = bi * BLOCK; i < std::min((bi + 1) * BLOCK, dims[0]); ++i)
+			for (long long j = bj * BLOCK; j < std::min((bj + 1) * BLOCK, dims[1]); ++j)
+				for (long long k = bk * BLOCK; k < std::min((bk + 1) * BLOCK, dims[2]); ++k)
+					if (std::max({ std::abs(i - c0[0]), std::abs(j - c0[1]), std::abs(k - c0[2]) }) >= BLOCK)
+						visit(i, j, k);
+	};
+	for (long long R = 0; R <= R_max; ++R)
+	{
+		for_shell(b0, R, b_dims, visit_block);
+		if (outside_is_farther(b0, R, cell * BLOCK, b_dims))
+			break;
+	}
+
+	return closest.resolve();
+}
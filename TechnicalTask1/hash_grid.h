@@ -0,0 +1,59 @@
+#pragma once
+#ifndef HASH_GRID_H
+#define HASH_GRID_H
+#include <array>
+#include <limits>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "octree_item.h"
+#include "tie_policy.h"
+
+// Uniform grid over the polyline BBox, only non-empty cells are stored (in a hash table)
+// every segment is registered in each cell it crosses;
+// queries visit the cells in expanding rings around the point,
+// far from the polyline the rings are made of blocks of BLOCK^3 cells, so that empty space is skipped faster
+class HashGrid
+{
+public:
+	// cell_size = 0 picks the median segment length
+	HashGrid(std::vector<Point3>& points, AABBox bounds, double cell_size = 0.);
+
+	// Ring search for the nearest segments,
+	// upper_bound - known upper bound of the minimal distance (if any)
+	// returns:
+	//		mininmum distance,
+	//		ids of the closest segments,
+	//		projections onto closest segments
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p,
+		double upper_bound = std::numeric_limits<double>::max());
+
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+	double get_cell_size() const { return cell; }
+	size_t get_cells_count() const { return table.size(); }
+
+private:
+	std::vector<Point3>& points;
+	AABBox bounds;
+	double cell;
+	std::array<long long, 3> dims;
+	std::unordered_map<unsigned long long, std::vector<size_t>> table;
+	// keys of the blocks having at least one non-empty cell
+	std::unordered_set<unsigned long long> blocks;
+	TiePolicy ties;
+	static constexpr long long BLOCK = 8;
+
+	// cell indices are packed by 21 bits
+	static unsigned long long key(long long i, long long j, long long k)
+	{
+		return (unsigned long long)i | ((unsigned long long)j << 21) | ((unsigned long long)k << 42);
+	}
+	std::array<long long, 3> cell_of(const Point3& p) const;
+	AABBox cell_bounds(long long i, long long j, long long k) const;
+	// 3D DDA walk over the cells crossed by the segment
+	void rasterize(size_t seg_id);
+};
+
+#endif
@@ -1,9 +1,31 @@
 #include <algorithm>
 #include <iostream>
+#include <unordered_set>
 #include <time.h>
 #include "octree.h"
 #include "polyline.h"
 
+static AABBox segment_box(const Segment& s)
+{
+	return AABBox::of(*s.p1, *s.p2);
+}
+
+static AABBox box_union(const AABBox& a, const AABBox& b)
+{
+	return AABBox{
+		Point3{ std::min(a.lMin.x, b.lMin.x), std::min(a.lMin.y, b.lMin.y), std::min(a.lMin.z, b.lMin.z) },
+		Point3{ std::max(a.rMax.x, b.rMax.x), std::max(a.rMax.y, b.rMax.y), std::max(a.rMax.z, b.rMax.z) } };
+}
+
+template<>
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point_bounded(Point3& p, double upper_bound);
+
+template<>
+double Octree<Segment>::data_scale() const;
+
+template<>
+void Octree<Segment>::scan_blocks(Point3& p, TreeItem<Segment>& tree, ClosestSegments& closest);
+
 std::shared_ptr<TreeItem<Segment>> Octree<Segment>::construct(AABBox bounds, std::vector<Point3>& points)
 {
 	time_t start = clock();
@@ -25,26 +47,40 @@ std::shared_ptr<TreeItem<Segment>> Octree<Segment>::construct(AABBox bounds, std
 	return root;
 }
 
+template<>
+std::shared_ptr<TreeItem<Segment>> Octree<Segment>::construct(AABBox bounds, std::vector<std::shared_ptr<Segment>>& segments)
+{
+	root = std::make_shared<TreeItem<Segment>>(bounds);
+	root->split();
+	for (auto& s : segments)
+		insert(s, root);
+	return root;
+}
+
 template <class T>
 void Octree<T>::push_back(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& cur_tree)
 {
 	if (cur_tree->data.capacity() == 0)
+	{
 		cur_tree->data.reserve(MAX_R);
+		cur_tree->blocks.reserve(MAX_R / BoxBlock::LANES + 1);
+	}
 
 	if (cur_tree->data.size() <= MAX_R || cur_tree->descendants.size())
-		cur_tree->data.push_back(s);
+		cur_tree->push_data(s);
 	else
 	{
 		cur_tree->split();
 
 		std::vector < std::shared_ptr <T>> elements = {};
 		elements.swap(cur_tree->data);
+		std::vector<BoxBlock>().swap(cur_tree->blocks);
 
 		for (auto& e : elements)
 		{
 			insert(e, cur_tree);
 		}
-
+		insert(s, cur_tree);
 	}
 }
 
@@ -52,6 +88,11 @@ void Octree<T>::push_back(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& cu
 template <class T>
 void Octree<T>::insert(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& tree)
 {
+	if (frozen)
+		throw std::runtime_error("Octree is compacted, no insertions allowed!");
+	// fitted boxes must keep containing everything below them
+	if (refitted)
+		tree->bounds = box_union(tree->bounds, segment_box(*s));
 	size_t CTI_Dsize = tree->descendants.size();
 	if(CTI_Dsize == 0)
 		push_back(s, tree);
@@ -76,14 +117,16 @@ void Octree<T>::insert(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& tree)
 
 std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point(Point3& p)
 {
+	// the octant walk relies on the node boxes being octants
+	if (refitted)
+		return locate_point_bounded(p, std::numeric_limits<double>::max());
 	return locate_point(p, root);
 }
 
 template <>
 std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point(Point3& p, std::shared_ptr<TreeItem<Segment>>& tree)
 {
-	// if the point is outside the Octree root BBox, obtain the closest projection-point
-	// if the projection is outside BBox, take the closest BBox point
+	// if the point is outside the Octree root BBox, obtain the closest BBox point
 	if (tree != nullptr)
 	{
 		Point3 p_proj;
@@ -97,7 +140,9 @@ std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::lo
 		}
 		// now, we'll check if the p_proj is inside the subboxes,
 		// but count distance to p anyway
-		return depth_first_search(p, p_proj, tree);
+		ClosestSegments closest(ties, p, data_scale());
+		depth_first_search(p, p_proj, tree, closest);
+		return closest.resolve();
 	}
 	return std::make_tuple(std::numeric_limits<double>::quiet_NaN(), std::vector<size_t>(), std::vector<Point3>());
 }
@@ -105,187 +150,870 @@ std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::lo
 template<>
 Point3 Octree<Segment>::project_closest(Point3& p, std::shared_ptr<TreeItem<Segment>>& tree)
 {
-	// project p on every face of the BB and choose the closest
-	std::array<double, 6> pln_dist = {
-		fabs(tree->bounds.lMin.x - p.x),
-		fabs(tree->bounds.lMin.y - p.y),
-		fabs(tree->bounds.lMin.z - p.z),
-		fabs(tree->bounds.rMax.x - p.x),
-		fabs(tree->bounds.rMax.y - p.y),
-		fabs(tree->bounds.rMax.z - p.z) };
-	auto it_min = std::min_element(pln_dist.begin(), pln_dist.end());
-	double min_pln_dist = *it_min;
-	auto min_pln_id = std::distance(pln_dist.begin(), it_min);
-
-	Vec3 n{ { 0., 0., 0. } };
-	n.v[min_pln_id % 3] = 1.;
-
-	//    ?
-	double dist = n.dot(Vec3(p));
-	Vec3 proj_vec = Vec3(p) - n * dist;
-	Point3 p_proj = { proj_vec.v[0], proj_vec.v[1], proj_vec.v[2] };
-	if (!root->bounds.is_inside(p_proj))
-	{
-		// distance to the nearest of 4 points of BB face
-		double min_pt_dist = std::numeric_limits<double>::max();
-		Point3 p_proj_new;
-
-		auto face_points = tree->bounds.get_plane_points(min_pln_id);
-		for_each(face_points.begin(), face_points.end(), [&](Point3& face_pt) {
-			auto d = face_pt.euc_dist(p);
-			if (min_pt_dist > d)
-			{
-				min_pt_dist = d;
-				p_proj_new = face_pt;
-			}
-			});
-		p_proj = p_proj_new;
-	}
-	return p_proj;
+	// the point of the BBox closest to p: p clamped to the BBox
+	// (the projection onto the closest face plane may lie outside of the face)
+	const AABBox& b = tree->bounds;
+	return Point3{
+		std::clamp(p.x, b.lMin.x, b.rMax.x),
+		std::clamp(p.y, b.lMin.y, b.rMax.y),
+		std::clamp(p.z, b.lMin.z, b.rMax.z) };
 }
 
+
 template<>
-std::tuple<double, 
-	std::vector<size_t>, 
-	std::vector<Point3>>
-	Octree<Segment>::depth_first_search(
-		Point3& p, Point3& p_proj, std::shared_ptr<TreeItem<Segment>>& tree)
+void Octree<Segment>::depth_first_search(
+		Point3& p, Point3& p_proj, std::shared_ptr<TreeItem<Segment>>& tree, ClosestSegments& closest)
 {
-	std::vector<size_t> min_ids{};
-	std::vector<Point3> min_proj{};
-
-	double min_dist = std::numeric_limits<double>::max();
+	// octants containing p_proj (more than one if it is on their border) are searched first
+	uint32_t visited = 0;
+	for (size_t i = 0; i < tree->descendants.size(); ++i)
+	{
+		if (tree->descendants[i]->bounds.is_inside(p_proj))
+		{
+			depth_first_search(p, p_proj, tree->descendants[i], closest);
+			visited |= 1u << i;
+		}
+	}
 
-	size_t i_octant = 0;
-	int point_octant = -1;
+	// check current tree data for closest segments
+	scan_blocks(p, *tree, closest);
 
-	for (auto& d_tree : tree->descendants)
+	// then the other octants, nearest first, while their boxes are within the current reach of the ties
+	// (diagonal neighbours included), each from the point of its box closest to p
+	if (tree->descendants.size())
 	{
-		if (d_tree->bounds.is_inside(p_proj))
+		std::array<std::pair<double, size_t>, 8> order;
+		size_t n = 0;
+		for (size_t i = 0; i < tree->descendants.size() && n < order.size(); ++i)
+			if (!(visited & (1u << i)))
+				order[n++] = { tree->descendants[i]->bounds.euc_dist(p), i };
+		std::sort(order.begin(), order.begin() + n);
+		for (size_t k = 0; k < n && closest.may_reach(order[k].first); ++k)
 		{
-			const auto [d, ids, projs] = depth_first_search(p, p_proj, d_tree); 
-			if (!std::isnan(d))
-			{
-				if (is_equal(d, min_dist))
-				{
-					min_ids.insert(min_ids.end(), ids.begin(), ids.end());
-					min_proj.insert(min_proj.begin(), projs.begin(), projs.end());
-				}
-				if (d < min_dist)
-				{
-					min_dist = d;
-					min_ids = ids;
-					min_proj = projs;
-				}
-				
-			}
-			point_octant = i_octant;
+			auto& d_tree = tree->descendants[order[k].second];
+			Point3 d_proj = project_closest(p, d_tree);
+			depth_first_search(p, d_proj, d_tree, closest);
 		}
-		++i_octant;
 	}
+}
 
-	// check current tree data for closest segments
-	for (auto& s : tree->data)
+template<>
+void Octree<Segment>::scan_blocks(Point3& p, TreeItem<Segment>& tree, ClosestSegments& closest)
+{
+	// the reach is widened as in may_reach: a segment closest would take is never skipped
+	auto reach2 = [&]() {
+		double r = closest.reach() + closest.error_bound();
+		return r * r;
+	};
+	double r2 = reach2();
+	std::array<double, BoxBlock::LANES> d2;
+	for (size_t b = 0; b < tree.blocks.size(); ++b)
 	{
-		auto [d, p_proj]  = s->euc_dist(p);
-		if (is_equal(d, min_dist))
+		if (tree.blocks[b].dist2(p, d2) > r2)
+			continue;
+		size_t first = b * BoxBlock::LANES;
+		size_t n = std::min(BoxBlock::LANES, tree.data.size() - first);
+		for (size_t k = 0; k < n; ++k)
 		{
-			min_ids.push_back(s->id);
-			min_proj.push_back(p_proj);
+			if (d2[k] > r2)
+				continue;
+			auto& s = tree.data[first + k];
+			auto [d, p_proj] = s->euc_dist(p);
+			closest.add(d, s->p1, s->p2, s->id, p_proj);
+			r2 = reach2();
 		}
+	}
+}
+
+template<>
+void Octree<Segment>::branch_and_bound(Point3& p, double eps, std::shared_ptr<TreeItem<Segment>>& tree,
+	double& min_dist, size_t& min_id, Point3& min_proj)
+{
+	if (tree->bounds.euc_dist(p) * (1. + eps) >= min_dist)
+		return;
+
+	for (auto& s : tree->data)
+	{
+		auto [d, p_proj] = s->euc_dist(p);
 		if (d < min_dist)
 		{
 			min_dist = d;
-			min_ids = std::vector<size_t>{ s->id };
-			min_proj = std::vector<Point3>{ (p_proj) };
+			min_id = s->id;
+			min_proj = p_proj;
 		}
 	}
 
-	// if the tree node has descendants, we may want to check 
-	// those closest to the point p,
-	// but only if the current min_dist > dist(F_i, p), where F_i -- is an internal plane between nodes
-	if (tree->descendants.size())
+	// visit the closest octants first, so that the rest are more likely to be pruned
+	size_t n_desc = tree->descendants.size();
+	std::array<std::pair<double, size_t>, 8> order;
+	for (size_t k = 0; k < n_desc; ++k)
+		order[k] = std::make_pair(tree->descendants[k]->bounds.euc_dist(p), k);
+	std::sort(order.begin(), order.begin() + n_desc);
+
+	for (size_t k = 0; k < n_desc; ++k)
+	{
+		if (order[k].first * (1. + eps) >= min_dist)
+			break;
+		branch_and_bound(p, eps, tree->descendants[order[k].second], min_dist, min_id, min_proj);
+	}
+}
+
+template<>
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point_approx(Point3& p, double eps)
+{
+	if (eps < 0)
+		throw std::runtime_error("Approximation factor eps must be non-negative!");
+
+	double min_dist = std::numeric_limits<double>::max();
+	size_t min_id = 0;
+	Point3 min_proj{};
+	if (root != nullptr)
+		branch_and_bound(p, eps, root, min_dist, min_id, min_proj);
+
+	if (min_dist == std::numeric_limits<double>::max())
+		return std::make_tuple(std::numeric_limits<double>::quiet_NaN(), std::vector<size_t>(), std::vector<Point3>());
+	return std::make_tuple(min_dist, std::vector<size_t>{ min_id }, std::vector<Point3>{ min_proj });
+}
+
+template<>
+void Octree<Segment>::bounded_search(Point3& p, std::shared_ptr<TreeItem<Segment>>& tree, ClosestSegments& closest)
+{
+	if (!closest.may_reach(tree->bounds.euc_dist(p)))
+		return;
+
+	scan_blocks(p, *tree, closest);
+
+	size_t n_desc = tree->descendants.size();
+	std::array<std::pair<double, size_t>, 8> order;
+	for (size_t k = 0; k < n_desc; ++k)
+		order[k] = std::make_pair(tree->descendants[k]->bounds.euc_dist(p), k);
+	std::sort(order.begin(), order.begin() + n_desc);
+
+	for (size_t k = 0; k < n_desc; ++k)
+		bounded_search(p, tree->descendants[order[k].second], closest);
+}
+
+template<>
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point_bounded(Point3& p, double upper_bound)
+{
+	// slightly inflated, so that segments exactly at upper_bound are not lost
+	if (upper_bound < std::numeric_limits<double>::max())
+		upper_bound = upper_bound * (1. + 1e-12) + std::numeric_limits<double>::epsilon();
+	ClosestSegments closest(ties, p, data_scale(), upper_bound);
+	if (root != nullptr)
+		bounded_search(p, root, closest);
+	return closest.resolve();
+}
+
+SharedBest::SharedBest(const ClosestSegments& closest) :
+	closest(closest), min_dist(closest.min()), reach(closest.reach() + closest.error_bound())
+{
+}
+
+void SharedBest::merge(const ClosestSegments& local)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	closest.merge(local);
+	min_dist = closest.min();
+	reach = closest.reach() + closest.error_bound();
+}
+
+template<>
+void Octree<Segment>::scan_data(Point3& p, std::shared_ptr<TreeItem<Segment>>& tree, size_t begin, size_t end, SharedBest& best)
+{
+	// bounded by the shared minimum, so the local reach is not wider than the shared one
+	ClosestSegments local(ties, p, data_scale(), best.min_dist.load());
+	for (size_t i = begin; i < end; ++i)
+	{
+		auto& s = tree->data[i];
+		auto [d, p_proj] = s->euc_dist(p);
+		local.add(d, s->p1, s->p2, s->id, p_proj);
+	}
+	if (!local.empty())
+		best.merge(local);
+}
+
+template<>
+void Octree<Segment>::parallel_search(Point3& p, std::shared_ptr<TreeItem<Segment>>& tree, SharedBest& best, TaskPool& pool, TaskGroup& group)
+{
+	if (tree->bounds.euc_dist(p) > best.reach.load())
+		return;
+
+	size_t sz = tree->data.size();
+	for (size_t b = PARALLEL_CHUNK; b < sz; b += PARALLEL_CHUNK)
+	{
+		size_t e = std::min(b + PARALLEL_CHUNK, sz);
+		pool.submit(group, [this, &p, tree, b, e, &best]() mutable { scan_data(p, tree, b, e, best); });
+	}
+	// the first chunk is scanned by the current thread
+	scan_data(p, tree, 0, std::min(sz, PARALLEL_CHUNK), best);
+
+	size_t n_desc = tree->descendants.size();
+	std::array<std::pair<double, size_t>, 8> order;
+	for (size_t k = 0; k < n_desc; ++k)
+		order[k] = std::make_pair(tree->descendants[k]->bounds.euc_dist(p), k);
+	std::sort(order.begin(), order.begin() + n_desc);
+
+	// the closest octant is searched by the current thread, the others may be stolen
+	for (size_t k = 1; k < n_desc; ++k)
+	{
+		auto& d_tree = tree->descendants[order[k].second];
+		pool.submit(group, [this, &p, &d_tree, &best, &pool, &group]() { parallel_search(p, d_tree, best, pool, group); });
+	}
+	if (n_desc)
+		parallel_search(p, tree->descendants[order[0].second], best, pool, group);
+}
+
+template<>
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Octree<Segment>::locate_point_parallel(Point3& p, TaskPool& pool)
+{
+	SharedBest best(ClosestSegments(ties, p, data_scale()));
+	if (root != nullptr)
+	{
+		TaskGroup group;
+		parallel_search(p, root, best, pool, group);
+		pool.wait(group);
+	}
+	return best.closest.resolve();
+}
+
+template<>
+MemoryUsage Octree<Segment>::memory_usage()
+{
+	// make_shared puts the object and its control block (two counters and a vtable pointer) together
+	const size_t control_block = 2 * sizeof(long) + sizeof(void*);
+	MemoryUsage usage;
+	if (root == nullptr)
+		return usage;
+
+	std::unordered_set<const Segment*> segments;
+	std::vector<TreeItem<Segment>*> stack{ root.get() };
+	while (!stack.empty())
+	{
+		auto tree = stack.back();
+		stack.pop_back();
+		usage.nodes += sizeof(TreeItem<Segment>) + control_block;
+		usage.node_lists += tree->data.capacity() * sizeof(std::shared_ptr<Segment>)
+			+ tree->blocks.capacity() * sizeof(BoxBlock)
+			+ tree->descendants.capacity() * sizeof(std::shared_ptr<TreeItem<Segment>>);
+		for (auto& s : tree->data)
+			segments.insert(s.get());
+		for (auto& d_tree : tree->descendants)
+			stack.push_back(d_tree.get());
+	}
+
+	if (segment_pool != nullptr)
+		usage.segments = segment_pool->capacity() * sizeof(Segment) + control_block;
+	else
+		usage.segments = segments.size() * (sizeof(Segment) + control_block);
+	return usage;
+}
+
+template<>
+bool Octree<Segment>::prune(std::shared_ptr<TreeItem<Segment>>& tree)
+{
+	bool empty_descendants = true;
+	for (auto& d_tree : tree->descendants)
+		empty_descendants = prune(d_tree) && empty_descendants;
+	// octants are addressed by index in the search, so they can only be removed all together
+	if (empty_descendants)
+		std::vector<std::shared_ptr<TreeItem<Segment>>>().swap(tree->descendants);
+
+	tree->data.shrink_to_fit();
+	tree->blocks.shrink_to_fit();
+	tree->descendants.shrink_to_fit();
+	return tree->data.empty() && tree->descendants.empty();
+}
+
+template<>
+void Octree<Segment>::compact()
+{
+	if (root == nullptr || frozen)
+		return;
+	prune(root);
+
+	// one allocation for all the segments instead of one per segment
+	size_t n_seg = 0;
+	std::vector<TreeItem<Segment>*> stack{ root.get() };
+	while (!stack.empty())
 	{
-		size_t d_indx = 0;
-		Point3 center = (tree->bounds.rMax - tree->bounds.lMin) * 0.5;
-		double dist_xmid = fabs(center.x - p.x),
-			dist_ymid = fabs(center.y - p.y),
-			dist_zmid = fabs(center.z - p.z);
+		auto tree = stack.back();
+		stack.pop_back();
+		for (auto& s : tree->data)
+			n_seg = std::max(n_seg, s->id + 1);
+		for (auto& d_tree : tree->descendants)
+			stack.push_back(d_tree.get());
+	}
+
+	segment_pool = std::make_shared<std::vector<Segment>>(n_seg);
+	stack.push_back(root.get());
+	while (!stack.empty())
+	{
+		auto tree = stack.back();
+		stack.pop_back();
+		for (auto& s : tree->data)
+		{
+			Segment& pooled = (*segment_pool)[s->id];
+			pooled = *s;
+			s = std::shared_ptr<Segment>(segment_pool, &pooled);
+		}
+		for (auto& d_tree : tree->descendants)
+			stack.push_back(d_tree.get());
+	}
+	frozen = true;
+}
+
+void SharedPair::update(const SegmentPair& candidate)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (candidate.dist < min_dist)
+	{
+		pair = candidate;
+		min_dist = candidate.dist;
+	}
+}
+
+template<>
+std::vector<std::pair<TreeItem<Segment>*, bool>> Octree<Segment>::node_parts(TreeItem<Segment>* tree)
+{
+	std::vector<std::pair<TreeItem<Segment>*, bool>> parts;
+	if (tree->data.size())
+		parts.push_back(std::make_pair(tree, true));
+	for (auto& d_tree : tree->descendants)
+		parts.push_back(std::make_pair(d_tree.get(), false));
+	return parts;
+}
 
+template<>
+void Octree<Segment>::dual_search(TreeItem<Segment>* a, bool a_own, TreeItem<Segment>* b, bool b_own, SharedPair& best)
+{
+	if (a->bounds.euc_dist(b->bounds) >= best.min_dist)
+		return;
 
-		auto search_neighbour = [&](size_t d_indx)
+	bool a_leaf = a_own || a->descendants.empty();
+	bool b_leaf = b_own || b->descendants.empty();
+	if (a_leaf && b_leaf)
+	{
+		auto seg_box = [](const Segment& s) {
+			return AABBox{
+				Point3{ std::min(s.p1->x, s.p2->x), std::min(s.p1->y, s.p2->y), std::min(s.p1->z, s.p2->z) },
+				Point3{ std::max(s.p1->x, s.p2->x), std::max(s.p1->y, s.p2->y), std::max(s.p1->z, s.p2->z) } };
+		};
+		std::vector<AABBox> b_boxes(b->data.size());
+		for (size_t j = 0; j < b->data.size(); ++j)
+			b_boxes[j] = seg_box(*b->data[j]);
+
+		for (auto& sa : a->data)
 		{
-			Point3 p_proj = project_closest(p, tree->descendants[d_indx]);
-			// if the point p is closer to its projection p_proj onto BBox's plane
-			// than to the closest segment, we may want to search the neighbour octant
-			if (p_proj.euc_dist(p) < min_dist)
+			AABBox a_box = seg_box(*sa);
+			if (a_box.euc_dist(b->bounds) >= best.min_dist)
+				continue;
+			for (size_t j = 0; j < b->data.size(); ++j)
 			{
-				const auto [d, ids, projs] = depth_first_search(p, p_proj, tree->descendants[d_indx]);
-				if (!std::isnan(d))
-				{
-					if (is_equal(d, min_dist))
-					{
-						min_ids.insert(min_ids.end(), ids.begin(), ids.end());
-						min_proj.insert(min_proj.begin(), projs.begin(), projs.end());
-					}
-					if (d < min_dist)
-					{
-						min_dist = d;
-						min_ids = ids;
-						min_proj = projs;
-
-					}
-					
-				}
+				if (a_box.euc_dist(b_boxes[j]) >= best.min_dist)
+					continue;
+				auto& sb = b->data[j];
+				auto [d, p1, p2] = sa->seg_dist(*sb);
+				if (d < best.min_dist)
+					best.update(SegmentPair{ d, sa->id, sb->id, p1, p2 });
 			}
+		}
+		return;
+	}
+
+	// split the larger of the two nodes
+	auto span = [](const AABBox& box) {
+		Point3 diff = box.rMax - box.lMin;
+		return std::max(std::max(diff.x, diff.y), diff.z);
+	};
+	bool split_a = !a_leaf && (b_leaf || span(a->bounds) >= span(b->bounds));
+	auto parts = node_parts(split_a ? a : b);
+	TreeItem<Segment>* other = split_a ? b : a;
+
+	std::vector<std::pair<double, size_t>> order(parts.size());
+	for (size_t k = 0; k < parts.size(); ++k)
+		order[k] = std::make_pair(parts[k].first->bounds.euc_dist(other->bounds), k);
+	std::sort(order.begin(), order.end());
+
+	for (auto& [d, k] : order)
+	{
+		if (split_a)
+			dual_search(parts[k].first, parts[k].second, b, b_own, best);
+		else
+			dual_search(a, a_own, parts[k].first, parts[k].second, best);
+	}
+}
+
+template<>
+SegmentPair Octree<Segment>::min_distance(Octree<Segment>& other, TaskPool* pool)
+{
+	SharedPair best;
+	best.min_dist = std::numeric_limits<double>::max();
+	best.pair = SegmentPair{ std::numeric_limits<double>::quiet_NaN(), 0, 0, Point3{}, Point3{} };
+	if (root == nullptr || other.root == nullptr)
+		return best.pair;
+
+	if (pool == nullptr)
+	{
+		dual_search(root.get(), false, other.root.get(), false, best);
+		return best.pair;
+	}
+
+	// pairs of top-level parts, the closest ones first
+	auto parts_a = node_parts(root.get());
+	auto parts_b = node_parts(other.root.get());
+	std::vector<std::tuple<double, size_t, size_t>> pairs;
+	for (size_t i = 0; i < parts_a.size(); ++i)
+		for (size_t j = 0; j < parts_b.size(); ++j)
+			pairs.push_back(std::make_tuple(parts_a[i].first->bounds.euc_dist(parts_b[j].first->bounds), i, j));
+	std::sort(pairs.begin(), pairs.end());
+
+	TaskGroup group;
+	for (auto& [d, i, j] : pairs)
+	{
+		auto& a = parts_a[i];
+		auto& b = parts_b[j];
+		pool->submit(group, [this, &a, &b, &best]() { dual_search(a.first, a.second, b.first, b.second, best); });
+	}
+	pool->wait(group);
+	return best.pair;
+}
+
+template<>
+void Octree<Segment>::dual_collect(TreeItem<Segment>* a, bool a_own, TreeItem<Segment>* b, bool b_own, double tolerance, std::vector<SegmentPair>& out)
+{
+	if (a->bounds.euc_dist(b->bounds) > tolerance)
+		return;
+
+	bool same = a == b && a_own == b_own;
+	bool a_leaf = a_own || a->descendants.empty();
+	bool b_leaf = b_own || b->descendants.empty();
+	if (a_leaf && b_leaf)
+	{
+		auto seg_box = [](const Segment& s) {
+			return AABBox{
+				Point3{ std::min(s.p1->x, s.p2->x), std::min(s.p1->y, s.p2->y), std::min(s.p1->z, s.p2->z) },
+				Point3{ std::max(s.p1->x, s.p2->x), std::max(s.p1->y, s.p2->y), std::max(s.p1->z, s.p2->z) } };
 		};
+		std::vector<AABBox> b_boxes(b->data.size());
+		for (size_t j = 0; j < b->data.size(); ++j)
+			b_boxes[j] = seg_box(*b->data[j]);
 
-		if (min_dist > std::min(std::min(dist_xmid, dist_ymid), dist_zmid))
+		for (size_t i = 0; i < a->data.size(); ++i)
 		{
-			if (min_dist > dist_xmid)
+			auto& sa = a->data[i];
+			AABBox a_box = seg_box(*sa);
+			for (size_t j = same ? i + 1 : 0; j < b->data.size(); ++j)
 			{
-				// 1->0; 3->2; 5->4; 7->6
-				if (point_octant % 2)
-				{
-					d_indx = point_octant - 1;
-				}
-				// 0->1; 2->3; 4->5; 6->7;
+				auto& sb = b->data[j];
+				if (sa->id + 1 >= sb->id && sb->id + 1 >= sa->id)
+					continue;
+				if (a_box.euc_dist(b_boxes[j]) > tolerance)
+					continue;
+				auto [d, p1, p2] = sa->seg_dist(*sb);
+				if (d > tolerance)
+					continue;
+				if (sa->id < sb->id)
+					out.push_back(SegmentPair{ d, sa->id, sb->id, p1, p2 });
 				else
-				{
-					d_indx = point_octant + 1;
-				}
-				search_neighbour(d_indx);
+					out.push_back(SegmentPair{ d, sb->id, sa->id, p2, p1 });
 			}
-			if (min_dist > dist_ymid)
+		}
+		return;
+	}
+
+	if (same)
+	{
+		auto parts = node_parts(a);
+		for (size_t i = 0; i < parts.size(); ++i)
+			for (size_t j = i; j < parts.size(); ++j)
+				dual_collect(parts[i].first, parts[i].second, parts[j].first, parts[j].second, tolerance, out);
+		return;
+	}
+
+	auto span = [](const AABBox& box) {
+		Point3 diff = box.rMax - box.lMin;
+		return std::max(std::max(diff.x, diff.y), diff.z);
+	};
+	bool split_a = !a_leaf && (b_leaf || span(a->bounds) >= span(b->bounds));
+	for (auto& [node, own] : node_parts(split_a ? a : b))
+	{
+		if (split_a)
+			dual_collect(node, own, b, b_own, tolerance, out);
+		else
+			dual_collect(a, a_own, node, own, tolerance, out);
+	}
+}
+
+template<>
+std::vector<SegmentPair> Octree<Segment>::self_contacts(double tolerance, TaskPool* pool)
+{
+	std::vector<SegmentPair> contacts;
+	if (root == nullptr)
+		return contacts;
+
+	if (pool == nullptr)
+	{
+		dual_collect(root.get(), false, root.get(), false, tolerance, contacts);
+	}
+	else
+	{
+		auto parts = node_parts(root.get());
+		std::mutex mtx;
+		TaskGroup group;
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			for (size_t j = i; j < parts.size(); ++j)
 			{
-				if (point_octant < 4)
-				{
-					d_indx = 3 - point_octant;
-				}
-				else
-				{
-					d_indx = 7 - point_octant;
-				}
-				search_neighbour(d_indx);
+				pool->submit(group, [this, &parts, i, j, tolerance, &contacts, &mtx]()
+					{
+						std::vector<SegmentPair> local;
+						dual_collect(parts[i].first, parts[i].second, parts[j].first, parts[j].second, tolerance, local);
+						std::lock_guard<std::mutex> lock(mtx);
+						contacts.insert(contacts.end(), local.begin(), local.end());
+					});
 			}
+		}
+		pool->wait(group);
+	}
 
-			if (min_dist > dist_zmid)
+	// a segment may be stored in more than one node
+	auto by_ids = [](const SegmentPair& a, const SegmentPair& b) { return std::make_pair(a.id1, a.id2) < std::make_pair(b.id1, b.id2); };
+	std::sort(contacts.begin(), contacts.end(), by_ids);
+	contacts.erase(std::unique(contacts.begin(), contacts.end(), 
+		[](const SegmentPair& a, const SegmentPair& b) { return a.id1 == b.id1 && a.id2 == b.id2; }), contacts.end());
+	return contacts;
+}
+
+template<>
+void Octree<Segment>::unique_hits(std::vector<SegmentPair>& hits)
+{
+	// a segment may be stored in more than one node
+	auto key = [](const SegmentPair& h) { return std::make_pair(h.id2, h.id1); };
+	std::sort(hits.begin(), hits.end(), [&](const SegmentPair& a, const SegmentPair& b) { return key(a) < key(b); });
+	hits.erase(std::unique(hits.begin(), hits.end(), [&](const SegmentPair& a, const SegmentPair& b) { return key(a) == key(b); }), hits.end());
+}
+
+template<>
+bool Octree<Segment>::corridor_search(std::shared_ptr<TreeItem<Segment>>& tree, std::vector<Segment>& queries, std::vector<AABBox>& query_boxes,
+	const std::vector<size_t>& active, double r, size_t max_hits, std::vector<SegmentPair>& out)
+{
+	std::vector<size_t> reaching;
+	for (size_t q : active)
+		if (query_boxes[q].euc_dist(tree->bounds) <= r)
+			reaching.push_back(q);
+	if (reaching.empty())
+		return true;
+
+	for (auto& s : tree->data)
+	{
+		AABBox s_box = segment_box(*s);
+		for (size_t q : reaching)
+		{
+			if (query_boxes[q].euc_dist(s_box) > r)
+				continue;
+			auto [d, p_seg, p_query] = s->seg_dist(queries[q]);
+			if (d > r)
+				continue;
+			out.push_back(SegmentPair{ d, s->id, q, p_seg, p_query });
+			// the repeats are dropped only when the raw hits are twice the limit, not on every hit
+			if (out.size() / 2 > max_hits)
 			{
-				if (point_octant < 4)
-				{
-					d_indx = point_octant + 4;
-				}
-				else
-				{
-					d_indx = point_octant - 4;
-				}
-				search_neighbour(d_indx);
-			}	
+				unique_hits(out);
+				if (out.size() > max_hits)
+					return false;
+			}
 		}
 	}
-	if (!min_ids.size())
-		min_dist = std::numeric_limits<double>::quiet_NaN();
-	return std::make_tuple(min_dist, min_ids, min_proj);
 
+	for (auto& d_tree : tree->descendants)
+		if (!corridor_search(d_tree, queries, query_boxes, reaching, r, max_hits, out))
+			return false;
+	return true;
+}
+
+template<>
+std::vector<SegmentPair> Octree<Segment>::corridor(std::vector<Segment>& queries, double r, size_t max_hits)
+{
+	std::vector<SegmentPair> hits;
+	if (root == nullptr || queries.empty())
+		return hits;
+
+	std::vector<AABBox> query_boxes(queries.size());
+	std::vector<size_t> active(queries.size());
+	for (size_t q = 0; q < queries.size(); ++q)
+	{
+		query_boxes[q] = segment_box(queries[q]);
+		active[q] = q;
+	}
+	corridor_search(root, queries, query_boxes, active, r, max_hits, hits);
+	unique_hits(hits);
+	if (hits.size() > max_hits)
+		hits.resize(max_hits + 1);
+	return hits;
 }
 
+template<>
+AABBox Octree<Segment>::refit_bounds(std::shared_ptr<TreeItem<Segment>>& tree)
+{
+	// empty box: infinitely far from any point
+	const double inf = std::numeric_limits<double>::infinity();
+	AABBox box{ Point3{ inf, inf, inf }, Point3{ -inf, -inf, -inf } };
+	for (auto& d_tree : tree->descendants)
+		box = box_union(box, refit_bounds(d_tree));
+	for (auto& s : tree->data)
+		box = box_union(box, segment_box(*s));
+	// the vertices have moved, so have the boxes of the segments
+	tree->update_blocks();
+	tree->bounds = box;
+	return box;
+}
+
+template<>
+size_t Octree<Segment>::rebuild_degraded(std::shared_ptr<TreeItem<Segment>>& tree, double max_overhang)
+{
+	const AABBox& b = tree->bounds;
+	const AABBox& c = tree->cell;
+	Point3 ext = c.rMax - c.lMin;
+	double margin = max_overhang * std::max({ ext.x, ext.y, ext.z });
+	bool degraded = b.lMin.x < c.lMin.x - margin || b.lMin.y < c.lMin.y - margin || b.lMin.z < c.lMin.z - margin ||
+		b.rMax.x > c.rMax.x + margin || b.rMax.y > c.rMax.y + margin || b.rMax.z > c.rMax.z + margin;
+
+	if (!degraded)
+	{
+		size_t rebuilt = 0;
+		for (auto& d_tree : tree->descendants)
+			rebuilt += rebuild_degraded(d_tree, max_overhang);
+		return rebuilt;
+	}
+
+	// the same segment records are inserted into a new subtree over the fitted box
+	std::vector<std::shared_ptr<Segment>> segments;
+	std::unordered_set<size_t> seen;
+	std::vector<TreeItem<Segment>*> stack{ tree.get() };
+	while (!stack.empty())
+	{
+		auto node = stack.back();
+		stack.pop_back();
+		for (auto& s : node->data)
+			if (seen.insert(s->id).second)
+				segments.push_back(s);
+		for (auto& d_tree : node->descendants)
+			stack.push_back(d_tree.get());
+	}
+	std::sort(segments.begin(), segments.end(), [](auto& a, auto& b) { return a->id < b->id; });
+
+	tree = std::make_shared<TreeItem<Segment>>(b);
+	for (auto& s : segments)
+		insert(s, tree);
+	return 1;
+}
+
+template<>
+size_t Octree<Segment>::refit(double max_overhang)
+{
+	if (root == nullptr)
+		return 0;
+	refitted = true;
+	refit_bounds(root);
+	if (frozen)
+		return 0;
+	return rebuild_degraded(root, max_overhang);
+}
+
+void QueryPacket::reset(size_t size)
+{
+	if (size > MAX)
+		throw std::runtime_error("Too many queries in the packet!");
+	n = size;
+	for (size_t k = 0; k < n; ++k)
+	{
+		min_dist[k] = std::numeric_limits<double>::max();
+		min_ids[k].clear();
+		min_proj[k].clear();
+	}
+}
+
+template<>
+void Octree<Segment>::packet_search(std::shared_ptr<TreeItem<Segment>>& tree, QueryPacket& packet, uint32_t active)
+{
+	const size_t n = packet.n;
+	// box lower bounds of all the lanes, a fixed loop over SoA arrays
+	auto box_dists = [&](const AABBox& b, std::array<double, QueryPacket::MAX>& lb)
+	{
+		for (size_t k = 0; k < n; ++k)
+		{
+			double dx = std::max(std::max(b.lMin.x - packet.x[k], 0.), packet.x[k] - b.rMax.x);
+			double dy = std::max(std::max(b.lMin.y - packet.y[k], 0.), packet.y[k] - b.rMax.y);
+			double dz = std::max(std::max(b.lMin.z - packet.z[k], 0.), packet.z[k] - b.rMax.z);
+			lb[k] = std::sqrt(dx * dx + dy * dy + dz * dz);
+		}
+	};
+	auto reaching = [&](const std::array<double, QueryPacket::MAX>& lb, uint32_t mask)
+	{
+		uint32_t res = 0;
+		for (size_t k = 0; k < n; ++k)
+			if ((mask >> k & 1) && packet.closest[k].may_reach(lb[k]))
+				res |= uint32_t(1) << k;
+		return res;
+	};
+
+	std::array<double, QueryPacket::MAX> lb;
+	box_dists(tree->bounds, lb);
+	active = reaching(lb, active);
+	if (!active)
+		return;
+
+	for (auto& s : tree->data)
+	{
+		// the segment is loaded once, the cheap clamped projection filters the lanes for the exact distance
+		Point3 a = *s->p1, dir = *s->p2 - *s->p1;
+		double len2 = dir.x * dir.x + dir.y * dir.y + dir.z * dir.z;
+		double inv_len2 = len2 > 0 ? 1. / len2 : 0.;
+		double slack = 1e-9 * (1. + std::sqrt(len2));
+		for (size_t k = 0; k < n; ++k)
+		{
+			if (!(active >> k & 1))
+				continue;
+			Point3 ap{ packet.x[k] - a.x, packet.y[k] - a.y, packet.z[k] - a.z };
+			double t = std::clamp((ap.x * dir.x + ap.y * dir.y + ap.z * dir.z) * inv_len2, 0., 1.);
+			Point3 r = ap - dir * t;
+			double approx = std::sqrt(r.x * r.x + r.y * r.y + r.z * r.z);
+			if (!packet.closest[k].may_reach(approx - slack * (1. + approx)))
+				continue;
+
+			Point3 P{ packet.x[k], packet.y[k], packet.z[k] };
+			auto [d, p_proj] = s->euc_dist(P);
+			packet.closest[k].add(d, s->p1, s->p2, s->id, p_proj);
+		}
+	}
+
+	// children nearest to the packet first, each one gets only the lanes it may improve
+	size_t n_desc = tree->descendants.size();
+	std::array<std::pair<double, size_t>, 8> order;
+	std::array<uint32_t, 8> masks;
+	for (size_t c = 0; c < n_desc; ++c)
+	{
+		box_dists(tree->descendants[c]->bounds, lb);
+		masks[c] = reaching(lb, active);
+		double nearest = std::numeric_limits<double>::max();
+		for (size_t k = 0; k < n; ++k)
+			if (masks[c] >> k & 1)
+				nearest = std::min(nearest, lb[k]);
+		order[c] = std::make_pair(nearest, c);
+	}
+	std::sort(order.begin(), order.begin() + n_desc);
+	for (size_t c = 0; c < n_desc; ++c)
+		if (masks[order[c].second])
+			packet_search(tree->descendants[order[c].second], packet, masks[order[c].second]);
+}
+
+template<>
+void Octree<Segment>::locate_packet(QueryPacket& packet)
+{
+	if (root == nullptr || packet.n == 0)
+		return;
+	packet.closest.clear();
+	double scale = data_scale();
+	for (size_t k = 0; k < packet.n; ++k)
+		packet.closest.emplace_back(ties, Point3{ packet.x[k], packet.y[k], packet.z[k] }, scale);
+	packet_search(root, packet, uint32_t((uint64_t(1) << packet.n) - 1));
+	// resolve() also drops the repeated segments (a segment on an octant border is reached from more than one node)
+	for (size_t k = 0; k < packet.n; ++k)
+		std::tie(packet.min_dist[k], packet.min_ids[k], packet.min_proj[k]) = packet.closest[k].resolve();
+}
+
+template<>
+void Octree<Segment>::own(std::shared_ptr<TreeItem<Segment>>& tree, OwnedNodes& owned)
+{
+	if (owned.count(tree.get()))
+		return;
+	tree = std::make_shared<TreeItem<Segment>>(*tree);
+	owned.insert(tree.get());
+}
+
+static bool box_contains(const AABBox& outer, const AABBox& inner)
+{
+	return outer.lMin.x <= inner.lMin.x && outer.lMin.y <= inner.lMin.y && outer.lMin.z <= inner.lMin.z &&
+		outer.rMax.x >= inner.rMax.x && outer.rMax.y >= inner.rMax.y && outer.rMax.z >= inner.rMax.z;
+}
+
+template<>
+void Octree<Segment>::cow_remove(std::shared_ptr<TreeItem<Segment>>& tree, size_t id, const AABBox& box, OwnedNodes& owned)
+{
+	own(tree, owned);
+	auto& data = tree->data;
+	data.erase(std::remove_if(data.begin(), data.end(), [&](auto& s) { return s->id == id; }), data.end());
+	tree->update_blocks();
+	// a segment is stored only in the nodes whose boxes contain it (more than one on the octant borders)
+	for (auto& d_tree : tree->descendants)
+		if (box_contains(d_tree->bounds, box))
+			cow_remove(d_tree, id, box, owned);
+}
+
+template<>
+void Octree<Segment>::cow_insert(std::shared_ptr<Segment> s, std::shared_ptr<TreeItem<Segment>>& tree, OwnedNodes& owned)
+{
+	own(tree, owned);
+	tree->bounds = box_union(tree->bounds, segment_box(*s));
+	if (tree->descendants.empty())
+	{
+		if (tree->data.size() <= MAX_R)
+		{
+			tree->push_data(s);
+			return;
+		}
+		// the new children belong to this update only
+		tree->split();
+		for (auto& d_tree : tree->descendants)
+			owned.insert(d_tree.get());
+		std::vector<std::shared_ptr<Segment>> elements;
+		elements.swap(tree->data);
+		std::vector<BoxBlock>().swap(tree->blocks);
+		elements.push_back(s);
+		for (auto& e : elements)
+			cow_insert(e, tree, owned);
+		return;
+	}
+
+	bool placed = false;
+	for (auto& d_tree : tree->descendants)
+	{
+		auto [inside, both_inside] = d_tree->is_inside(*s);
+		if (both_inside)
+		{
+			cow_insert(s, d_tree, owned);
+			placed = true;
+		}
+		else if (inside)
+			break;
+	}
+	if (!placed)
+		tree->push_data(s);
+}
+
+template<>
+std::shared_ptr<Octree<Segment>> Octree<Segment>::copy_on_write(const std::vector<std::pair<size_t, AABBox>>& removed,
+	const std::vector<std::shared_ptr<Segment>>& inserted)
+{
+	if (frozen)
+		throw std::runtime_error("Octree is compacted, no insertions allowed!");
+	auto copy = std::make_shared<Octree<Segment>>(*this);
+	// bounds are grown by the inserted segments and not shrunk by the removed ones
+	copy->refitted = true;
+	OwnedNodes owned;
+	for (auto& [id, box] : removed)
+		copy->cow_remove(copy->root, id, box, owned);
+	for (auto& s : inserted)
+		copy->cow_insert(s, copy->root, owned);
+	return copy;
+}
+
+template<>
+double Octree<Segment>::data_scale() const
+{
+	if (root == nullptr)
+		return 0.;
+	auto& b = root->bounds;
+	return std::max({ std::abs(b.lMin.x), std::abs(b.lMin.y), std::abs(b.lMin.z), std::abs(b.rMax.x), std::abs(b.rMax.y), std::abs(b.rMax.z) });
+}
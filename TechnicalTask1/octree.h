@@ -1,6 +1,67 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <limits>
 #include <list>
+#include <mutex>
+#include <unordered_set>
 #include "octree_item.h"
+#include "task_pool.h"
+#include "tie_policy.h"
+
+// Memory used by a polyline and its index, bytes
+struct MemoryUsage
+{
+	size_t vertices = 0;
+	// tree nodes themselves (with their shared_ptr control blocks)
+	size_t nodes = 0;
+	// per-node lists: data and descendants vectors (by capacity)
+	size_t node_lists = 0;
+	// segment records (with their shared_ptr control blocks, if allocated one by one)
+	size_t segments = 0;
+
+	size_t total() const { return vertices + nodes + node_lists + segments; }
+};
+
+// Current best of a query shared by the tasks of parallel search
+struct SharedBest
+{
+	std::mutex mtx;
+	// closest segments found by all the tasks, under mtx
+	ClosestSegments closest;
+	// closest.min() and the bound of closest.may_reach, read by the tasks without the lock
+	std::atomic<double> min_dist;
+	std::atomic<double> reach;
+
+	SharedBest(const ClosestSegments& closest);
+	// merges the candidates found by a task
+	void merge(const ClosestSegments& local);
+};
+
+// Closest pair of segments found so far by the dual-tree search, shared by its tasks
+struct SharedPair
+{
+	std::atomic<double> min_dist;
+	std::mutex mtx;
+	SegmentPair pair;
+
+	void update(const SegmentPair& candidate);
+};
+
+// Up to MAX queries traversing the tree together, coordinates in SoA layout
+struct QueryPacket
+{
+	static constexpr size_t MAX = 16;
+	size_t n = 0;
+	std::array<double, MAX> x, y, z;
+	std::array<double, MAX> min_dist;
+	std::array<std::vector<size_t>, MAX> min_ids;
+	std::array<std::vector<Point3>, MAX> min_proj;
+	// per-lane closest segments under the tie policy of the tree, resolved into min_dist, min_ids, min_proj
+	std::vector<ClosestSegments> closest;
+
+	void reset(size_t size);
+};
 
 template <class T>
 class Octree
@@ -8,9 +69,21 @@ class Octree
 	std::shared_ptr<TreeItem<T>> root;
 	size_t MAX_R;	// max data items in box
 	bool verbose = false;
+	// set by compact(), no more insertions allowed
+	bool frozen = false;
+	// vertices have moved since the construction, bounds are fitted boxes rather than octants
+	bool refitted = false;
+	// after compact() all the segments live here, nodes refer to them by aliasing shared_ptr
+	std::shared_ptr<std::vector<T>> segment_pool;
+	// ties of the exact searches
+	TiePolicy ties;
 
 	void push_back(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& cur_tree);
 
+	// removes descendants that are all empty leaves, shrinks node lists to fit
+	// returns true if the node is an empty leaf afterwards
+	bool prune(std::shared_ptr<TreeItem<T>>& tree);
+
 	
 	std::tuple<
 		double, 
@@ -18,14 +91,14 @@ class Octree
 		std::vector<Point3>
 	> locate_point(Point3& p, std::shared_ptr<TreeItem<T>>& tree);
 
-	// Projects the point p, which is outside the BBox, onto the closest BBox plane
+	// Projects the point p, which is outside the BBox, onto the BBox
 	// p - point to be projected;
 	// tree - Octree node whose BBox does not contain the point p 
-	// returns the coordinates of projection
+	// returns the point of the BBox closest to p
 	Point3 project_closest(Point3& p, std::shared_ptr<TreeItem<T>>& tree);
 	
 	// Recursivey searches octree for point p_proj (whinch might be equal to p, 
-	// if p is inside octree root BBox, or is the projection onto the closest Bbox plane otherwise)
+	// if p is inside octree root BBox, or is the closest point of the BBox otherwise)
 	// returns:
 	//		mininmum distance, 
 	//		ids of the closest segments, 
@@ -33,11 +106,62 @@ class Octree
 	// this, actually, is a violation of obj-oriented principles, basically, 
 	// octree should not care for the distances and projections, and should only return the octant
 	// to then use the greedy search on it
-	std::tuple<
-		double, 
-		std::vector<size_t>, 
-		std::vector<Point3>>
-		depth_first_search(Point3& p, Point3& p_proj, std::shared_ptr<TreeItem<T>>& tree);
+	// the closest segments found are collected in closest
+	void depth_first_search(Point3& p, Point3& p_proj, std::shared_ptr<TreeItem<T>>& tree, ClosestSegments& closest);
+
+	// Branch-and-bound search for the approximate nearest segment:
+	// a node is skipped if its BBox distance to p, scaled by (1 + eps), is not below min_dist,
+	// so the distance found is at most (1 + eps) times the optimal one
+	// min_dist, min_id, min_proj hold the current best candidate and are updated in place
+	void branch_and_bound(Point3& p, double eps, std::shared_ptr<TreeItem<T>>& tree,
+		double& min_dist, size_t& min_id, Point3& min_proj);
+
+	// exact distances of the node data within the reach of closest: a block of boxes (see BoxBlock)
+	// farther than the reach is skipped at once, the rest item by item
+	void scan_blocks(Point3& p, TreeItem<T>& tree, ClosestSegments& closest);
+
+	// Exact branch-and-bound search collecting all the closest segments,
+	// nodes beyond the reach of the current ties are skipped
+	void bounded_search(Point3& p, std::shared_ptr<TreeItem<T>>& tree, ClosestSegments& closest);
+
+	// Parallel branch-and-bound: large node data is scanned in chunks of PARALLEL_CHUNK segments
+	// and descendants are searched in separate tasks of the pool, 
+	// all sharing the current best distance
+	void parallel_search(Point3& p, std::shared_ptr<TreeItem<T>>& tree, SharedBest& best, TaskPool& pool, TaskGroup& group);
+	// scans tree->data[begin, end)
+	void scan_data(Point3& p, std::shared_ptr<TreeItem<T>>& tree, size_t begin, size_t end, SharedBest& best);
+	static constexpr size_t PARALLEL_CHUNK = 1024;
+
+	// Simultaneous traversal of two trees: a node enters either with its whole subtree, 
+	// or with its own data only (own = true), pairs of boxes farther apart than the best pair are pruned
+	void dual_search(TreeItem<T>* a, bool a_own, TreeItem<T>* b, bool b_own, SharedPair& best);
+	// Collects the pairs of non-adjacent segments not farther than tolerance, 
+	// a == b is the self-traversal, where each pair of parts is taken once
+	void dual_collect(TreeItem<T>* a, bool a_own, TreeItem<T>* b, bool b_own, double tolerance, std::vector<SegmentPair>& out);
+	// Corridor search: active - indices of the query segments whose boxes are within r of the node box
+	// stops and returns false once out holds more than max_hits different hits
+	bool corridor_search(std::shared_ptr<TreeItem<T>>& tree, std::vector<T>& queries, std::vector<AABBox>& query_boxes,
+		const std::vector<size_t>& active, double r, size_t max_hits, std::vector<SegmentPair>& out);
+	// sorts the hits by query segment index and segment id, drops the repeated ones
+	static void unique_hits(std::vector<SegmentPair>& hits);
+	// lanes of the active mask whose lower bound at the node does not exceed their minimal distance go down,
+	// the node data is scanned once for all of them
+	void packet_search(std::shared_ptr<TreeItem<T>>& tree, QueryPacket& packet, uint32_t active);
+	// bottom-up pass: bounds of every node are fitted to the current segments
+	AABBox refit_bounds(std::shared_ptr<TreeItem<T>>& tree);
+	// top-down pass: the topmost nodes whose bounds stick out of their cells by more than max_overhang
+	// of the largest cell side are rebuilt, with their bounds as the new cell
+	size_t rebuild_degraded(std::shared_ptr<TreeItem<T>>& tree, double max_overhang);
+	// nodes copied by the current copy-on-write update
+	using OwnedNodes = std::unordered_set<TreeItem<T>*>;
+	// replaces the node by its shallow copy (sharing the descendants and the segment records), unless already copied
+	static void own(std::shared_ptr<TreeItem<T>>& tree, OwnedNodes& owned);
+	// removes the records of segment id from the copied nodes whose bounds contain box (its box when inserted)
+	void cow_remove(std::shared_ptr<TreeItem<T>>& tree, size_t id, const AABBox& box, OwnedNodes& owned);
+	// insert over copied nodes, the bounds grow to the segment; a segment outside of all the children stays in the node
+	void cow_insert(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& tree, OwnedNodes& owned);
+	// a node split into its own data and its descendants
+	static std::vector<std::pair<TreeItem<T>*, bool>> node_parts(TreeItem<T>* tree);
 
 public:
 	
@@ -45,7 +169,59 @@ public:
 	~Octree() {}
 	
 	std::shared_ptr<TreeItem<T>> construct(AABBox bounds, std::vector<Point3>&);
+	// construction from the segment records (e.g. over vertices that are not contiguous)
+	std::shared_ptr<TreeItem<T>> construct(AABBox bounds, std::vector<std::shared_ptr<T>>& segments);
    	void insert(std::shared_ptr<T> s, std::shared_ptr<TreeItem<T>>& cur_tree);
    	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p);
+	// (1 + eps)-approximate nearest segment, ties are not collected: 
+	// returns a single segment id and projection
+   	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_approx(Point3& p, double eps);
+	// exact search when the minimal distance is known not to exceed upper_bound 
+	// (e.g. from a previous query for a nearby point)
+   	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_bounded(Point3& p, double upper_bound);
+	// tie policy of all the exact searches (locate_point, locate_point_bounded, locate_point_parallel, locate_packet)
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+	const TiePolicy& get_tie_policy() const { return ties; }
+	// largest coordinate magnitude of the root box, the scale of the distance errors
+	double data_scale() const;
+	// exact search for a single point using the threads of the pool
+   	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_parallel(Point3& p, TaskPool& pool);
+
+	// Exact search for all the queries of the packet at once (ties included), see Polyline::locate_points
+	void locate_packet(QueryPacket& packet);
+
+	// Minimal distance between the segments of this tree and of the other one,
+	// pairs of top-level octants are searched in parallel if the pool is given
+	SegmentPair min_distance(Octree<T>& other, TaskPool* pool = nullptr);
+
+	// Pairs of non-adjacent segments of the tree (|id1 - id2| > 1) not farther than tolerance apart,
+	// sorted by ids, id1 < id2; pairs of top-level octants are processed in parallel if the pool is given
+	std::vector<SegmentPair> self_contacts(double tolerance, TaskPool* pool = nullptr);
+
+	// Corridor query: all the segments within distance r of the query segments,
+	// the tree is traversed once for all of them, a node is visited with those query segments that may reach it
+	// returns {distance, segment id, query segment index, point on the segment, point on the query segment},
+	// sorted by query segment index and segment id
+	// the enumeration stops after more than max_hits hits: then max_hits + 1 of them are returned
+	std::vector<SegmentPair> corridor(std::vector<T>& queries, double r, size_t max_hits = std::numeric_limits<size_t>::max());
+
+	// To be called after the vertices have moved (the segments keep pointing to them):
+	// refits the node boxes in one bottom-up pass and rebuilds only the degraded subtrees
+	// (none for a compacted tree), returns the number of rebuilt subtrees
+	// the searches stay exact; locate_point switches from the octant walk to the branch-and-bound search
+	size_t refit(double max_overhang = 0.5);
+
+	// Copy-on-write update: a new tree sharing with this one all the nodes but those on the paths
+	// of the removed and of the inserted segments, this tree is not modified (and may be searched meanwhile)
+	// removed - {segment id, box of the segment when it was inserted}, inserted - new segment records
+	// the copy has fitted bounds (see refit); not for a compacted tree
+	std::shared_ptr<Octree<T>> copy_on_write(const std::vector<std::pair<size_t, AABBox>>& removed,
+		const std::vector<std::shared_ptr<T>>& inserted);
+
+	MemoryUsage memory_usage();
+	// Post-build compaction: prunes empty octants, shrinks node lists to fit 
+	// and moves segments into one contiguous pool; the tree becomes read-only
+	void compact();
+	bool is_frozen() const { return frozen; }
 
  };
\ No newline at end of file
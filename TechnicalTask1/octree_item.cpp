@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <limits>
 #include "octree_item.h"
 #include "polyline.h"
 
 void TreeItem<Segment>::split()
 {
+	const AABBox& bounds = cell;
 	Point3 center = bounds.lMin + (bounds.rMax - bounds.lMin) * 0.5;
 	
 	descendants.resize(8);
@@ -35,11 +38,61 @@ void TreeItem<Segment>::split()
 
 std::tuple<bool, size_t> TreeItem<Segment>::is_inside(Segment& obj)
 {
-	bool p1_inside = bounds.is_inside(*(obj.p1));
-	bool p2_inside = bounds.is_inside(*(obj.p2));
+	bool p1_inside = cell.is_inside(*(obj.p1));
+	bool p2_inside = cell.is_inside(*(obj.p2));
 	return std::make_tuple(p1_inside || p2_inside, p1_inside && p2_inside);
 }
 
+template<>
+void TreeItem<Segment>::push_data(std::shared_ptr<Segment> obj)
+{
+	size_t slot = data.size() % BoxBlock::LANES;
+	if (slot == 0)
+		blocks.emplace_back();
+	blocks.back().set(slot, AABBox::of(*obj->p1, *obj->p2));
+	data.push_back(std::move(obj));
+}
+
+template<>
+void TreeItem<Segment>::update_blocks()
+{
+	blocks.assign((data.size() + BoxBlock::LANES - 1) / BoxBlock::LANES, BoxBlock());
+	for (size_t i = 0; i < data.size(); ++i)
+		blocks[i / BoxBlock::LANES].set(i % BoxBlock::LANES, AABBox::of(*data[i]->p1, *data[i]->p2));
+}
+
+BoxBlock::BoxBlock()
+{
+	const double inf = std::numeric_limits<double>::infinity();
+	lo_x.fill(inf); lo_y.fill(inf); lo_z.fill(inf);
+	hi_x.fill(-inf); hi_y.fill(-inf); hi_z.fill(-inf);
+}
+
+void BoxBlock::set(size_t slot, const AABBox& box)
+{
+	lo_x[slot] = box.lMin.x; lo_y[slot] = box.lMin.y; lo_z[slot] = box.lMin.z;
+	hi_x[slot] = box.rMax.x; hi_y[slot] = box.rMax.y; hi_z[slot] = box.rMax.z;
+}
+
+double BoxBlock::dist2(const Point3& p, std::array<double, LANES>& d2) const
+{
+	// branchless over the lanes, vectorized by the compiler
+	for (size_t s = 0; s < LANES; ++s)
+	{
+		double dx = std::max(std::max(lo_x[s] - p.x, 0.), p.x - hi_x[s]);
+		double dy = std::max(std::max(lo_y[s] - p.y, 0.), p.y - hi_y[s]);
+		double dz = std::max(std::max(lo_z[s] - p.z, 0.), p.z - hi_z[s]);
+		d2[s] = dx * dx + dy * dy + dz * dz;
+	}
+	return *std::min_element(d2.begin(), d2.end());
+}
+
+AABBox AABBox::of(const Point3& a, const Point3& b)
+{
+	return AABBox{
+		Point3{ std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) },
+		Point3{ std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) } };
+}
 
 bool AABBox::is_inside(const Point3& p) const
 {
@@ -49,6 +102,22 @@ bool AABBox::is_inside(const Point3& p) const
 	return true;
 }
 
+double AABBox::euc_dist(const Point3& p) const
+{
+	double dx = std::max(std::max(lMin.x - p.x, 0.), p.x - rMax.x);
+	double dy = std::max(std::max(lMin.y - p.y, 0.), p.y - rMax.y);
+	double dz = std::max(std::max(lMin.z - p.z, 0.), p.z - rMax.z);
+	return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+double AABBox::euc_dist(const AABBox& b) const
+{
+	double dx = std::max(std::max(lMin.x - b.rMax.x, 0.), b.lMin.x - rMax.x);
+	double dy = std::max(std::max(lMin.y - b.rMax.y, 0.), b.lMin.y - rMax.y);
+	double dz = std::max(std::max(lMin.z - b.rMax.z, 0.), b.lMin.z - rMax.z);
+	return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
 //    4 | Z
 //    --------- 7   
 // 5/   |   6 /|
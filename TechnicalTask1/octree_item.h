@@ -1,6 +1,7 @@
 #pragma once
 #ifndef OCTREE_ITEM_H
 #define OCTREE_ITEM_H
+#include <array>
 #include <vector>
 #include <memory>
 #include <tuple>
@@ -16,8 +17,37 @@ struct AABBox
 	template <class T>
 	bool is_inside(const T& s) const;
 	bool is_inside(const Point3& s) const;
+	// distance from p to the box (0 if p is inside), 
+	// a lower bound for the distance from p to anything stored in the box
+	double euc_dist(const Point3& p) const;
+	// distance between two boxes (0 if they intersect)
+	double euc_dist(const AABBox& b) const;
 	std::array<Point3, 8> get_all_points() const;
 	std::array<Point3, 4> get_plane_points(size_t id) const;
+	// box of the segment [a, b]
+	static AABBox of(const Point3& a, const Point3& b);
+};
+
+// Boxes of LANES consecutive node data items in SoA layout, a coordinate of all the lanes per (AVX) register
+// empty slots have inverted boxes, infinitely far from any point
+struct alignas(32) BoxBlock
+{
+	static constexpr size_t LANES = 4;
+	std::array<double, LANES> lo_x, lo_y, lo_z, hi_x, hi_y, hi_z;
+
+	BoxBlock();
+	void set(size_t slot, const AABBox& box);
+	// squared distances from p to the boxes of the slots, lower bounds of the squared item distances
+	// returns the smallest of them
+	double dist2(const Point3& p, std::array<double, LANES>& d2) const;
+};
+
+// Closest points of two segments
+struct SegmentPair
+{
+	double dist;
+	size_t id1, id2;
+	Point3 p1, p2;
 };
 
 template <class T>
@@ -26,9 +56,14 @@ class TreeItem
 public:
 	std::vector<std::shared_ptr<TreeItem>> descendants;
 	std::vector<std::shared_ptr< T>> data;
+	// boxes of the data items: data[i] is the slot i % LANES of blocks[i / LANES]
+	std::vector<BoxBlock> blocks;
+	// box containing everything stored in the subtree, used by the searches
 	AABBox bounds;
+	// octant of the node, used to place the items and to split (bounds == cell until the tree is refitted)
+	AABBox cell;
 
-	TreeItem(AABBox bounds) : bounds(bounds) {}
+	TreeItem(AABBox bounds) : bounds(bounds), cell(bounds) {}
 
 	~TreeItem()
 	{
@@ -38,6 +73,10 @@ public:
 
 	void split();
 	std::tuple<bool, size_t> is_inside(T& obj);
+	// appends the item to data and its box to blocks
+	void push_data(std::shared_ptr<T> obj);
+	// rebuilds blocks after data items were removed or have moved
+	void update_blocks();
 };
 
 #endif
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include "paged_polyline.h"
+#include "polyline.h"
+
+static const char PAGED_MAGIC[4] = { 'P', 'L', 'P', '1' };
+// magic, n_points, page_vertices, n_pages, directory offset
+static const size_t HEADER_SIZE = sizeof(PAGED_MAGIC) + 4 * sizeof(unsigned long long);
+
+static_assert(sizeof(Point3) == 3 * sizeof(double), "Pages are read directly into Point3 arrays");
+
+template<class T>
+static void write_value(std::ofstream& out, const T& v)
+{
+	out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template<class T>
+static void read_value(std::ifstream& in, T& v)
+{
+	in.read(reinterpret_cast<char*>(&v), sizeof(T));
+}
+
+static AABBox points_bounds(const Point3* begin, const Point3* end)
+{
+	AABBox box{ *begin, *begin };
+	for (auto p = begin; p != end; ++p)
+	{
+		box.lMin = Point3{ std::min(box.lMin.x, p->x), std::min(box.lMin.y, p->y), std::min(box.lMin.z, p->z) };
+		box.rMax = Point3{ std::max(box.rMax.x, p->x), std::max(box.rMax.y, p->y), std::max(box.rMax.z, p->z) };
+	}
+	return box;
+}
+
+static AABBox box_union(const AABBox& a, const AABBox& b)
+{
+	return AABBox{
+		Point3{ std::min(a.lMin.x, b.lMin.x), std::min(a.lMin.y, b.lMin.y), std::min(a.lMin.z, b.lMin.z) },
+		Point3{ std::max(a.rMax.x, b.rMax.x), std::max(a.rMax.y, b.rMax.y), std::max(a.rMax.z, b.rMax.z) } };
+}
+
+///____________________________________________________________________________________
+
+PagedFileWriter::PagedFileWriter(const std::string& filename, size_t page_vertices) :
+	out(filename, std::ios::out | std::ios::binary | std::ios::trunc), page_vertices(page_vertices)
+{
+	if (!out.is_open())
+		throw std::runtime_error("Cannot create paged file " + filename);
+	if (page_vertices < 1)
+		throw std::runtime_error("Page must hold at least one segment!");
+	// placeholder, rewritten by finish
+	out.write(std::string(HEADER_SIZE, '\0').data(), HEADER_SIZE);
+	page.reserve(page_vertices + 1);
+}
+
+PagedFileWriter::~PagedFileWriter()
+{
+	// an unfinished file is left invalid (zero magic), exceptions must not leave the destructor
+	if (!finished)
+		out.close();
+}
+
+void PagedFileWriter::add(const Point3& p)
+{
+	if (finished)
+		throw std::runtime_error("Paged file is already finished!");
+	page.push_back(p);
+	++n_points;
+	if (page.size() == page_vertices + 1)
+	{
+		flush_page();
+		// the last vertex starts the next page
+		page = std::vector<Point3>{ p };
+		page.reserve(page_vertices + 1);
+	}
+}
+
+void PagedFileWriter::flush_page()
+{
+	directory.push_back(PageEntry{ (unsigned long long)out.tellp(), page.size(), points_bounds(page.data(), page.data() + page.size()) });
+	out.write(reinterpret_cast<const char*>(page.data()), page.size() * sizeof(Point3));
+}
+
+void PagedFileWriter::finish()
+{
+	if (finished)
+		return;
+	if (n_points < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	// a single vertex left is the end of the previous page
+	if (page.size() > 1)
+		flush_page();
+
+	unsigned long long dir_offset = out.tellp();
+	for (auto& e : directory)
+	{
+		write_value(out, e.offset);
+		write_value(out, e.count);
+		write_value(out, e.bounds.lMin);
+		write_value(out, e.bounds.rMax);
+	}
+	out.seekp(0);
+	out.write(PAGED_MAGIC, sizeof(PAGED_MAGIC));
+	write_value(out, (unsigned long long)n_points);
+	write_value(out, (unsigned long long)page_vertices);
+	write_value(out, (unsigned long long)directory.size());
+	write_value(out, dir_offset);
+	out.close();
+	if (out.fail())
+		throw std::runtime_error("Cannot write paged file!");
+	finished = true;
+}
+
+void PagedFileWriter::write(const std::vector<Point3>& points, const std::string& filename, size_t page_vertices)
+{
+	PagedFileWriter writer(filename, page_vertices);
+	for (auto& p : points)
+		writer.add(p);
+	writer.finish();
+}
+
+void PagedFileWriter::convert_text(const std::string& text_file, const std::string& filename, size_t page_vertices)
+{
+	std::ifstream in(text_file, std::ios::in);
+	if (!in.is_open())
+		throw std::runtime_error("No file: " + text_file);
+	PagedFileWriter writer(filename, page_vertices);
+	double x, y, z;
+	while (in >> x >> y >> z)
+		writer.add(Point3{ x, y, z });
+	writer.finish();
+}
+
+///____________________________________________________________________________________
+
+size_t PagedPolyline::Page::memory() const
+{
+	return sizeof(Page) + vertices.capacity() * sizeof(Point3) + chunk_boxes.capacity() * sizeof(AABBox);
+}
+
+PagedPolyline::PagedPolyline(const std::string& filename, size_t memory_budget) :
+	in(filename, std::ios::in | std::ios::binary), budget(memory_budget)
+{
+	if (!in.is_open())
+		throw std::runtime_error("No file: " + filename);
+
+	char magic[sizeof(PAGED_MAGIC)];
+	unsigned long long n_pts, page_v, n_pages, dir_offset;
+	in.read(magic, sizeof(magic));
+	read_value(in, n_pts);
+	read_value(in, page_v);
+	read_value(in, n_pages);
+	read_value(in, dir_offset);
+	if (!in || std::memcmp(magic, PAGED_MAGIC, sizeof(magic)) != 0 || n_pages == 0)
+		throw std::runtime_error("Not a paged polyline file: " + filename);
+	n_points = n_pts;
+	page_vertices = page_v;
+
+	directory.resize(n_pages);
+	in.seekg(dir_offset);
+	for (auto& e : directory)
+	{
+		read_value(in, e.offset);
+		read_value(in, e.count);
+		read_value(in, e.bounds.lMin);
+		read_value(in, e.bounds.rMax);
+	}
+	if (!in)
+		throw std::runtime_error("Corrupted page directory: " + filename);
+
+	levels.emplace_back();
+	for (auto& e : directory)
+		levels[0].push_back(e.bounds);
+	while (levels.back().size() > 1)
+	{
+		auto& lower = levels.back();
+		std::vector<AABBox> upper((lower.size() + 1) / 2);
+		for (size_t i = 0; i < upper.size(); ++i)
+			upper[i] = 2 * i + 1 < lower.size() ? box_union(lower[2 * i], lower[2 * i + 1]) : lower[2 * i];
+		levels.push_back(std::move(upper));
+	}
+}
+
+std::shared_ptr<PagedPolyline::Page> PagedPolyline::fetch(size_t page_id)
+{
+	auto it = resident.find(page_id);
+	if (it != resident.end())
+	{
+		++stats.hits;
+		lru.splice(lru.begin(), lru, it->second.first);
+		return it->second.second;
+	}
+
+	++stats.faults;
+	auto& e = directory[page_id];
+	auto page = std::make_shared<Page>();
+	page->first = page_id * page_vertices;
+	page->vertices.resize(e.count);
+	in.clear();
+	in.seekg(e.offset);
+	in.read(reinterpret_cast<char*>(page->vertices.data()), e.count * sizeof(Point3));
+	if (!in)
+		throw std::runtime_error("Cannot read page " + std::to_string(page_id));
+	stats.bytes_read += e.count * sizeof(Point3);
+
+	size_t n_seg = e.count - 1;
+	for (size_t c = 0; c < n_seg; c += CHUNK)
+	{
+		auto begin = page->vertices.data() + c;
+		page->chunk_boxes.push_back(points_bounds(begin, begin + std::min(CHUNK, n_seg - c) + 1));
+	}
+
+	lru.push_front(page_id);
+	resident[page_id] = std::make_pair(lru.begin(), page);
+	stats.resident_bytes += page->memory();
+	trim();
+	return page;
+}
+
+void PagedPolyline::trim()
+{
+	// the most recent page stays
+	while (stats.resident_bytes > budget && lru.size() > 1)
+	{
+		auto it = resident.find(lru.back());
+		stats.resident_bytes -= it->second.second->memory();
+		resident.erase(it);
+		lru.pop_back();
+		++stats.evictions;
+	}
+}
+
+void PagedPolyline::set_memory_budget(size_t bytes)
+{
+	budget = bytes;
+	trim();
+}
+
+PageStats PagedPolyline::page_stats() const
+{
+	PageStats s = stats;
+	s.resident_pages = resident.size();
+	return s;
+}
+
+void PagedPolyline::reset_stats()
+{
+	size_t resident_bytes = stats.resident_bytes;
+	stats = PageStats{};
+	stats.resident_bytes = resident_bytes;
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> PagedPolyline::locate_point(Point3& p)
+{
+	size_t top = levels.size() - 1;
+	auto& root = levels[top][0];
+	double scale = std::max({ std::abs(root.lMin.x), std::abs(root.lMin.y), std::abs(root.lMin.z),
+		std::abs(root.rMax.x), std::abs(root.rMax.y), std::abs(root.rMax.z) });
+	// the candidates are copied, so the pages may be evicted during the search
+	ClosestSegments closest(ties, p, scale);
+	auto may_reach = [&](double lb) { return closest.may_reach(lb); };
+
+	// {lower bound, level, index}, nearest first
+	using Entry = std::tuple<double, size_t, size_t>;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+	queue.push(Entry{ root.euc_dist(p), top, 0 });
+
+	while (!queue.empty())
+	{
+		auto [lb, level, idx] = queue.top();
+		queue.pop();
+		if (!may_reach(lb))
+			break;
+
+		if (level > 0)
+		{
+			for (size_t c = 2 * idx; c < std::min(2 * idx + 2, levels[level - 1].size()); ++c)
+			{
+				double c_lb = levels[level - 1][c].euc_dist(p);
+				if (may_reach(c_lb))
+					queue.push(Entry{ c_lb, level - 1, c });
+			}
+			continue;
+		}
+
+		auto page = fetch(idx);
+		auto& v = page->vertices;
+		for (size_t c = 0; c < page->chunk_boxes.size(); ++c)
+		{
+			if (!may_reach(page->chunk_boxes[c].euc_dist(p)))
+				continue;
+			for (size_t j = c * CHUNK; j < std::min((c + 1) * CHUNK, v.size() - 1); ++j)
+			{
+				size_t id = page->first + j;
+				auto [d, p_proj] = Segment{ &v[j], &v[j + 1], id }.euc_dist(p);
+				closest.add(d, &v[j], &v[j + 1], id, p_proj);
+			}
+		}
+	}
+
+	return closest.resolve();
+}
@@ -0,0 +1,126 @@
+#pragma once
+#ifndef PAGED_POLYLINE_H
+#define PAGED_POLYLINE_H
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "octree_item.h"
+#include "tie_policy.h"
+
+// Paged polyline file:
+//		header {magic, n_points, page_vertices, n_pages, directory offset},
+//		pages - runs of page_vertices + 1 consecutive vertices (the last one is the first of the next page),
+//		so page k holds the segments [k * page_vertices, (k + 1) * page_vertices) entirely,
+//		directory - {file offset, number of vertices, AABBox} of every page
+// values are stored in the native byte order
+
+// Streams the vertices into a paged file, without keeping more than one page in memory
+class PagedFileWriter
+{
+public:
+	PagedFileWriter(const std::string& filename, size_t page_vertices = 4096);
+	~PagedFileWriter();
+
+	void add(const Point3& p);
+	// writes the last page and the directory, the file is not usable before it
+	void finish();
+
+	static void write(const std::vector<Point3>& points, const std::string& filename, size_t page_vertices = 4096);
+	// converts a text file of "x y z" triples (as read by the interactive mode)
+	static void convert_text(const std::string& text_file, const std::string& filename, size_t page_vertices = 4096);
+
+private:
+	struct PageEntry
+	{
+		unsigned long long offset, count;
+		AABBox bounds;
+	};
+
+	std::ofstream out;
+	size_t page_vertices;
+	size_t n_points = 0;
+	std::vector<Point3> page;
+	std::vector<PageEntry> directory;
+	bool finished = false;
+
+	void flush_page();
+
+	friend class PagedPolyline;
+};
+
+struct PageStats
+{
+	// page requests served from memory and from the file
+	size_t hits = 0;
+	size_t faults = 0;
+	size_t evictions = 0;
+	size_t bytes_read = 0;
+	size_t resident_pages = 0;
+	size_t resident_bytes = 0;
+
+	double hit_rate() const { return hits + faults ? double(hits) / double(hits + faults) : 0.; }
+};
+
+// Out-of-core polyline: the page directory and a binary tree of the page boxes stay resident,
+// pages are faulted in on demand through an LRU cache limited by memory_budget bytes
+// (a page in use is never evicted, so a budget below one page still works, with a fault on every access)
+// queries are exact, the same as Polyline::locate_point; not thread-safe
+class PagedPolyline
+{
+public:
+	PagedPolyline(const std::string& filename, size_t memory_budget = size_t(256) << 20);
+
+	// Best-first search over the page tree, pages are scanned by chunks with their own boxes
+	// returns:
+	//		mininmum distance,
+	//		ids of the closest segments,
+	//		projections onto closest segments
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p);
+
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+	size_t get_points_count() const { return n_points; }
+	size_t get_pages_count() const { return directory.size(); }
+	size_t get_page_vertices() const { return page_vertices; }
+
+	// the cache is trimmed at once if the budget shrinks
+	void set_memory_budget(size_t bytes);
+	PageStats page_stats() const;
+	void reset_stats();
+
+private:
+	struct Page
+	{
+		size_t first;
+		std::vector<Point3> vertices;
+		// boxes of the runs of CHUNK segments
+		std::vector<AABBox> chunk_boxes;
+
+		size_t memory() const;
+	};
+	static constexpr size_t CHUNK = 64;
+
+	std::ifstream in;
+	size_t n_points;
+	size_t page_vertices;
+	std::vector<PagedFileWriter::PageEntry> directory;
+	// levels[0] - page boxes, levels[l][i] - union of levels[l - 1][2i] and levels[l - 1][2i + 1]
+	std::vector<std::vector<AABBox>> levels;
+	TiePolicy ties;
+
+	size_t budget;
+	// most recently used first
+	std::list<size_t> lru;
+	std::unordered_map<size_t, std::pair<std::list<size_t>::iterator, std::shared_ptr<Page>>> resident;
+	PageStats stats;
+
+	std::shared_ptr<Page> fetch(size_t page_id);
+	void trim();
+};
+
+#endif
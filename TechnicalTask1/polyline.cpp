@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <time.h>
@@ -34,19 +36,77 @@ std::tuple<double, Point3> Segment::euc_dist(Point3& p) const
 	return std::make_tuple(dist, p_proj);
 }
 
+std::tuple<double, Point3, Point3> Segment::seg_dist(const Segment& s) const
+{
+	// closest points p1 + d1 * a, s.p1 + d2 * b, a, b in [0, 1]
+	Vec3 d1 = *p2 - *p1;
+	Vec3 d2 = *s.p2 - *s.p1;
+	Vec3 r = *p1 - *s.p1;
+	double l1 = d1.dot(d1), l2 = d2.dot(d2), f = d2.dot(r);
+	double a = 0., b = 0.;
+
+	if (l1 == 0. && l2 == 0.)
+	{
+		a = b = 0.;
+	}
+	else if (l1 == 0.)
+	{
+		b = std::clamp(f / l2, 0., 1.);
+	}
+	else
+	{
+		double c = d1.dot(r);
+		if (l2 == 0.)
+		{
+			a = std::clamp(-c / l1, 0., 1.);
+		}
+		else
+		{
+			double d12 = d1.dot(d2);
+			double denom = l1 * l2 - d12 * d12;
+			// parallel segments: any a will do, take a = 0
+			a = denom > 0. ? std::clamp((d12 * f - c * l2) / denom, 0., 1.) : 0.;
+			b = (d12 * a + f) / l2;
+			if (b < 0.)
+			{
+				b = 0.;
+				a = std::clamp(-c / l1, 0., 1.);
+			}
+			else if (b > 1.)
+			{
+				b = 1.;
+				a = std::clamp((d12 - c) / l1, 0., 1.);
+			}
+		}
+	}
+
+	Point3 c1 = *p1 + (*p2 - *p1) * a;
+	Point3 c2 = *s.p1 + (*s.p2 - *s.p1) * b;
+	return std::make_tuple(c1.euc_dist(c2), c1, c2);
+}
+
 bool Segment::contains_point(Point3& p)
 {
 	return false;
 }
 
 
-Polyline::Polyline(std::vector<Point3>& v)
+Polyline::Polyline(std::vector<Point3>& v, IndexType index) : index(index)
 {
 	if (v.size() < 2)
 		std:throw std::runtime_error("Polyline implies at least two points!");
 	points.resize(v.size());
 	std::move(v.begin(), v.end(), points.begin());
 
+	measure();
+
+	octree = std::make_shared<Octree<Segment>>(MAX_OCTANT, true);
+	octree->construct(this->bounds,	points);
+	build_index();
+}
+
+void Polyline::measure()
+{
 	// xmin, xmax, ymin, ymax, zmin, zmax
 	std::array<double, 6> bounds;
 	bounds[0] = bounds[2] = bounds[4] = std::numeric_limits<double>::max();
@@ -72,41 +132,423 @@ Polyline::Polyline(std::vector<Point3>& v)
 				Point3{bounds[1], bounds[3], bounds[5]}
 	};
 
-	octree = std::make_shared<Octree<Segment>>(MAX_OCTANT, true);
-	octree->construct(this->bounds,	points);
+	chainages.resize(points.size());
+	chainages[0] = 0.;
+	for (size_t i = 1; i < points.size(); ++i)
+		chainages[i] = chainages[i - 1] + points[i - 1].euc_dist(points[i]);
 }
 
-std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point(Point3& p)
+void Polyline::build_index()
+{
+	if (index == IndexType::HASH_GRID)
+	{
+		grid = std::make_shared<HashGrid>(points, this->bounds);
+		grid->set_tie_policy(ties);
+	}
+	if (index == IndexType::FLAT_OCTREE)
+		tree = std::make_shared<SpatialTree<FlatOctree>>(points);
+	if (index == IndexType::FLAT_QUADTREE)
+		tree = std::make_shared<SpatialTree<FlatQuadtree>>(points);
+	if (tree != nullptr)
+		tree->set_tie_policy(ties);
+}
+
+size_t Polyline::update_vertices(std::span<const Point3> v, double max_overhang)
 {
+	if (v.size() != points.size())
+		throw std::runtime_error("Number of vertices must not change!");
+	// in place, the segments keep pointing to the same vertices
+	std::copy(v.begin(), v.end(), points.begin());
+	measure();
+	size_t rebuilt = octree->refit(max_overhang);
+
+	pyramid = nullptr;
+	field = nullptr;
+	if (cache != nullptr)
+		cache->clear();
+	build_index();
+	return rebuilt;
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::index_search(Point3& p, double upper_bound)
+{
+	if (index == IndexType::HASH_GRID)
+		return grid->locate_point(p, upper_bound);
+	if (tree != nullptr)
+		return tree->locate_point(p, upper_bound);
+	if (upper_bound < std::numeric_limits<double>::max())
+		return octree->locate_point_bounded(p, upper_bound);
 	return octree->locate_point(p);
 }
 
-std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_greedy(Point3& p)
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point(Point3& p)
 {
-	size_t sz_seg = points.size() - 1;
-	double min_dist = std::numeric_limits<double>::max();
-	std::vector<size_t> closest_seg_ids;
-	closest_seg_ids.reserve(sz_seg);
-	std::vector<Point3> projection_points;
-	projection_points.reserve(sz_seg);
+	if (cache == nullptr)
+		return index_search(p);
 
-	for (size_t i_seg = 0; i_seg < sz_seg; ++i_seg)
+	auto [status, cached, p_cached] = cache->lookup(p);
+	if (status == CacheLookup::HIT)
+		return cached;
+
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> ret;
+	if (status == CacheLookup::NEAR)
+		ret = index_search(p, std::get<0>(cached) + p.euc_dist(p_cached));
+	else
+		ret = index_search(p);
+	cache->store(p, ret);
+	return ret;
+}
+
+void Polyline::enable_cache(size_t capacity, double quantum)
+{
+	cache = std::make_shared<QueryCache>(capacity, quantum);
+}
+
+void Polyline::enable_parallel(size_t n_threads)
+{
+	pool = std::make_shared<TaskPool>(n_threads);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_parallel(Point3& p)
+{
+	if (pool == nullptr)
+		throw std::runtime_error("Parallel queries are not enabled!");
+	return octree->locate_point_parallel(p, *pool);
+}
+
+// 21 bits of v spread to every third bit
+static uint64_t spread_bits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+std::vector<std::tuple<double, std::vector<size_t>, std::vector<Point3>>> Polyline::locate_points(const std::vector<Point3>& queries,
+	size_t packet_size)
+{
+	if (packet_size < 1 || packet_size > QueryPacket::MAX)
+		throw std::runtime_error("Packet size must be from 1 to 16!");
+
+	// Morton order of the queries clamped to the polyline bounds
+	Point3 ext = bounds.rMax - bounds.lMin;
+	auto cell = [](double v, double lo, double size)
+	{
+		double t = size > 0 ? (v - lo) / size : 0.;
+		return uint64_t(std::clamp(t, 0., 1.) * double(0x1fffff));
+	};
+	std::vector<std::pair<uint64_t, size_t>> order(queries.size());
+	for (size_t i = 0; i < queries.size(); ++i)
+	{
+		auto& q = queries[i];
+		order[i] = std::make_pair(spread_bits(cell(q.x, bounds.lMin.x, ext.x)) |
+			spread_bits(cell(q.y, bounds.lMin.y, ext.y)) << 1 |
+			spread_bits(cell(q.z, bounds.lMin.z, ext.z)) << 2, i);
+	}
+	std::sort(order.begin(), order.end());
+
+	std::vector<std::tuple<double, std::vector<size_t>, std::vector<Point3>>> results(queries.size());
+	size_t n_packets = (queries.size() + packet_size - 1) / packet_size;
+	auto run_packet = [&](size_t b)
 	{
-		auto [dist, proj] = get_segment(i_seg)->euc_dist(p);
-		if (is_equal(min_dist, dist))
+		QueryPacket packet;
+		size_t begin = b * packet_size;
+		packet.reset(std::min(packet_size, queries.size() - begin));
+		for (size_t k = 0; k < packet.n; ++k)
 		{
-			closest_seg_ids.push_back(i_seg);
-			projection_points.push_back(proj);
+			auto& q = queries[order[begin + k].second];
+			packet.x[k] = q.x;
+			packet.y[k] = q.y;
+			packet.z[k] = q.z;
 		}
-		if (min_dist > dist)
+		octree->locate_packet(packet);
+		for (size_t k = 0; k < packet.n; ++k)
+			results[order[begin + k].second] = std::make_tuple(packet.min_dist[k], std::move(packet.min_ids[k]), std::move(packet.min_proj[k]));
+	};
+
+	if (pool != nullptr)
+		pool->parallel_for(0, n_packets, 16, run_packet);
+	else
+		for (size_t b = 0; b < n_packets; ++b)
+			run_packet(b);
+	return results;
+}
+
+SegmentPair Polyline::distance_to(Polyline& other)
+{
+	return octree->min_distance(*other.octree, pool.get());
+}
+
+double Polyline::directed_hausdorff(Polyline& other, double tolerance, TaskPool* pool)
+{
+	// distance to the other polyline and the id of the closest segment
+	auto dist = [&](Point3 x)
+	{
+		auto [d, ids, projs] = other.octree->locate_point_approx(x, 0.);
+		return std::make_tuple(d, ids[0]);
+	};
+	auto for_each_index = [&](size_t count, const std::function<void(size_t)>& foo)
+	{
+		if (pool != nullptr)
+			pool->parallel_for(0, count, 64, foo);
+		else
+			for (size_t i = 0; i < count; ++i)
+				foo(i);
+	};
+
+	size_t n = points.size();
+	std::vector<std::tuple<double, size_t>> d_vert(n);
+	for_each_index(n, [&](size_t i) { d_vert[i] = dist(points[i]); });
+
+	double max_vert = 0.;
+	for (auto& [d, id] : d_vert)
+		max_vert = std::max(max_vert, d);
+	std::atomic<double> lower = max_vert;
+
+	for_each_index(n - 1, [&](size_t i)
 		{
-			min_dist = dist;
-			projection_points = std::vector<Point3>{ proj };
-			closest_seg_ids = std::vector<size_t>{ i_seg };
+			// pieces of the segment: {u, v, {d(u), closest segment}, {d(v), closest segment}}
+			using Piece = std::tuple<Point3, Point3, std::tuple<double, size_t>, std::tuple<double, size_t>>;
+			std::vector<Piece> pieces{ std::make_tuple(points[i], points[i + 1], d_vert[i], d_vert[i + 1]) };
+			while (!pieces.empty())
+			{
+				auto [u, v, du, dv] = pieces.back();
+				pieces.pop_back();
+
+				// distance to a single segment is convex, so over [u, v] it is at most its max at the ends,
+				// besides, distance to the polyline is 1-Lipschitz
+				auto s_u = other.get_segment(std::get<1>(du));
+				auto s_v = other.get_segment(std::get<1>(dv));
+				double upper = std::min({
+					0.5 * (std::get<0>(du) + std::get<0>(dv) + u.euc_dist(v)),
+					std::max(std::get<0>(du), std::get<0>(s_u->euc_dist(v))),
+					std::max(std::get<0>(s_v->euc_dist(u)), std::get<0>(dv)) });
+				if (upper <= lower + tolerance)
+					continue;
+
+				Point3 m = (u + v) * 0.5;
+				auto dm = dist(m);
+				double cur = lower.load();
+				while (std::get<0>(dm) > cur && !lower.compare_exchange_weak(cur, std::get<0>(dm)));
+				pieces.push_back(std::make_tuple(u, m, du, dm));
+				pieces.push_back(std::make_tuple(m, v, dm, dv));
+			}
+		});
+	return lower;
+}
+
+double Polyline::hausdorff_to(Polyline& other, double tolerance)
+{
+	if (tolerance <= 0)
+		tolerance = 1e-9 * std::max(get_max_span(), other.get_max_span());
+	return std::max(directed_hausdorff(other, tolerance, pool.get()), other.directed_hausdorff(*this, tolerance, pool.get()));
+}
+
+std::vector<SegmentPair> Polyline::find_self_contacts(double tolerance)
+{
+	auto contacts = octree->self_contacts(tolerance, pool.get());
+	if (points.size() > 3 && points.front() == points.back())
+	{
+		size_t last = points.size() - 2;
+		contacts.erase(std::remove_if(contacts.begin(), contacts.end(),
+			[last](const SegmentPair& c) { return c.id1 == 0 && c.id2 == last; }), contacts.end());
+	}
+	return contacts;
+}
+
+std::vector<SegmentPair> Polyline::corridor(Point3& a, Point3& b, double r, size_t max_hits)
+{
+	std::vector<Segment> queries{ Segment{ &a, &b, 0 } };
+	return octree->corridor(queries, r, max_hits);
+}
+
+std::vector<SegmentPair> Polyline::corridor(std::vector<Point3>& path, double r)
+{
+	std::vector<Segment> queries;
+	for (size_t i = 0; i + 1 < path.size(); ++i)
+		queries.push_back(Segment{ &path[i], &path[i + 1], i });
+	return octree->corridor(queries, r);
+}
+
+double Polyline::chainage(size_t id, const Point3& proj) const
+{
+	if (id + 1 >= points.size())
+		throw std::runtime_error("Segment id is out of range!");
+	return chainages[id] + std::min(points[id].euc_dist(proj), chainages[id + 1] - chainages[id]);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>, std::vector<double>> Polyline::locate_point_linear(Point3& p)
+{
+	auto [d, ids, projs] = locate_point(p);
+	std::vector<double> s(ids.size());
+	for (size_t i = 0; i < ids.size(); ++i)
+		s[i] = chainage(ids[i], projs[i]);
+	return std::make_tuple(d, ids, projs, s);
+}
+
+size_t Polyline::segment_at(double s, size_t hint) const
+{
+	size_t n_seg = points.size() - 1;
+	for (size_t id = hint; id < std::min(hint + 2, n_seg); ++id)
+		if (chainages[id] <= s && (s < chainages[id + 1] || id + 1 == n_seg))
+			return id;
+	// the last point with chainage <= s starts the segment
+	size_t id = std::upper_bound(chainages.begin(), chainages.end(), s) - chainages.begin();
+	return std::clamp(id, size_t(1), n_seg) - 1;
+}
+
+Point3 Polyline::interpolate(size_t id, double s) const
+{
+	double len = chainages[id + 1] - chainages[id];
+	if (len <= 0)
+		return points[id];
+	double t = std::clamp((s - chainages[id]) / len, 0., 1.);
+	return points[id] + (points[id + 1] - points[id]) * t;
+}
+
+Point3 Polyline::point_at(double s) const
+{
+	if (s < 0 || s > length())
+		throw std::runtime_error("Chainage is out of the polyline!");
+	return interpolate(segment_at(s), s);
+}
+
+std::vector<Point3> Polyline::range_between(double s0, double s1) const
+{
+	bool reversed = s0 > s1;
+	if (reversed)
+		std::swap(s0, s1);
+	std::vector<Point3> range{ point_at(s0) };
+	size_t id0 = segment_at(s0), id1 = segment_at(s1, id0);
+	for (size_t i = id0 + 1; i <= id1; ++i)
+		if (chainages[i] > s0 && chainages[i] < s1)
+			range.push_back(points[i]);
+	range.push_back(point_at(s1));
+	if (reversed)
+		std::reverse(range.begin(), range.end());
+	return range;
+}
+
+std::vector<Point3> Polyline::points_at(const std::vector<double>& s)
+{
+	for (double s_i : s)
+		if (!(s_i >= 0 && s_i <= length()))
+			throw std::runtime_error("Chainage is out of the polyline!");
+
+	std::vector<Point3> res(s.size());
+	// consecutive chainages are likely to fall onto the same or the next segment
+	auto chunk = [&](size_t begin, size_t end)
+	{
+		size_t id = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			id = segment_at(s[i], id);
+			res[i] = interpolate(id, s[i]);
 		}
-		
+	};
+
+	const size_t grain = 1 << 16;
+	if (pool == nullptr || s.size() <= grain)
+	{
+		chunk(0, s.size());
+		return res;
+	}
+	pool->parallel_for(0, (s.size() - 1) / grain + 1, 1, [&](size_t c) {
+		chunk(c * grain, std::min((c + 1) * grain, s.size()));
+		});
+	return res;
+}
+
+MemoryUsage Polyline::memory_usage()
+{
+	MemoryUsage usage = octree->memory_usage();
+	usage.vertices = points.capacity() * sizeof(Point3) + chainages.capacity() * sizeof(double);
+	if (tree != nullptr)
+		usage.nodes += tree->memory();
+	return usage;
+}
+
+void Polyline::compact()
+{
+	octree->compact();
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_approx(Point3& p, double eps)
+{
+	return octree->locate_point_approx(p, eps);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_greedy(Point3& p)
+{
+	size_t sz_seg = points.size() - 1;
+	double scale = std::max({ std::abs(bounds.lMin.x), std::abs(bounds.lMin.y), std::abs(bounds.lMin.z),
+		std::abs(bounds.rMax.x), std::abs(bounds.rMax.y), std::abs(bounds.rMax.z) });
+	ClosestSegments closest(ties, p, scale);
+
+	for (size_t i_seg = 0; i_seg < sz_seg; ++i_seg)
+	{
+		auto [dist, proj] = Segment{ &points[i_seg], &points[i_seg + 1], i_seg }.euc_dist(p);
+		closest.add(dist, &points[i_seg], &points[i_seg + 1], i_seg, proj);
 	}
-	return std::make_tuple(min_dist, closest_seg_ids, projection_points);
+	return closest.resolve();
+}
+
+void Polyline::set_tie_policy(const TiePolicy& policy)
+{
+	ties = policy;
+	octree->set_tie_policy(policy);
+	if (grid != nullptr)
+		grid->set_tie_policy(policy);
+	if (tree != nullptr)
+		tree->set_tie_policy(policy);
+	if (pyramid != nullptr)
+		pyramid->set_tie_policy(policy);
+	if (field != nullptr)
+		field->set_tie_policy(policy);
+	if (cache != nullptr)
+		cache->clear();
+}
+
+void Polyline::build_pyramid(double tolerance, size_t min_vertices)
+{
+	pyramid = std::make_shared<PolylinePyramid>(points, tolerance, min_vertices);
+	pyramid->set_tie_policy(ties);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_coarse(Point3& p, double tolerance)
+{
+	if (pyramid == nullptr)
+		throw std::runtime_error("Polyline pyramid is not built!");
+	return pyramid->locate_point(p, tolerance);
+}
+
+void Polyline::build_distance_field(const AABBox& box, const DistanceFieldParams& params)
+{
+	field = std::make_shared<DistanceField>(*this, points, box, params, pool.get());
+}
+
+FieldSample Polyline::field_distance(const Point3& p) const
+{
+	if (field == nullptr)
+		throw std::runtime_error("Distance field is not built!");
+	return field->distance(p);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> Polyline::locate_point_field(Point3& p)
+{
+	if (field == nullptr)
+		throw std::runtime_error("Distance field is not built!");
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> ret;
+	if (field->locate_point(p, ret))
+		return ret;
+	// the field still bounds the search
+	auto sample = field->distance(p);
+	double upper_bound = sample.distance + sample.error;
+	return index_search(p, upper_bound + 1e-9 * (1. + upper_bound));
 }
 
 std::optional<Segment> Polyline::get_segment(size_t id)
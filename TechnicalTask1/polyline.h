@@ -5,8 +5,15 @@
 #include <string>
 #include <memory>
 #include <optional>
+#include <limits>
 #include <array>
+#include <span>
 #include "octree.h"
+#include "polyline_pyramid.h"
+#include "query_cache.h"
+#include "hash_grid.h"
+#include "spatial_tree.h"
+#include "distance_field.h"
 
 using namespace geo_units;
 
@@ -15,14 +22,29 @@ struct Segment
 	Point3 *p1, *p2;
 	size_t id;
 	std::tuple<double, Point3> euc_dist(Point3& p) const;
+	// distance between two segments and their closest points (on this segment, on s)
+	std::tuple<double, Point3, Point3> seg_dist(const Segment& s) const;
 
 	bool contains_point(Point3& p);
 };
 
+// Spatial index used by Polyline::locate_point
+enum class IndexType
+{
+	OCTREE,
+	// uniform hashed grid, for dense evenly distributed polylines
+	HASH_GRID,
+	// flat SpatialTree octree, see FlatOctree
+	FLAT_OCTREE,
+	// flat SpatialTree quadtree over (x, y), for planar polylines, see FlatQuadtree
+	FLAT_QUADTREE
+};
+
 class Polyline
 {
 public:
-	Polyline(std::vector<Point3>&v);
+	// the octree is built for any index type, since the rest of the queries rely on it
+	Polyline(std::vector<Point3>&v, IndexType index = IndexType::OCTREE);
 	// Searches for the nearest segment to a point p 
 	// A distance between point P and degment is defined as
 	// a length of a projection of a point P onto the segment (in the plane fromed of two segment points and point P)
@@ -31,10 +53,106 @@ public:
 	//		mininmum distance, 
 	//		ids of the closest segments, 
 	//		projections onto closest segments
+	// If the query cache is enabled, repeated points are answered from the cache,
+	// and a point in an already queried quantization cell seeds the search 
+	// with the upper bound dist(cached point) + |p - cached point|, so the result stays exact
 	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p);
 	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_greedy(Point3& p);
+	// Approximate search: the returned distance is within (1 + eps) of the minimal one,
+	// only one of the closest segments is returned
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_approx(Point3& p, double eps);
 	std::optional<Segment> get_segment(size_t id);
 
+	// Tie policy of all the exact searches (locate_point with any index, locate_point_greedy, locate_point_parallel,
+	// locate_points, the pyramid and the distance field ones): the segments whose distances are tied
+	// with the minimal one under the policy are all returned;
+	// the distances are filtered in double and only the near-tie decisions are re-evaluated in double-double
+	void set_tie_policy(const TiePolicy& policy);
+	const TiePolicy& get_tie_policy() const { return ties; }
+
+	// Puts a bounded LRU cache of capacity points in front of locate_point
+	// quantum - size of the quantization cell for near repeats (0 - exact repeats only)
+	void enable_cache(size_t capacity, double quantum = 0.);
+	void disable_cache() { cache = nullptr; }
+	CacheMetrics cache_metrics() const { return cache ? cache->metrics() : CacheMetrics{}; }
+
+	// Creates the work-stealing pool used by the parallel queries (n_threads = 0 - all hardware threads)
+	void enable_parallel(size_t n_threads = 0);
+	// Same as locate_point, but a single query is split into tasks over the pool,
+	// requires enable_parallel
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_parallel(Point3& p);
+
+	// Batch of exact searches (the octree is used for any index type): the queries are sorted along the Morton curve
+	// within the polyline bounds and traverse the octree in packets of packet_size (1 to 16) neighbours,
+	// sharing the node tests and the segment scans; parallel over the packets if enable_parallel was called
+	// returns the results in the order of the queries
+	std::vector<std::tuple<double, std::vector<size_t>, std::vector<Point3>>> locate_points(const std::vector<Point3>& queries,
+		size_t packet_size = 8);
+
+	// Closest approach of two polylines: minimal segment-segment distance, found by
+	// a simultaneous traversal of both octrees (parallel if enable_parallel was called)
+	// returns the distance, ids of the segments of this and the other polyline and the closest points
+	SegmentPair distance_to(Polyline& other);
+	// Symmetric Hausdorff distance between two polylines, 
+	// accurate up to tolerance (0 - 1e-9 of the larger polyline span)
+	double hausdorff_to(Polyline& other, double tolerance = 0.);
+
+	// Places where the polyline comes within tolerance of itself: pairs of non-adjacent segments
+	// (for a closed polyline the first and the last segments are adjacent too), 
+	// sorted by ids, with id1 < id2 and the closest points; parallel if enable_parallel was called
+	std::vector<SegmentPair> find_self_contacts(double tolerance);
+
+	// Capsule query: all the segments within distance r of the segment [a, b]
+	// returns {distance, segment id, 0, point on the segment, point on [a, b]}
+	// more than max_hits segments stop the enumeration: then max_hits + 1 of them are returned
+	std::vector<SegmentPair> corridor(Point3& a, Point3& b, double r, size_t max_hits = std::numeric_limits<size_t>::max());
+	// Corridor of a path: all the segments within distance r of each of the path segments,
+	// returns {distance, segment id, path segment index, point on the segment, point on the path}
+	std::vector<SegmentPair> corridor(std::vector<Point3>& path, double r);
+
+	// Linear referencing: chainage - distance along the polyline from its first point,
+	// kept as a prefix sum of the segment lengths
+	double length() const { return chainages.back(); }
+	// chainage of a point lying on the segment id (e.g. a projection returned by locate_point)
+	double chainage(size_t id, const Point3& proj) const;
+	// locate_point with the chainages of the projections
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>, std::vector<double>> locate_point_linear(Point3& p);
+	// point at chainage s, s in [0, length()]
+	Point3 point_at(double s) const;
+	// part of the polyline between chainages s0 and s1 (reversed if s0 > s1): 
+	// point_at(s0), the vertices in between, point_at(s1)
+	std::vector<Point3> range_between(double s0, double s1) const;
+	// batch point_at, fastest for sorted chainages; parallel if enable_parallel was called
+	std::vector<Point3> points_at(const std::vector<double>& s);
+
+	// Moves all the vertices (the topology is the same): the octree is refitted in place,
+	// only its subtrees whose boxes stick out of their octants by more than max_overhang of the octant size are rebuilt
+	// (see Octree::refit), returns the number of rebuilt subtrees
+	// the query cache is cleared, the pyramid and the distance field are dropped (build them again if needed),
+	// the hash grid and the flat trees are rebuilt
+	size_t update_vertices(std::span<const Point3> v, double max_overhang = 0.5);
+
+	// memory used by the vertices, the chainage table and the octree
+	MemoryUsage memory_usage();
+	// Post-build compaction of the octree (see Octree::compact), queries are not affected
+	void compact();
+
+	// Precomputes the multi-resolution pyramid of simplified polylines for locate_point_coarse
+	// tolerance - simplification tolerance of the finest level (doubled for each coarser one)
+	void build_pyramid(double tolerance, size_t min_vertices = 64);
+	// Coarse-to-fine search over the pyramid: exact for tolerance = 0,
+	// otherwise the distance is at most tolerance above the minimal one
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_coarse(Point3& p, double tolerance = 0.);
+
+	// Samples the distance field of the polyline over the box (see DistanceField), parallel if enable_parallel was called
+	void build_distance_field(const AABBox& box, const DistanceFieldParams& params = DistanceFieldParams{});
+	// Interpolated distance with its error bound, requires build_distance_field
+	FieldSample field_distance(const Point3& p) const;
+	// Exact search among the candidate segments of the field cell holding p,
+	// for the points outside the field box and the cells without candidates - search in the index,
+	// bounded by the interpolated distance plus its error
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_field(Point3& p);
+
 	// 
 	double get_max_span()
 	{
@@ -44,8 +162,36 @@ public:
 private:
 	std::vector<Point3> points;
 	AABBox bounds;
+	// chainages[i] - chainage of points[i]
+	std::vector<double> chainages;
 	// i-th segment: {points[i], points[i+1]}
 	std::shared_ptr<Octree<Segment>> octree;
+	std::shared_ptr<PolylinePyramid> pyramid;
+	std::shared_ptr<DistanceField> field;
+	std::shared_ptr<QueryCache> cache;
+	IndexType index;
+	std::shared_ptr<HashGrid> grid;
+	std::shared_ptr<SpatialTreeBase> tree;
+	std::shared_ptr<TaskPool> pool;
+	TiePolicy ties;
+
+	// max over the points of this polyline of the distance to the other one:
+	// every segment is bisected while the upper bound of the distance over the piece [u, v] 
+	// exceeds the best lower bound found plus tolerance
+	double directed_hausdorff(Polyline& other, double tolerance, TaskPool* pool);
+
+	// bounds and chainages of the current vertices
+	void measure();
+	// the index selected besides the octree
+	void build_index();
+
+	// id of the segment holding chainage s, the hint segment and its successor are checked first
+	size_t segment_at(double s, size_t hint = 0) const;
+	Point3 interpolate(size_t id, double s) const;
+
+	// search in the selected index, upper_bound - known upper bound of the minimal distance
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> index_search(Point3& p, 
+		double upper_bound = std::numeric_limits<double>::max());
 };
 
 #endif
\ No newline at end of file
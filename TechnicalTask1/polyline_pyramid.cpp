@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <stack>
+#include "polyline_pyramid.h"
+#include "polyline.h"
+
+PolylinePyramid::PolylinePyramid(std::vector<Point3>& points, double tolerance, size_t min_vertices) : points(points)
+{
+	if (points.size() < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	if (tolerance <= 0)
+		throw std::runtime_error("Simplification tolerance must be positive!");
+
+	for (auto& v : points)
+		scale = std::max({ scale, std::abs(v.x), std::abs(v.y), std::abs(v.z) });
+
+	std::vector<size_t> src(points.size());
+	std::iota(src.begin(), src.end(), 0);
+
+	double tol = tolerance;
+	while (src.size() > std::max(min_vertices, size_t(2)))
+	{
+		auto kept = simplify(src, tol);
+		tol *= 2.;
+		// the level is not worth storing if nothing has been removed
+		if (kept.size() == src.size())
+			continue;
+
+		add_level(src, kept);
+		src = pyramid.back().vertices;
+	}
+}
+
+std::vector<size_t> PolylinePyramid::simplify(const std::vector<size_t>& src, double tolerance)
+{
+	std::vector<bool> keep(src.size(), false);
+	keep.front() = keep.back() = true;
+
+	std::stack<std::pair<size_t, size_t>> ranges;
+	ranges.push(std::make_pair(size_t(0), src.size() - 1));
+	while (!ranges.empty())
+	{
+		auto [a, b] = ranges.top();
+		ranges.pop();
+		if (b - a < 2)
+			continue;
+
+		Segment s{ &points[src[a]], &points[src[b]], 0 };
+		double max_dist = -1.;
+		size_t i_max = a;
+		for (size_t i = a + 1; i < b; ++i)
+		{
+			double d = std::get<0>(s.euc_dist(points[src[i]]));
+			if (d > max_dist)
+			{
+				max_dist = d;
+				i_max = i;
+			}
+		}
+		if (max_dist > tolerance)
+		{
+			keep[i_max] = true;
+			ranges.push(std::make_pair(a, i_max));
+			ranges.push(std::make_pair(i_max, b));
+		}
+	}
+
+	std::vector<size_t> kept;
+	for (size_t i = 0; i < src.size(); ++i)
+		if (keep[i])
+			kept.push_back(i);
+	return kept;
+}
+
+void PolylinePyramid::add_level(const std::vector<size_t>& src, const std::vector<size_t>& kept)
+{
+	PyramidLevel level;
+	level.vertices.resize(kept.size());
+	level.first_child = kept;
+	for (size_t j = 0; j < kept.size(); ++j)
+		level.vertices[j] = src[kept[j]];
+
+	// the error is measured against the original vertices, not the finer level ones:
+	// distance to a segment is convex, so its max over an original segment is reached at a vertex
+	level.seg_error.resize(kept.size() - 1);
+	for (size_t j = 0; j + 1 < kept.size(); ++j)
+	{
+		Segment s{ &points[level.vertices[j]], &points[level.vertices[j + 1]], j };
+		double err = 0.;
+		for (size_t i = level.vertices[j] + 1; i < level.vertices[j + 1]; ++i)
+			err = std::max(err, std::get<0>(s.euc_dist(points[i])));
+		level.seg_error[j] = err;
+		level.error = std::max(level.error, err);
+	}
+	pyramid.push_back(std::move(level));
+}
+
+double PolylinePyramid::coarse_dist(size_t level, size_t j, Point3& p)
+{
+	auto& lvl = pyramid[level - 1];
+	Segment s{ &points[lvl.vertices[j]], &points[lvl.vertices[j + 1]], j };
+	return std::max(std::get<0>(s.euc_dist(p)) - lvl.seg_error[j], 0.);
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> PolylinePyramid::locate_point(Point3& p, double tolerance)
+{
+	ClosestSegments closest(ties, p, scale);
+
+	auto check_segment = [&](size_t i)
+	{
+		auto [d, proj] = Segment{ &points[i], &points[i + 1], i }.euc_dist(p);
+		closest.add(d, &points[i], &points[i + 1], i, proj);
+	};
+
+	if (pyramid.empty())
+	{
+		for (size_t i = 0; i + 1 < points.size(); ++i)
+			check_segment(i);
+		return closest.resolve();
+	}
+
+	// candidates: {lower bound of the distance, level (1-based), segment index in the level}
+	using Candidate = std::tuple<double, size_t, size_t>;
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+
+	size_t coarsest = pyramid.size();
+	for (size_t j = 0; j + 1 < pyramid.back().vertices.size(); ++j)
+		candidates.push(std::make_tuple(coarse_dist(coarsest, j, p), coarsest, j));
+
+	while (!candidates.empty())
+	{
+		auto [lb, level, j] = candidates.top();
+		candidates.pop();
+		// with zero tolerance, candidates within the reach of the ties are still refined to collect them
+		if (tolerance > 0 ? lb >= closest.min() - tolerance : !closest.may_reach(lb))
+			break;
+
+		auto& lvl = pyramid[level - 1];
+		for (size_t k = lvl.first_child[j]; k < lvl.first_child[j + 1]; ++k)
+		{
+			if (level == 1)
+				check_segment(k);
+			else
+				candidates.push(std::make_tuple(coarse_dist(level - 1, k, p), level - 1, k));
+		}
+	}
+	return closest.resolve();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#ifndef POLYLINE_PYRAMID_H
+#define POLYLINE_PYRAMID_H
+#include <vector>
+#include <tuple>
+#include "geo_units.h"
+#include "tie_policy.h"
+
+using namespace geo_units;
+
+// One simplification level of the pyramid
+// j-th coarse segment: {points[vertices[j]], points[vertices[j+1]]},
+// it replaces the segments [first_child[j], first_child[j+1]) of the next finer level
+// (for the finest simplified level these are the ids of the original segments)
+struct PyramidLevel
+{
+	std::vector<size_t> vertices;
+	std::vector<size_t> first_child;
+	// max distance from the original vertices in the range of the coarse segment to this segment
+	std::vector<double> seg_error;
+	// Hausdorff error of the level: max of seg_error
+	double error = 0.;
+};
+
+// A pyramid of Douglas-Peucker simplifications of a polyline,
+// each level is a simplification of the previous (finer) one,
+// so the ranges of the original segments are nested
+class PolylinePyramid
+{
+public:
+	// tolerance - Douglas-Peucker tolerance of the finest level, it is doubled for every next level
+	// levels are added until the coarsest one has no more than min_vertices vertices
+	PolylinePyramid(std::vector<Point3>& points, double tolerance, size_t min_vertices = 64);
+
+	// Coarse-to-fine search: candidates found on the coarsest level are refined
+	// only within their ranges, a coarse segment is skipped if its distance minus its error
+	// is not below the current minimum
+	// tolerance = 0 gives the exact result (with all the ties under the tie policy),
+	// otherwise the returned distance is at most tolerance above the minimal one
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p, double tolerance = 0.);
+
+	size_t levels() const { return pyramid.size(); }
+	size_t level_size(size_t level) const { return pyramid[level].vertices.size(); }
+	double error(size_t level) const { return pyramid[level].error; }
+
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+private:
+	std::vector<Point3>& points;
+	// pyramid[0] is the finest simplified level, pyramid.back() is the coarsest one
+	std::vector<PyramidLevel> pyramid;
+	TiePolicy ties;
+	// largest coordinate magnitude of the vertices, the scale of the distance errors
+	double scale = 0.;
+
+	// Douglas-Peucker simplification of the polyline given by the vertex indices src
+	// returns the positions (in src) of the kept vertices
+	std::vector<size_t> simplify(const std::vector<size_t>& src, double tolerance);
+	// appends a level made of the vertices src[kept[j]], src - vertex indices of the finer level
+	void add_level(const std::vector<size_t>& src, const std::vector<size_t>& kept);
+	double coarse_dist(size_t level, size_t j, Point3& p);
+};
+
+#endif
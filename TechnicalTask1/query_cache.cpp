@@ -0,0 +1,121 @@
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include "query_cache.h"
+
+QueryCache::QueryCache(size_t capacity, double quantum) : capacity(capacity), quantum(quantum)
+{
+	if (capacity == 0)
+		throw std::runtime_error("Cache capacity must be positive!");
+	if (quantum < 0)
+		throw std::runtime_error("Cache quantum must be non-negative!");
+	index.reserve(capacity);
+}
+
+size_t QueryCache::KeyHash::operator () (const Key& k) const
+{
+	size_t h = std::hash<long long>()(k.x);
+	h ^= std::hash<long long>()(k.y) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	h ^= std::hash<long long>()(k.z) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	return h ^ size_t(k.exact);
+}
+
+QueryCache::Key QueryCache::make_key(const Point3& p) const
+{
+	Key k;
+	if (quantum > 0)
+	{
+		double cx = std::floor(p.x / quantum), cy = std::floor(p.y / quantum), cz = std::floor(p.z / quantum);
+		// the conversion is undefined out of the range of long long (NaN fails the test too)
+		const double limit = 0x1p62;
+		if (std::fabs(cx) < limit && std::fabs(cy) < limit && std::fabs(cz) < limit)
+		{
+			k.x = (long long)cx;
+			k.y = (long long)cy;
+			k.z = (long long)cz;
+			k.exact = false;
+			return k;
+		}
+	}
+	std::memcpy(&k.x, &p.x, sizeof(double));
+	std::memcpy(&k.y, &p.y, sizeof(double));
+	std::memcpy(&k.z, &p.z, sizeof(double));
+	k.exact = true;
+	return k;
+}
+
+size_t QueryCache::entry_memory(const Entry& e)
+{
+	// list node (two pointers) + hash table node (key, iterator, next pointer, hash)
+	size_t node_overhead = 2 * sizeof(void*) + sizeof(Key) + 3 * sizeof(void*);
+	return sizeof(Entry) + node_overhead
+		+ std::get<1>(e.result).capacity() * sizeof(size_t)
+		+ std::get<2>(e.result).capacity() * sizeof(Point3);
+}
+
+std::tuple<CacheLookup, QueryCache::Result, Point3> QueryCache::lookup(const Point3& p)
+{
+	Key k = make_key(p);
+	std::lock_guard<std::mutex> lock(mtx);
+
+	auto it = index.find(k);
+	if (it == index.end())
+	{
+		++stats.misses;
+		return std::make_tuple(CacheLookup::MISS, Result{}, Point3{});
+	}
+
+	// move to front
+	lru.splice(lru.begin(), lru, it->second);
+	const Entry& e = *it->second;
+	bool same = e.p.x == p.x && e.p.y == p.y && e.p.z == p.z;
+	if (same)
+		++stats.hits;
+	else
+		++stats.near_hits;
+	return std::make_tuple(same ? CacheLookup::HIT : CacheLookup::NEAR, e.result, e.p);
+}
+
+void QueryCache::store(const Point3& p, const Result& result)
+{
+	Key k = make_key(p);
+	std::lock_guard<std::mutex> lock(mtx);
+
+	auto it = index.find(k);
+	if (it != index.end())
+	{
+		// the newer point replaces the older one in the same cell
+		stats.memory -= entry_memory(*it->second);
+		it->second->p = p;
+		it->second->result = result;
+		stats.memory += entry_memory(*it->second);
+		lru.splice(lru.begin(), lru, it->second);
+		return;
+	}
+
+	if (lru.size() >= capacity)
+	{
+		stats.memory -= entry_memory(lru.back());
+		index.erase(lru.back().key);
+		lru.pop_back();
+	}
+	lru.push_front(Entry{ k, p, result });
+	index[k] = lru.begin();
+	stats.memory += entry_memory(lru.front());
+}
+
+void QueryCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	lru.clear();
+	index.clear();
+	stats.memory = 0;
+}
+
+CacheMetrics QueryCache::metrics() const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	CacheMetrics m = stats;
+	m.entries = lru.size();
+	return m;
+}
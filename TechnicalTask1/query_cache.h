@@ -0,0 +1,86 @@
+#pragma once
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+#include <list>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "geo_units.h"
+
+using namespace geo_units;
+
+enum class CacheLookup
+{
+	MISS,
+	HIT,	// the very same point has been queried
+	NEAR	// a point in the same quantization cell has been queried
+};
+
+struct CacheMetrics
+{
+	size_t hits = 0;
+	size_t near_hits = 0;
+	size_t misses = 0;
+	size_t entries = 0;
+	// approximate memory held by the cached entries, bytes
+	size_t memory = 0;
+
+	double hit_rate() const
+	{
+		size_t total = hits + near_hits + misses;
+		return total ? double(hits) / total : 0.;
+	}
+};
+
+// Bounded LRU cache of locate_point results, thread-safe
+// points are keyed by the quantization cell {floor(x / quantum), floor(y / quantum), floor(z / quantum)},
+// one (the most recent) point per cell is kept;
+// quantum = 0 keys by the exact coordinates, so there are no near hits;
+// a point whose cell index does not fit into long long (huge coordinates or tiny quantum) is keyed exactly as well
+class QueryCache
+{
+public:
+	using Result = std::tuple<double, std::vector<size_t>, std::vector<Point3>>;
+
+	QueryCache(size_t capacity, double quantum = 0.);
+
+	// returns the lookup status, the cached result and the point it was computed for
+	// (the last two are meaningful for HIT and NEAR only)
+	std::tuple<CacheLookup, Result, Point3> lookup(const Point3& p);
+	void store(const Point3& p, const Result& result);
+	void clear();
+	CacheMetrics metrics() const;
+
+private:
+	struct Key
+	{
+		long long x, y, z;
+		// the bits of the coordinates rather than a cell
+		bool exact;
+		bool operator == (const Key& k) const { return x == k.x && y == k.y && z == k.z && exact == k.exact; }
+	};
+	struct KeyHash
+	{
+		size_t operator () (const Key& k) const;
+	};
+	struct Entry
+	{
+		Key key;
+		Point3 p;
+		Result result;
+	};
+
+	size_t capacity;
+	double quantum;
+	// most recently used entries first
+	std::list<Entry> lru;
+	std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+	mutable std::mutex mtx;
+	CacheMetrics stats;
+
+	Key make_key(const Point3& p) const;
+	static size_t entry_memory(const Entry& e);
+};
+
+#endif
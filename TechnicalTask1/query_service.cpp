@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include "query_service.h"
+
+void QueryService::Awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	// the coroutine may be resumed (and this awaiter destroyed) before enqueue returns
+	service.enqueue(p, [this, handle](std::exception_ptr e, Result&& r)
+		{
+			error = e;
+			result = std::move(r);
+			handle.resume();
+		}, true);
+}
+
+QueryService::Result QueryService::Awaiter::await_resume()
+{
+	if (error)
+		std::rethrow_exception(error);
+	return std::move(result);
+}
+
+///____________________________________________________________________________________
+
+QueryService::QueryService(Polyline& polyline, const QueryServiceParams& params) :
+	polyline(polyline), params(params), executor(params.n_threads)
+{
+	if (params.max_batch == 0 || params.capacity == 0)
+		throw std::runtime_error("Batch size and capacity must be positive!");
+	if (params.packet_size < 1 || params.packet_size > QueryPacket::MAX)
+		throw std::runtime_error("Packet size must be from 1 to 16!");
+	dispatcher = std::thread(&QueryService::dispatch_loop, this);
+}
+
+QueryService::~QueryService()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	ready_cv.notify_all();
+	space_cv.notify_all();
+	dispatcher.join();
+	// run_batch catches the errors of the searches and of the completions, this is for the rest (e.g. bad_alloc)
+	try
+	{
+		executor.wait(running);
+	}
+	catch (...)
+	{
+	}
+}
+
+std::future<QueryService::Result> QueryService::submit(const Point3& p)
+{
+	auto promise = std::make_shared<std::promise<Result>>();
+	auto future = promise->get_future();
+	enqueue(p, [promise](std::exception_ptr e, Result&& r)
+		{
+			if (e)
+				promise->set_exception(e);
+			else
+				promise->set_value(std::move(r));
+		}, true);
+	return future;
+}
+
+void QueryService::submit(const Point3& p, std::function<void(Result&&)> on_done)
+{
+	enqueue(p, [on_done = std::move(on_done)](std::exception_ptr e, Result&& r)
+		{
+			if (e)
+				r = std::make_tuple(std::numeric_limits<double>::quiet_NaN(), std::vector<size_t>(), std::vector<Point3>());
+			on_done(std::move(r));
+		}, true);
+}
+
+bool QueryService::try_submit(const Point3& p, Completion on_done)
+{
+	return enqueue(p, std::move(on_done), false);
+}
+
+void QueryService::flush()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		flush_requested = true;
+	}
+	ready_cv.notify_all();
+}
+
+size_t QueryService::batches_count() const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return batches;
+}
+
+size_t QueryService::queries_count() const
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return queries;
+}
+
+bool QueryService::enqueue(const Point3& p, Completion done, bool blocking)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	auto has_space = [&]() { return stop || accepted < params.capacity; };
+	while (blocking && !has_space())
+	{
+		if (!executor.in_worker())
+		{
+			space_cv.wait(lock, has_space);
+			break;
+		}
+		// a worker (e.g. resuming a coroutine that awaits its next query) must not just block:
+		// the capacity is released by the batches queued to the executor, it runs them meanwhile
+		lock.unlock();
+		bool ran = executor.run_one();
+		lock.lock();
+		if (!ran)
+			space_cv.wait_for(lock, std::chrono::milliseconds(1), has_space);
+	}
+	if (stop)
+		throw std::runtime_error("Query service is stopped!");
+	if (accepted >= params.capacity)
+		return false;
+
+	++accepted;
+	pending.push_back(Request{ p, std::chrono::steady_clock::now(), std::move(done) });
+	bool wake = pending.size() == 1 || pending.size() >= params.max_batch;
+	lock.unlock();
+	// the dispatcher is waiting either for the first query or for a full batch
+	if (wake)
+		ready_cv.notify_one();
+	return true;
+}
+
+void QueryService::dispatch_loop()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true)
+	{
+		if (pending.empty())
+		{
+			flush_requested = false;
+			if (stop)
+				break;
+			ready_cv.wait(lock, [&]() { return stop || flush_requested || !pending.empty(); });
+			continue;
+		}
+
+		// the deadline of the batch is set by its oldest query
+		auto deadline = pending.front().time + params.max_delay;
+		ready_cv.wait_until(lock, deadline, [&]() { return stop || flush_requested || pending.size() >= params.max_batch; });
+
+		auto batch = std::make_shared<std::vector<Request>>();
+		size_t n = std::min(params.max_batch, pending.size());
+		batch->reserve(n);
+		for (size_t i = 0; i < n; ++i)
+		{
+			batch->push_back(std::move(pending.front()));
+			pending.pop_front();
+		}
+		++batches;
+		queries += n;
+
+		lock.unlock();
+		executor.submit(running, [this, batch]() { run_batch(*batch); });
+		lock.lock();
+	}
+}
+
+void QueryService::run_batch(std::vector<Request>& batch)
+{
+	std::vector<Point3> points(batch.size());
+	for (size_t i = 0; i < batch.size(); ++i)
+		points[i] = batch[i].p;
+
+	std::exception_ptr error;
+	std::vector<Result> results;
+	try
+	{
+		results = polyline.locate_points(points, params.packet_size);
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+		results.resize(batch.size());
+	}
+
+	// the capacity is released before the completions, they may submit the next queries (e.g. resumed coroutines)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		accepted -= batch.size();
+	}
+	space_cv.notify_all();
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		// an exception of a completion has nowhere to go, the rest of the batch is still completed
+		try
+		{
+			batch[i].done(error, std::move(results[i]));
+		}
+		catch (...)
+		{
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+#ifndef QUERY_SERVICE_H
+#define QUERY_SERVICE_H
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "polyline.h"
+#include "task_pool.h"
+
+struct QueryServiceParams
+{
+	// a batch is flushed once it has max_batch queries (throughput)...
+	size_t max_batch = 256;
+	// ...or once its oldest query has waited for max_delay (latency)
+	std::chrono::microseconds max_delay{ 500 };
+	// queries accepted but not searched yet, submit blocks and try_submit fails beyond it
+	size_t capacity = 4096;
+	// packet size of the batch traversal, see Polyline::locate_points
+	size_t packet_size = 8;
+	// workers of the executor running the batches (0 - all hardware threads)
+	size_t n_threads = 0;
+};
+
+// Asynchronous front end of Polyline::locate_point: queries of any number of producers are coalesced
+// into batches, which are traversed by Polyline::locate_points on the internal executor
+// the results are delivered through futures, callbacks or coroutine awaitables, on the executor threads
+// (ties as in locate_points); the polyline must outlive the service and must not be modified meanwhile
+class QueryService
+{
+public:
+	using Result = std::tuple<double, std::vector<size_t>, std::vector<Point3>>;
+	// called once per query, with the error of its batch, if any, or with the result;
+	// an exception thrown by the completion is dropped
+	using Completion = std::function<void(std::exception_ptr, Result&&)>;
+
+	// Awaitable of a single query: co_await service.locate(p) suspends the coroutine until the result is ready,
+	// it is resumed on an executor thread (at capacity, its next co_await runs the queued batches while waiting)
+	class Awaiter
+	{
+	public:
+		Awaiter(QueryService& service, const Point3& p) : service(service), p(p) {}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle);
+		Result await_resume();
+
+	private:
+		QueryService& service;
+		Point3 p;
+		std::exception_ptr error;
+		Result result;
+	};
+
+	QueryService(Polyline& polyline, const QueryServiceParams& params = QueryServiceParams());
+	// completes all the accepted queries
+	~QueryService();
+
+	// blocks while the service is at capacity
+	std::future<Result> submit(const Point3& p);
+	// blocks while the service is at capacity, on_done gets a NaN distance and no segments if the batch has failed
+	void submit(const Point3& p, std::function<void(Result&&)> on_done);
+	// returns false (the query is not accepted) if the service is at capacity
+	bool try_submit(const Point3& p, Completion on_done);
+	Awaiter locate(const Point3& p) { return Awaiter(*this, p); }
+
+	// flushes the pending queries without waiting for a full batch or for max_delay
+	void flush();
+
+	size_t batches_count() const;
+	size_t queries_count() const;
+
+private:
+	struct Request
+	{
+		Point3 p;
+		std::chrono::steady_clock::time_point time;
+		Completion done;
+	};
+
+	Polyline& polyline;
+	QueryServiceParams params;
+
+	mutable std::mutex mtx;
+	// the dispatcher waits for a full batch, a deadline, flush or stop
+	std::condition_variable ready_cv;
+	// producers wait for the capacity
+	std::condition_variable space_cv;
+	std::deque<Request> pending;
+	// accepted and not searched yet (released before the completions of the batch run)
+	size_t accepted = 0;
+	bool flush_requested = false;
+	bool stop = false;
+	size_t batches = 0;
+	size_t queries = 0;
+
+	TaskPool executor;
+	TaskGroup running;
+	std::thread dispatcher;
+
+	// blocking - wait for the capacity (a worker runs the queued batches meanwhile), otherwise return false at capacity
+	bool enqueue(const Point3& p, Completion done, bool blocking);
+	void dispatch_loop();
+	void run_batch(std::vector<Request>& batch);
+};
+
+#endif
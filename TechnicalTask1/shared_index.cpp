@@ -0,0 +1,175 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "shared_index.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char SHARED_MAGIC[4] = { 'P', 'L', 'S', '1' };
+static const uint32_t SHARED_VERSION = 1;
+
+SharedIndex::SharedIndex(const std::string& name, std::vector<Point3>& points) : name(name), owner(true)
+{
+	SpatialTree<FlatOctree> built(points);
+	size_t image_size = built.image_size();
+	create(IMAGE_OFFSET + image_size);
+	built.write_image(base + IMAGE_OFFSET);
+
+	Header header;
+	std::memcpy(header.magic, SHARED_MAGIC, sizeof(header.magic));
+	header.version = SHARED_VERSION;
+	header.image_size = image_size;
+	// the image must be complete before anyone sees the magic
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(base, &header, sizeof(header));
+
+	// the builder searches the segment too, its own copy is dropped
+	tree = std::make_unique<SpatialTree<FlatOctree>>(base + IMAGE_OFFSET, image_size);
+}
+
+SharedIndex::SharedIndex(const std::string& name) : name(name), owner(false)
+{
+	attach();
+	Header header;
+	if (length < IMAGE_OFFSET)
+	{
+		release();
+		throw std::runtime_error("Not a shared index: " + name);
+	}
+	std::memcpy(&header, base, sizeof(header));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (std::memcmp(header.magic, SHARED_MAGIC, sizeof(header.magic)) != 0 || header.version != SHARED_VERSION ||
+		header.image_size > length - IMAGE_OFFSET)
+	{
+		release();
+		throw std::runtime_error("Shared index is not ready or not compatible: " + name);
+	}
+	try
+	{
+		tree = std::make_unique<SpatialTree<FlatOctree>>(base + IMAGE_OFFSET, header.image_size);
+	}
+	catch (std::runtime_error&)
+	{
+		release();
+		throw;
+	}
+}
+
+SharedIndex::~SharedIndex()
+{
+	tree = nullptr;
+	release();
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> SharedIndex::locate_point(Point3& p, double upper_bound)
+{
+	return tree->locate_point(p, upper_bound);
+}
+
+#ifdef _WIN32
+
+void SharedIndex::create(size_t size)
+{
+	std::string object = "Local\\" + name;
+	HANDLE h = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		DWORD(uint64_t(size) >> 32), DWORD(size & 0xffffffffu), object.c_str());
+	if (h == nullptr)
+		throw std::runtime_error("Cannot create shared memory " + name);
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		CloseHandle(h);
+		throw std::runtime_error("Shared memory already exists: " + name);
+	}
+	void* view = MapViewOfFile(h, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (view == nullptr)
+	{
+		CloseHandle(h);
+		throw std::runtime_error("Cannot map shared memory " + name);
+	}
+	handle = h;
+	base = static_cast<char*>(view);
+	length = size;
+}
+
+void SharedIndex::attach()
+{
+	std::string object = "Local\\" + name;
+	HANDLE h = OpenFileMappingA(FILE_MAP_READ, FALSE, object.c_str());
+	if (h == nullptr)
+		throw std::runtime_error("No shared memory: " + name);
+	void* view = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION info;
+	if (view == nullptr || VirtualQuery(view, &info, sizeof(info)) == 0)
+	{
+		if (view != nullptr)
+			UnmapViewOfFile(view);
+		CloseHandle(h);
+		throw std::runtime_error("Cannot map shared memory " + name);
+	}
+	handle = h;
+	base = static_cast<char*>(view);
+	// whole pages, the header gives the size of the image
+	length = info.RegionSize;
+}
+
+void SharedIndex::release()
+{
+	if (base != nullptr)
+		UnmapViewOfFile(base);
+	if (handle != nullptr)
+		CloseHandle(handle);
+	base = nullptr;
+	handle = nullptr;
+}
+
+#else
+
+void SharedIndex::create(size_t size)
+{
+	std::string object = "/" + name;
+	int fd = shm_open(object.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		throw std::runtime_error(errno == EEXIST ? "Shared memory already exists: " + name : "Cannot create shared memory " + name);
+	void* view = ftruncate(fd, off_t(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (view == MAP_FAILED)
+	{
+		shm_unlink(object.c_str());
+		throw std::runtime_error("Cannot map shared memory " + name);
+	}
+	base = static_cast<char*>(view);
+	length = size;
+}
+
+void SharedIndex::attach()
+{
+	int fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		throw std::runtime_error("No shared memory: " + name);
+	struct stat st;
+	void* view = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (view == MAP_FAILED)
+		throw std::runtime_error("Cannot map shared memory " + name);
+	base = static_cast<char*>(view);
+	length = size_t(st.st_size);
+}
+
+void SharedIndex::release()
+{
+	if (base != nullptr)
+		munmap(base, length);
+	if (owner)
+		shm_unlink(("/" + name).c_str());
+	base = nullptr;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef SHARED_INDEX_H
+#define SHARED_INDEX_H
+#include <limits>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "spatial_tree.h"
+
+// Index shared by the processes of a host: one process builds a FlatOctree and writes its image
+// (see SpatialTree::write_image, vertices included) into a named shared memory segment,
+// the others attach to the segment read-only and search the image in place, without building anything
+// segment: header {magic, version, image size}, the image at IMAGE_OFFSET
+// the name is removed when the builder is destroyed, the processes attached keep their mappings
+// (on Windows the segment and its name live while any process has it mapped)
+class SharedIndex
+{
+public:
+	// builds the index of the points into a new segment, fails if the name is taken
+	SharedIndex(const std::string& name, std::vector<Point3>& points);
+	// attaches to the segment built by another SharedIndex
+	SharedIndex(const std::string& name);
+	~SharedIndex();
+
+	SharedIndex(const SharedIndex&) = delete;
+	SharedIndex& operator = (const SharedIndex&) = delete;
+
+	// exact search, the same as Polyline::locate_point with IndexType::FLAT_OCTREE
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p,
+		double upper_bound = std::numeric_limits<double>::max());
+	void set_tie_policy(const TiePolicy& policy) { tree->set_tie_policy(policy); }
+
+	bool is_owner() const { return owner; }
+	// bytes of the segment
+	size_t size() const { return length; }
+	const std::string& get_name() const { return name; }
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t image_size;
+	};
+	static constexpr size_t IMAGE_OFFSET = 64;
+
+	std::string name;
+	bool owner;
+	char* base = nullptr;
+	size_t length = 0;
+	// mapping object on Windows
+	void* handle = nullptr;
+	// searches the image in the segment
+	std::unique_ptr<SpatialTree<FlatOctree>> tree;
+
+	void create(size_t size);
+	void attach();
+	void release();
+};
+
+#endif
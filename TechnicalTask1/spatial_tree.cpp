@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include "spatial_tree.h"
+#include "polyline.h"
+
+template<typename Policy>
+std::array<double, SpatialTree<Policy>::DIM> SpatialTree<Policy>::coords(const Point3& p)
+{
+	if constexpr (DIM == 3)
+		return { p.x, p.y, p.z };
+	else
+		return { p.x, p.y };
+}
+
+template<typename Policy>
+SpatialTree<Policy>::SpatialTree(std::vector<Point3>& vertices) : points(vertices.data()), n_points(vertices.size())
+{
+	if (n_points < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	size_t n_seg = n_points - 1;
+	if (n_seg > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("Too many segments for the tree!");
+
+	std::array<double, DIM> lo, hi;
+	lo.fill(std::numeric_limits<double>::max());
+	hi.fill(-std::numeric_limits<double>::max());
+	for (auto& pt : vertices)
+	{
+		auto c = coords(pt);
+		for (size_t a = 0; a < DIM; ++a)
+		{
+			lo[a] = std::min(lo[a], c[a]);
+			hi[a] = std::max(hi[a], c[a]);
+		}
+	}
+	extent = 0.;
+	for (size_t a = 0; a < DIM; ++a)
+	{
+		origin[a] = 0.5 * (lo[a] + hi[a]);
+		extent = std::max(extent, hi[a] - lo[a]);
+	}
+
+	std::vector<uint32_t> ids(n_seg);
+	for (size_t i = 0; i < n_seg; ++i)
+		ids[i] = uint32_t(i);
+	nodes.push_back(Node{});
+	build(0, ids, 0, n_seg, 0);
+	nodes.shrink_to_fit();
+	blocks.shrink_to_fit();
+	node_data = nodes.data();
+	block_data = blocks.data();
+	n_nodes = nodes.size();
+	n_blocks = blocks.size();
+}
+
+template<typename Policy>
+std::array<size_t, 4> SpatialTree<Policy>::image_layout(size_t n_points, size_t n_nodes, size_t n_blocks)
+{
+	auto align = [](size_t offset) { return (offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN; };
+	std::array<size_t, 4> offsets;
+	offsets[0] = align(sizeof(ImageHeader));
+	offsets[1] = align(offsets[0] + n_points * sizeof(Point3));
+	offsets[2] = align(offsets[1] + n_nodes * sizeof(Node));
+	offsets[3] = offsets[2] + n_blocks * sizeof(LeafBlock);
+	return offsets;
+}
+
+template<typename Policy>
+SpatialTree<Policy>::SpatialTree(const void* image, size_t size)
+{
+	auto base = static_cast<const char*>(image);
+	if (size < sizeof(ImageHeader) || reinterpret_cast<uintptr_t>(base) % IMAGE_ALIGN != 0)
+		throw std::runtime_error("Invalid tree image!");
+	ImageHeader header;
+	std::memcpy(&header, base, sizeof(header));
+	if (header.dim != DIM || header.leaf != LEAF || header.scalar_size != sizeof(Scalar))
+		throw std::runtime_error("Tree image is built with another policy!");
+	auto offsets = image_layout(header.n_points, header.n_nodes, header.n_blocks);
+	if (header.n_points < 2 || header.n_nodes == 0 || offsets[3] > size)
+		throw std::runtime_error("Invalid tree image!");
+
+	points = const_cast<Point3*>(reinterpret_cast<const Point3*>(base + offsets[0]));
+	n_points = header.n_points;
+	node_data = reinterpret_cast<const Node*>(base + offsets[1]);
+	n_nodes = header.n_nodes;
+	block_data = reinterpret_cast<const LeafBlock*>(base + offsets[2]);
+	n_blocks = header.n_blocks;
+	depth = header.depth;
+	origin = header.origin;
+	extent = header.extent;
+}
+
+template<typename Policy>
+size_t SpatialTree<Policy>::image_size() const
+{
+	return image_layout(n_points, n_nodes, n_blocks)[3];
+}
+
+template<typename Policy>
+void SpatialTree<Policy>::write_image(void* image) const
+{
+	auto base = static_cast<char*>(image);
+	auto offsets = image_layout(n_points, n_nodes, n_blocks);
+	ImageHeader header{ uint32_t(DIM), uint32_t(LEAF), uint32_t(sizeof(Scalar)), 0, n_points, n_nodes, n_blocks, depth, origin, extent };
+	std::memcpy(base, &header, sizeof(header));
+	std::memcpy(base + offsets[0], points, n_points * sizeof(Point3));
+	std::memcpy(base + offsets[1], node_data, n_nodes * sizeof(Node));
+	std::memcpy(base + offsets[2], block_data, n_blocks * sizeof(LeafBlock));
+}
+
+template<typename Policy>
+void SpatialTree<Policy>::build(size_t idx, std::vector<uint32_t>& ids, size_t begin, size_t end, size_t level)
+{
+	depth = std::max(depth, level);
+	Node node;
+	node.lo.fill(std::numeric_limits<double>::max());
+	node.hi.fill(-std::numeric_limits<double>::max());
+	// box of the midpoints, for the split
+	std::array<double, DIM> m_lo = node.lo, m_hi = node.hi;
+	for (size_t i = begin; i < end; ++i)
+	{
+		auto a = coords(points[ids[i]]), b = coords(points[ids[i] + 1]);
+		for (size_t k = 0; k < DIM; ++k)
+		{
+			node.lo[k] = std::min({ node.lo[k], a[k], b[k] });
+			node.hi[k] = std::max({ node.hi[k], a[k], b[k] });
+			double m = 0.5 * (a[k] + b[k]);
+			m_lo[k] = std::min(m_lo[k], m);
+			m_hi[k] = std::max(m_hi[k], m);
+		}
+	}
+
+	std::array<double, DIM> center;
+	bool splittable = false;
+	for (size_t k = 0; k < DIM; ++k)
+	{
+		center[k] = 0.5 * (m_lo[k] + m_hi[k]);
+		splittable |= m_lo[k] < center[k];
+	}
+
+	// a split into 2^DIM children leaves them mostly underfilled, so a leaf may hold several blocks,
+	// 64 levels are more than enough for any split by halves
+	if (end - begin <= LEAF * LEAF_BLOCKS || !splittable || level >= 64)
+	{
+		node.leaf = true;
+		node.first = uint32_t(blocks.size());
+		node.count = uint32_t((end - begin + LEAF - 1) / LEAF);
+		for (size_t b = begin; b < end; b += LEAF)
+		{
+			LeafBlock block;
+			for (size_t s = 0; s < LEAF; ++s)
+			{
+				if (b + s >= end)
+				{
+					// empty slot: far away, never passes the bound
+					for (size_t k = 0; k < DIM; ++k)
+					{
+						block.start[k][s] = std::numeric_limits<Scalar>::max();
+						block.dir[k][s] = 0;
+					}
+					block.inv_len2[s] = 0;
+					block.ids[s] = std::numeric_limits<uint32_t>::max();
+					continue;
+				}
+				uint32_t id = ids[b + s];
+				auto a = coords(points[id]), c = coords(points[id + 1]);
+				double len2 = 0.;
+				for (size_t k = 0; k < DIM; ++k)
+				{
+					block.start[k][s] = Scalar(a[k] - origin[k]);
+					block.dir[k][s] = Scalar(c[k] - a[k]);
+					len2 += double(block.dir[k][s]) * block.dir[k][s];
+				}
+				// too short for Scalar - as a degenerate one
+				block.inv_len2[s] = len2 > 0 && 1. / len2 < std::numeric_limits<Scalar>::max() ? Scalar(1. / len2) : Scalar(0);
+				block.ids[s] = id;
+			}
+			blocks.push_back(block);
+		}
+		nodes[idx] = node;
+		return;
+	}
+
+	// partition by the child code of the midpoints
+	auto code = [&](uint32_t id)
+	{
+		auto a = coords(points[id]), b = coords(points[id + 1]);
+		size_t c = 0;
+		for (size_t k = 0; k < DIM; ++k)
+			if (0.5 * (a[k] + b[k]) >= center[k])
+				c |= size_t(1) << k;
+		return c;
+	};
+	std::array<size_t, Policy::children + 1> offsets{};
+	for (size_t i = begin; i < end; ++i)
+		++offsets[code(ids[i]) + 1];
+	for (size_t c = 0; c < Policy::children; ++c)
+		offsets[c + 1] += offsets[c];
+	std::vector<uint32_t> sorted(end - begin);
+	std::array<size_t, Policy::children + 1> pos = offsets;
+	for (size_t i = begin; i < end; ++i)
+		sorted[pos[code(ids[i])]++] = ids[i];
+	std::copy(sorted.begin(), sorted.end(), ids.begin() + begin);
+
+	// non-empty children are stored next to each other
+	node.leaf = false;
+	node.first = uint32_t(nodes.size());
+	node.count = 0;
+	for (size_t c = 0; c < Policy::children; ++c)
+		node.count += offsets[c + 1] > offsets[c];
+	nodes[idx] = node;
+	nodes.resize(nodes.size() + node.count);
+
+	size_t child = node.first;
+	for (size_t c = 0; c < Policy::children; ++c)
+		if (offsets[c + 1] > offsets[c])
+			build(child++, ids, begin + offsets[c], begin + offsets[c + 1], level + 1);
+}
+
+template<typename Policy>
+void SpatialTree<Policy>::scan(const LeafBlock& block, const std::array<Scalar, DIM>& p, std::array<Scalar, LEAF>& d2) const
+{
+	for (size_t s = 0; s < LEAF; ++s)
+	{
+		Scalar t = 0;
+		for (size_t k = 0; k < DIM; ++k)
+			t += (p[k] - block.start[k][s]) * block.dir[k][s];
+		t = std::clamp(t * block.inv_len2[s], Scalar(0), Scalar(1));
+		Scalar d = 0;
+		for (size_t k = 0; k < DIM; ++k)
+		{
+			Scalar r = p[k] - block.start[k][s] - t * block.dir[k][s];
+			d += r * r;
+		}
+		d2[s] = d;
+	}
+}
+
+template<typename Policy>
+double SpatialTree<Policy>::box_dist(const Node& node, const std::array<double, DIM>& p) const
+{
+	double d2 = 0.;
+	for (size_t k = 0; k < DIM; ++k)
+	{
+		double r = std::max({ node.lo[k] - p[k], 0., p[k] - node.hi[k] });
+		d2 += r * r;
+	}
+	return std::sqrt(d2);
+}
+
+template<typename Policy>
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> SpatialTree<Policy>::locate_point(Point3& p, double upper_bound)
+{
+	if (upper_bound < std::numeric_limits<double>::max())
+		upper_bound = upper_bound * (1. + 1e-12) + std::numeric_limits<double>::epsilon();
+	double scale = extent;
+	for (size_t k = 0; k < DIM; ++k)
+		scale = std::max(scale, std::fabs(origin[k]) + extent);
+	ClosestSegments closest(ties, p, scale, upper_bound);
+
+	auto pc = coords(p);
+	std::array<Scalar, DIM> p_rel;
+	double p_max = 0.;
+	for (size_t k = 0; k < DIM; ++k)
+	{
+		p_rel[k] = Scalar(pc[k] - origin[k]);
+		p_max = std::max(p_max, std::fabs(pc[k] - origin[k]));
+	}
+	// error of the leaf scan distances: rounding of the relative coordinates and of the projection, with a margin
+	// (start + dir is not exactly the segment end even in double)
+	double slack = 16. * std::numeric_limits<Scalar>::epsilon() * (extent + p_max);
+
+	std::vector<std::pair<double, uint32_t>> stack{ { box_dist(node_data[0], pc), 0 } };
+	std::array<std::pair<double, uint32_t>, Policy::children> order;
+	std::array<Scalar, LEAF> d2;
+	while (!stack.empty())
+	{
+		auto [lb, idx] = stack.back();
+		stack.pop_back();
+		if (!closest.may_reach(lb))
+			continue;
+		const Node& node = node_data[idx];
+
+		if (!node.leaf)
+		{
+			// the nearest child goes on top
+			for (size_t c = 0; c < node.count; ++c)
+				order[c] = { box_dist(node_data[node.first + c], pc), uint32_t(node.first + c) };
+			std::sort(order.begin(), order.begin() + node.count, std::greater<>());
+			for (size_t c = 0; c < node.count; ++c)
+				if (closest.may_reach(order[c].first))
+					stack.push_back(order[c]);
+			continue;
+		}
+
+		for (size_t b = node.first; b < node.first + node.count; ++b)
+		{
+			const LeafBlock& block = block_data[b];
+			scan(block, p_rel, d2);
+			for (size_t s = 0; s < LEAF; ++s)
+			{
+				if (block.ids[s] == std::numeric_limits<uint32_t>::max() || !closest.may_reach(std::sqrt(double(d2[s])) - slack))
+					continue;
+				size_t id = block.ids[s];
+				auto [d, p_proj] = Segment{ &points[id], &points[id + 1], id }.euc_dist(p);
+				closest.add(d, &points[id], &points[id + 1], id, p_proj);
+			}
+		}
+	}
+
+	return closest.resolve();
+}
+
+template<typename Policy>
+size_t SpatialTree<Policy>::memory() const
+{
+	return nodes.capacity() * sizeof(Node) + blocks.capacity() * sizeof(LeafBlock);
+}
+
+template class SpatialTree<TreePolicy<double, 8, 3>>;
+template class SpatialTree<TreePolicy<double, 16, 3>>;
+template class SpatialTree<TreePolicy<float, 16, 3>>;
+template class SpatialTree<TreePolicy<double, 8, 2>>;
+template class SpatialTree<TreePolicy<float, 16, 2>>;
@@ -0,0 +1,139 @@
+#pragma once
+#ifndef SPATIAL_TREE_H
+#define SPATIAL_TREE_H
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+#include "octree_item.h"
+#include "tie_policy.h"
+
+// Compile-time configuration of SpatialTree:
+//		Scalar - type of the leaf coordinates (float halves the leaf size, the distances are refined in double),
+//		LeafCap - number of segments in a leaf block, leaf scans are fixed loops over LeafCap slots,
+//		Dim - 3 for an octree, 2 for a quadtree over (x, y) (for planar polylines, z is ignored by the tree only)
+template<typename Scalar, size_t LeafCap, size_t Dim>
+struct TreePolicy
+{
+	using scalar = Scalar;
+	static constexpr size_t leaf_capacity = LeafCap;
+	static constexpr size_t dim = Dim;
+	static constexpr size_t children = size_t(1) << Dim;
+	static_assert(Dim == 2 || Dim == 3, "Only quadtrees and octrees are supported");
+};
+
+using FlatOctree = TreePolicy<double, 8, 3>;
+using FlatQuadtree = TreePolicy<double, 8, 2>;
+
+// Nearest segment index built over Polyline points
+class SpatialTreeBase
+{
+public:
+	virtual ~SpatialTreeBase() = default;
+	// Branch-and-bound search for the nearest segments,
+	// upper_bound - known upper bound of the minimal distance (if any)
+	// returns:
+	//		mininmum distance,
+	//		ids of the closest segments,
+	//		projections onto closest segments
+	virtual std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p,
+		double upper_bound = std::numeric_limits<double>::max()) = 0;
+	virtual size_t memory() const = 0;
+	// tie policy of locate_point
+	void set_tie_policy(const TiePolicy& policy) { ties = policy; }
+
+protected:
+	TiePolicy ties;
+};
+
+// Loose tree with nodes in a flat array: every segment is placed by its midpoint,
+// node boxes are fitted to the segments they hold,
+// leaves hold blocks of LeafCap segments in SoA layout (start point, direction)
+template<typename Policy>
+class SpatialTree : public SpatialTreeBase
+{
+public:
+	using Scalar = typename Policy::scalar;
+	static constexpr size_t LEAF = Policy::leaf_capacity;
+	static constexpr size_t DIM = Policy::dim;
+	// maximum number of blocks in a leaf
+	static constexpr size_t LEAF_BLOCKS = Policy::children / 2;
+
+	SpatialTree(std::vector<Point3>& vertices);
+	// read-only tree searching in place an image written by write_image (which must outlive it)
+	SpatialTree(const void* image, size_t size);
+
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p,
+		double upper_bound = std::numeric_limits<double>::max()) override;
+	size_t memory() const override;
+
+	size_t get_nodes_count() const { return n_nodes; }
+	size_t get_depth() const { return depth; }
+
+	// Position-independent image of the tree and of its vertices: a header and the arrays at offsets from it,
+	// no pointers, so it may be mapped at any address (e.g. of shared memory, see SharedIndex)
+	size_t image_size() const;
+	void write_image(void* image) const;
+
+private:
+	struct Node
+	{
+		std::array<double, DIM> lo, hi;
+		// leaf: first block and number of blocks, otherwise first child and number of children
+		uint32_t first;
+		uint32_t count;
+		bool leaf;
+	};
+	struct alignas(32) LeafBlock
+	{
+		// coordinates relative to origin
+		std::array<std::array<Scalar, LEAF>, DIM> start, dir;
+		// 1 / |dir|^2 (0 for degenerate segments and empty slots)
+		std::array<Scalar, LEAF> inv_len2;
+		std::array<uint32_t, LEAF> ids;
+	};
+
+	struct ImageHeader
+	{
+		// policy the image is built with
+		uint32_t dim, leaf, scalar_size, reserved;
+		uint64_t n_points, n_nodes, n_blocks, depth;
+		std::array<double, DIM> origin;
+		double extent;
+	};
+	static constexpr size_t IMAGE_ALIGN = 64;
+
+	// the searched vertices, nodes and blocks: the polyline points and the own arrays, or those of an image
+	// (the points of an image are never written to, Segment just takes non-const pointers)
+	Point3* points;
+	size_t n_points;
+	const Node* node_data = nullptr;
+	const LeafBlock* block_data = nullptr;
+	size_t n_nodes = 0;
+	size_t n_blocks = 0;
+	std::array<double, DIM> origin;
+	// largest side of the box of the points
+	double extent;
+	std::vector<Node> nodes;
+	std::vector<LeafBlock> blocks;
+	size_t depth = 0;
+
+	// offsets of the vertices, of the nodes, of the blocks and the image size
+	static std::array<size_t, 4> image_layout(size_t n_points, size_t n_nodes, size_t n_blocks);
+
+	static std::array<double, DIM> coords(const Point3& p);
+	// builds the node idx over the segments ids[begin, end)
+	void build(size_t idx, std::vector<uint32_t>& ids, size_t begin, size_t end, size_t level);
+	// squared lower bounds of the distances from p to the block slots
+	void scan(const LeafBlock& block, const std::array<Scalar, DIM>& p, std::array<Scalar, LEAF>& d2) const;
+	double box_dist(const Node& node, const std::array<double, DIM>& p) const;
+};
+
+extern template class SpatialTree<TreePolicy<double, 8, 3>>;
+extern template class SpatialTree<TreePolicy<double, 16, 3>>;
+extern template class SpatialTree<TreePolicy<float, 16, 3>>;
+extern template class SpatialTree<TreePolicy<double, 8, 2>>;
+extern template class SpatialTree<TreePolicy<float, 16, 2>>;
+
+#endif
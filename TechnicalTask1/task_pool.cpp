@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <chrono>
+#include "task_pool.h"
+
+static thread_local const TaskPool* tl_pool = nullptr;
+static thread_local int tl_queue = -1;
+
+TaskPool::TaskPool(size_t n_threads)
+{
+	if (n_threads == 0)
+		n_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (size_t i = 0; i < n_threads; ++i)
+		queues.push_back(std::make_unique<WorkerQueue>());
+	for (size_t i = 0; i < n_threads; ++i)
+		workers.emplace_back(&TaskPool::worker_loop, this, i);
+}
+
+TaskPool::~TaskPool()
+{
+	stop = true;
+	sleep_cv.notify_all();
+	for (auto& w : workers)
+		w.join();
+}
+
+int TaskPool::own_queue() const
+{
+	return tl_pool == this ? tl_queue : -1;
+}
+
+void TaskPool::submit(TaskGroup& group, std::function<void()> task)
+{
+	++group.pending;
+	int q = own_queue();
+	size_t queue_id = q >= 0 ? size_t(q) : next_queue++ % queues.size();
+	{
+		std::lock_guard<std::mutex> lock(queues[queue_id]->mtx);
+		queues[queue_id]->tasks.push_back(Task{ std::move(task), &group });
+	}
+	++queued;
+	sleep_cv.notify_one();
+}
+
+bool TaskPool::try_pop(size_t queue_id, Task& t, bool steal)
+{
+	auto& q = *queues[queue_id];
+	std::lock_guard<std::mutex> lock(q.mtx);
+	if (q.tasks.empty())
+		return false;
+	if (steal)
+	{
+		t = std::move(q.tasks.front());
+		q.tasks.pop_front();
+	}
+	else
+	{
+		t = std::move(q.tasks.back());
+		q.tasks.pop_back();
+	}
+	--queued;
+	return true;
+}
+
+bool TaskPool::find_task(Task& t)
+{
+	if (queued == 0)
+		return false;
+	int own = own_queue();
+	if (own >= 0 && try_pop(own, t, false))
+		return true;
+	// steal, starting from the neighbour queue
+	size_t n = queues.size();
+	size_t start = own >= 0 ? own + 1 : 0;
+	for (size_t k = 0; k < n; ++k)
+	{
+		size_t q = (start + k) % n;
+		if (int(q) != own && try_pop(q, t, true))
+			return true;
+	}
+	return false;
+}
+
+void TaskPool::run(Task& t)
+{
+	TaskGroup& group = *t.group;
+	std::exception_ptr error;
+	try
+	{
+		t.foo();
+	}
+	catch (...)
+	{
+		error = std::current_exception();
+	}
+	std::lock_guard<std::mutex> lock(group.mtx);
+	if (error && !group.error)
+		group.error = error;
+	if (--group.pending == 0)
+		group.done_cv.notify_all();
+}
+
+void TaskPool::wait(TaskGroup& group)
+{
+	Task t;
+	while (group.pending > 0)
+	{
+		if (find_task(t))
+		{
+			run(t);
+			continue;
+		}
+		// tasks queued by the running ones do not signal the group, hence the timeout
+		std::unique_lock<std::mutex> lock(group.mtx);
+		group.done_cv.wait_for(lock, std::chrono::milliseconds(1), [&]() { return group.pending == 0 || queued > 0; });
+	}
+
+	// the last task has released the group
+	std::lock_guard<std::mutex> lock(group.mtx);
+	if (group.error)
+	{
+		std::exception_ptr error = group.error;
+		group.error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+bool TaskPool::run_one()
+{
+	Task t;
+	if (!find_task(t))
+		return false;
+	run(t);
+	return true;
+}
+
+void TaskPool::worker_loop(size_t id)
+{
+	tl_pool = this;
+	tl_queue = int(id);
+	Task t;
+	while (!stop)
+	{
+		if (find_task(t))
+		{
+			run(t);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mtx);
+		sleep_cv.wait_for(lock, std::chrono::milliseconds(1), [&]() { return queued > 0 || stop; });
+	}
+}
+
+void TaskPool::parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t)>& foo)
+{
+	TaskGroup group;
+	grain = std::max(grain, size_t(1));
+	for (size_t b = begin; b < end; b += grain)
+	{
+		size_t e = std::min(b + grain, end);
+		submit(group, [&foo, b, e]() {
+			for (size_t i = b; i < e; ++i)
+				foo(i);
+			});
+	}
+	wait(group);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counter of the unfinished tasks submitted as a group
+struct TaskGroup
+{
+	std::atomic<size_t> pending{ 0 };
+	// the first exception thrown by a task of the group, rethrown by TaskPool::wait
+	std::exception_ptr error;
+	// guards error and the last decrement of pending, so that wait cannot return while a task still signals
+	std::mutex mtx;
+	std::condition_variable done_cv;
+};
+
+// Work-stealing thread pool: every worker has its own deque of tasks,
+// it pops its own tasks from the back (LIFO) and steals from the front of the others (FIFO)
+// tasks submitted from a worker go to its own deque, the rest are spread round-robin
+class TaskPool
+{
+public:
+	// n_threads = 0 - one worker per hardware thread
+	TaskPool(size_t n_threads = 0);
+	~TaskPool();
+
+	void submit(TaskGroup& group, std::function<void()> task);
+	// the calling thread executes (or steals) tasks until the group is done, sleeps when there is nothing to steal
+	// rethrows the first exception of the tasks of the group (after all of them have finished)
+	void wait(TaskGroup& group);
+	// runs foo(i) for i in [begin, end), in chunks of grain indices, and waits (rethrows as wait)
+	void parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t)>& foo);
+	// executes one queued task (own or stolen), returns false if there is none
+	// (for a task waiting for a condition which the queued tasks establish)
+	bool run_one();
+
+	size_t size() const { return workers.size(); }
+	// the calling thread is a worker of this pool
+	bool in_worker() const { return own_queue() >= 0; }
+
+private:
+	struct Task
+	{
+		std::function<void()> foo;
+		TaskGroup* group;
+	};
+	struct WorkerQueue
+	{
+		std::mutex mtx;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> next_queue{ 0 };
+	std::atomic<size_t> queued{ 0 };
+	std::atomic<bool> stop{ false };
+	std::mutex sleep_mtx;
+	std::condition_variable sleep_cv;
+
+	// index of the queue owned by the current thread, or -1 for non-worker threads
+	int own_queue() const;
+	bool try_pop(size_t queue_id, Task& t, bool steal);
+	bool find_task(Task& t);
+	void run(Task& t);
+	void worker_loop(size_t id);
+};
+
+#endif
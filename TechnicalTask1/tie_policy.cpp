@@ -0,0 +1,381 @@
+#include "tie_policy.h"
+
+static DoubleDouble two_sum(double a, double b)
+{
+	double s = a + b;
+	double bb = s - a;
+	return DoubleDouble{ s, (a - (s - bb)) + (b - bb) };
+}
+
+static DoubleDouble quick_two_sum(double a, double b)
+{
+	double s = a + b;
+	return DoubleDouble{ s, b - (s - a) };
+}
+
+static DoubleDouble two_prod(double a, double b)
+{
+	double p = a * b;
+	return DoubleDouble{ p, std::fma(a, b, -p) };
+}
+
+static DoubleDouble dd_add(const DoubleDouble& a, const DoubleDouble& b)
+{
+	DoubleDouble s = two_sum(a.hi, b.hi);
+	DoubleDouble t = two_sum(a.lo, b.lo);
+	s = quick_two_sum(s.hi, s.lo + t.hi);
+	return quick_two_sum(s.hi, s.lo + t.lo);
+}
+
+static DoubleDouble dd_neg(const DoubleDouble& a)
+{
+	return DoubleDouble{ -a.hi, -a.lo };
+}
+
+static DoubleDouble dd_mul(const DoubleDouble& a, const DoubleDouble& b)
+{
+	DoubleDouble p = two_prod(a.hi, b.hi);
+	return quick_two_sum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+static DoubleDouble dd_div(const DoubleDouble& a, const DoubleDouble& b)
+{
+	double q1 = a.hi / b.hi;
+	DoubleDouble r = dd_add(a, dd_neg(dd_mul(b, DoubleDouble{ q1, 0. })));
+	double q2 = r.hi / b.hi;
+	r = dd_add(r, dd_neg(dd_mul(b, DoubleDouble{ q2, 0. })));
+	double q3 = r.hi / b.hi;
+	return dd_add(quick_two_sum(q1, q2), DoubleDouble{ q3, 0. });
+}
+
+static DoubleDouble dd_dot(const DoubleDouble (&a)[3], const DoubleDouble (&b)[3])
+{
+	return dd_add(dd_add(dd_mul(a[0], b[0]), dd_mul(a[1], b[1])), dd_mul(a[2], b[2]));
+}
+
+double dd_sqrt(const DoubleDouble& x)
+{
+	if (x.hi <= 0.)
+		return 0.;
+	// one Newton step from the double root
+	double s = std::sqrt(x.hi);
+	DoubleDouble r = dd_add(x, dd_neg(two_prod(s, s)));
+	return s + r.hi / (2. * s);
+}
+
+DoubleDouble refined_dist2(const Point3& p, const Point3& a, const Point3& b)
+{
+	DoubleDouble ab[3] = { two_sum(b.x, -a.x), two_sum(b.y, -a.y), two_sum(b.z, -a.z) };
+	DoubleDouble ap[3] = { two_sum(p.x, -a.x), two_sum(p.y, -a.y), two_sum(p.z, -a.z) };
+	DoubleDouble l2 = dd_dot(ab, ab), t = dd_dot(ap, ab);
+	// the vertex a is the closest point
+	if (l2.hi == 0. || t.hi <= 0.)
+		return dd_dot(ap, ap);
+	// the vertex b
+	if (!(t < l2))
+	{
+		DoubleDouble bp[3] = { two_sum(p.x, -b.x), two_sum(p.y, -b.y), two_sum(p.z, -b.z) };
+		return dd_dot(bp, bp);
+	}
+	// |ap|^2 - (ap . ab)^2 / |ab|^2
+	DoubleDouble d2 = dd_add(dd_dot(ap, ap), dd_neg(dd_div(dd_mul(t, t), l2)));
+	return d2.hi < 0. ? DoubleDouble{ 0., 0. } : d2;
+}
+
+double refined_error(const Point3& p, const Point3& a, const Point3& b)
+{
+	// the rounding errors of refined_dist2 are a few ulps of double-double of |ap|^2 or |bp|^2
+	// (t^2 / |ab|^2 <= |ap|^2), 2^-96 leaves a wide margin
+	Point3 ap = p - a, bp = p - b;
+	double m = std::max(ap.x * ap.x + ap.y * ap.y + ap.z * ap.z, bp.x * bp.x + bp.y * bp.y + bp.z * bp.z);
+	return 0x1p-96 * m * (1. + 1e-6);
+}
+
+// Exact arithmetic on expansions: sums of non-overlapping doubles, by increasing magnitude, without zeros
+// (J. R. Shewchuk, Adaptive Precision Floating-Point Arithmetic and Fast Robust Geometric Predicates)
+using Expansion = std::vector<double>;
+
+// the components of both are merged by magnitude and accumulated
+static Expansion sum(const Expansion& e, const Expansion& f)
+{
+	Expansion h;
+	h.reserve(e.size() + f.size());
+	size_t i = 0, j = 0;
+	auto next = [&]() { return j == f.size() || (i < e.size() && std::abs(e[i]) < std::abs(f[j])) ? e[i++] : f[j++]; };
+	double q = next();
+	if (i < e.size() || j < f.size())
+	{
+		double c = next();
+		DoubleDouble s = quick_two_sum(c, q);
+		if (s.lo != 0.)
+			h.push_back(s.lo);
+		q = s.hi;
+		while (i < e.size() || j < f.size())
+		{
+			s = two_sum(q, next());
+			if (s.lo != 0.)
+				h.push_back(s.lo);
+			q = s.hi;
+		}
+	}
+	if (q != 0. || h.empty())
+		h.push_back(q);
+	return h;
+}
+
+static Expansion scale(const Expansion& e, double b)
+{
+	Expansion h;
+	DoubleDouble p = two_prod(e[0], b);
+	if (p.lo != 0.)
+		h.push_back(p.lo);
+	double q = p.hi;
+	for (size_t i = 1; i < e.size(); ++i)
+	{
+		p = two_prod(e[i], b);
+		DoubleDouble s = two_sum(q, p.lo);
+		if (s.lo != 0.)
+			h.push_back(s.lo);
+		s = quick_two_sum(p.hi, s.hi);
+		if (s.lo != 0.)
+			h.push_back(s.lo);
+		q = s.hi;
+	}
+	if (q != 0. || h.empty())
+		h.push_back(q);
+	return h;
+}
+
+// the shortest form of the same value, keeps the products short
+static Expansion compress(const Expansion& e)
+{
+	Expansion g(e.size());
+	size_t bottom = e.size() - 1;
+	double q = e[bottom];
+	for (size_t i = e.size() - 1; i-- > 0; )
+	{
+		DoubleDouble s = quick_two_sum(q, e[i]);
+		if (s.lo != 0.)
+		{
+			g[bottom--] = s.hi;
+			q = s.lo;
+		}
+		else
+			q = s.hi;
+	}
+	g[bottom] = q;
+	Expansion h;
+	for (size_t i = bottom + 1; i < e.size(); ++i)
+	{
+		DoubleDouble s = quick_two_sum(g[i], q);
+		if (s.lo != 0.)
+			h.push_back(s.lo);
+		q = s.hi;
+	}
+	h.push_back(q);
+	return h;
+}
+
+static Expansion mul(const Expansion& e, const Expansion& f)
+{
+	if (f.size() == 1)
+		return f[0] == 1. ? e : scale(e, f[0]);
+	Expansion h{ 0. };
+	for (double c : f)
+		h = sum(h, scale(e, c));
+	return compress(h);
+}
+
+static Expansion neg(Expansion e)
+{
+	for (double& c : e)
+		c = -c;
+	return e;
+}
+
+// the largest component decides the sign
+static int sign(const Expansion& e)
+{
+	return e.back() > 0. ? 1 : (e.back() < 0. ? -1 : 0);
+}
+
+// a - b, exact
+static Expansion diff(double a, double b)
+{
+	DoubleDouble s = two_sum(a, -b);
+	return s.lo != 0. ? Expansion{ s.lo, s.hi } : Expansion{ s.hi };
+}
+
+static Expansion dot(const Expansion (&u)[3], const Expansion (&v)[3])
+{
+	return compress(sum(sum(mul(u[0], v[0]), mul(u[1], v[1])), mul(u[2], v[2])));
+}
+
+// squared distance num / den, den > 0
+struct ExactDist2
+{
+	Expansion num, den;
+};
+
+static ExactDist2 exact_dist2(const Point3& p, const Point3& a, const Point3& b)
+{
+	Expansion ab[3] = { diff(b.x, a.x), diff(b.y, a.y), diff(b.z, a.z) };
+	Expansion ap[3] = { diff(p.x, a.x), diff(p.y, a.y), diff(p.z, a.z) };
+	Expansion l2 = dot(ab, ab), t = dot(ap, ab);
+	if (sign(l2) == 0 || sign(t) <= 0)
+		return ExactDist2{ dot(ap, ap), Expansion{ 1. } };
+	if (sign(sum(t, neg(l2))) >= 0)
+	{
+		Expansion bp[3] = { diff(p.x, b.x), diff(p.y, b.y), diff(p.z, b.z) };
+		return ExactDist2{ dot(bp, bp), Expansion{ 1. } };
+	}
+	// (|ap|^2 |ab|^2 - (ap . ab)^2) / |ab|^2
+	return ExactDist2{ compress(sum(mul(dot(ap, ap), l2), neg(mul(t, t)))), l2 };
+}
+
+// sign of u - v
+static int compare(const ExactDist2& u, const ExactDist2& v)
+{
+	return sign(sum(mul(u.num, v.den), neg(mul(v.num, u.den))));
+}
+
+// sqrt(u) <= (1 + relative) sqrt(v) + absolute
+static bool within(const ExactDist2& u, const ExactDist2& v, const TiePolicy& policy)
+{
+	DoubleDouble c = two_sum(1., policy.relative);
+	Expansion c2 = mul(c.lo != 0. ? Expansion{ c.lo, c.hi } : Expansion{ c.hi }, c.lo != 0. ? Expansion{ c.lo, c.hi } : Expansion{ c.hi });
+	DoubleDouble a = two_prod(policy.absolute, policy.absolute);
+	Expansion a2 = a.lo != 0. ? Expansion{ a.lo, a.hi } : Expansion{ a.hi };
+	// u - c^2 v - a^2 <= 2 c a sqrt(v), over the common denominator
+	Expansion uv = mul(u.den, v.den);
+	Expansion l = compress(sum(sum(mul(u.num, v.den), neg(mul(c2, mul(v.num, u.den)))), neg(mul(a2, uv))));
+	if (sign(l) <= 0)
+		return true;
+	if (policy.absolute == 0.)
+		return false;
+	// both sides are positive, squared: l^2 <= 4 c^2 a^2 v.num v.den u.den^2
+	Expansion r = scale(mul(mul(c2, a2), mul(mul(v.num, v.den), mul(u.den, u.den))), 4.);
+	return sign(sum(r, neg(mul(l, l)))) >= 0;
+}
+
+///____________________________________________________________________________________
+
+ClosestSegments::ClosestSegments(const TiePolicy& policy, const Point3& p, double data_scale, double upper_bound) :
+	policy(policy), p(p), min_dist(upper_bound)
+{
+	double scale = std::max({ data_scale, std::abs(p.x), std::abs(p.y), std::abs(p.z) });
+	error = ERROR_ULPS * std::numeric_limits<double>::epsilon() * scale;
+	// no bound: the tolerance of an infinite distance would be NaN (0 * inf)
+	limit = std::isinf(min_dist) ? min_dist : min_dist + policy.tolerance(min_dist) + 2. * error;
+}
+
+void ClosestSegments::lower(double d)
+{
+	min_dist = d;
+	limit = min_dist + policy.tolerance(min_dist) + 2. * error;
+	candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](const Candidate& c) { return c.d > limit; }), candidates.end());
+}
+
+void ClosestSegments::merge(const ClosestSegments& other)
+{
+	for (auto& c : other.candidates)
+	{
+		if (c.d > limit)
+			continue;
+		candidates.push_back(c);
+		if (c.d < min_dist)
+			lower(c.d);
+	}
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> ClosestSegments::resolve() const
+{
+	std::vector<size_t> ids;
+	std::vector<Point3> projs;
+	if (candidates.empty())
+		return std::make_tuple(std::numeric_limits<double>::quiet_NaN(), ids, projs);
+	if (candidates.size() == 1)
+		return std::make_tuple(candidates[0].d, std::vector<size_t>{ candidates[0].id }, std::vector<Point3>{ candidates[0].proj });
+
+	// a segment may come from more than one node
+	std::vector<const Candidate*> unique;
+	for (auto& c : candidates)
+		unique.push_back(&c);
+	std::sort(unique.begin(), unique.end(), [](auto a, auto b) { return a->id < b->id || (a->id == b->id && a->d < b->d); });
+	unique.erase(std::unique(unique.begin(), unique.end(), [](auto a, auto b) { return a->id == b->id; }), unique.end());
+
+	const Candidate* best = *std::min_element(unique.begin(), unique.end(), [](auto a, auto b) { return a->d < b->d; });
+	double tol = policy.tolerance(best->d);
+	// no candidate within 2 error of the band edge (or of the minimum): the double distances decide
+	bool certain = std::all_of(unique.begin(), unique.end(), [&](auto c) { return c == best || c->d - best->d <= tol - 2. * error; });
+	if (certain)
+	{
+		for (auto c : unique)
+		{
+			ids.push_back(c->id);
+			projs.push_back(c->proj);
+		}
+		return std::make_tuple(best->d, ids, projs);
+	}
+
+	// double-double distances with their error bounds, the exact ones only for the decisions within the bounds
+	std::vector<DoubleDouble> d2(unique.size());
+	std::vector<double> err(unique.size());
+	std::vector<ExactDist2> exact(unique.size());
+	std::vector<bool> has_exact(unique.size(), false);
+	auto exact_at = [&](size_t k) -> const ExactDist2&
+	{
+		if (!has_exact[k])
+		{
+			exact[k] = exact_dist2(p, unique[k]->a, unique[k]->b);
+			has_exact[k] = true;
+		}
+		return exact[k];
+	};
+	// sign of d2[k] - d2[j]
+	auto order = [&](size_t k, size_t j)
+	{
+		double delta = dd_add(d2[k], dd_neg(d2[j])).hi;
+		if (std::abs(delta) > err[k] + err[j])
+			return delta > 0. ? 1 : -1;
+		return compare(exact_at(k), exact_at(j));
+	};
+
+	size_t ref = 0;
+	for (size_t k = 0; k < unique.size(); ++k)
+	{
+		d2[k] = refined_dist2(p, unique[k]->a, unique[k]->b);
+		err[k] = refined_error(p, unique[k]->a, unique[k]->b);
+		if (k == 0)
+			continue;
+		int o = order(k, ref);
+		if (o < 0 || (o == 0 && unique[k]->d < unique[ref]->d))
+			ref = k;
+	}
+	double ref_dist = dd_sqrt(d2[ref]);
+	tol = policy.tolerance(ref_dist);
+	// error of dd_sqrt(d2[k]): the rounding to double and the error of d2[k] (|sqrt(x) - sqrt(y)| <= |x - y| / sqrt(x))
+	auto root_error = [&](size_t k, double d)
+	{
+		return 2. * std::numeric_limits<double>::epsilon() * d + (d > 0. ? std::min(std::sqrt(err[k]), err[k] / d) : std::sqrt(err[k]));
+	};
+	for (size_t k = 0; k < unique.size(); ++k)
+	{
+		bool tie = k == ref;
+		if (!tie && policy.absolute == 0. && policy.relative == 0.)
+			tie = order(k, ref) == 0;
+		else if (!tie)
+		{
+			double d = dd_sqrt(d2[k]);
+			double excess = d - ref_dist - tol;
+			double margin = root_error(k, d) + (1. + policy.relative) * root_error(ref, ref_dist) + 2. * std::numeric_limits<double>::epsilon() * (d + tol);
+			tie = std::abs(excess) > margin ? excess <= 0. : within(exact_at(k), exact_at(ref), policy);
+		}
+		if (tie)
+		{
+			ids.push_back(unique[k]->id);
+			projs.push_back(unique[k]->proj);
+		}
+	}
+	return std::make_tuple(unique[ref]->d, ids, projs);
+}
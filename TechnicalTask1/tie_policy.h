@@ -0,0 +1,102 @@
+#pragma once
+#ifndef TIE_POLICY_H
+#define TIE_POLICY_H
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+#include <vector>
+#include "geo_units.h"
+
+using namespace geo_units;
+
+// Tolerance of the distance ties: distances a and b are tied if |a - b| <= absolute + relative * max(a, b)
+// the default is the absolute machine epsilon, as compared by is_equal
+struct TiePolicy
+{
+	double relative = 0.;
+	double absolute = std::numeric_limits<double>::epsilon();
+
+	static TiePolicy relative_to(double r) { return TiePolicy{ r, 0. }; }
+	static TiePolicy ulps(double n) { return TiePolicy{ n * std::numeric_limits<double>::epsilon(), 0. }; }
+	// ties of the equal distances only
+	static TiePolicy exact() { return TiePolicy{ 0., 0. }; }
+
+	double tolerance(double d) const { return absolute + relative * d; }
+};
+
+// Unevaluated sum hi + lo, |lo| <= ulp(hi) / 2
+struct DoubleDouble
+{
+	double hi, lo;
+
+	bool operator < (const DoubleDouble& b) const { return hi < b.hi || (hi == b.hi && lo < b.lo); }
+	bool operator == (const DoubleDouble& b) const { return hi == b.hi && lo == b.lo; }
+};
+
+// squared distance from p to the segment [a, b] in double-double arithmetic (about 106 significant bits),
+// the coordinate differences are exact
+DoubleDouble refined_dist2(const Point3& p, const Point3& a, const Point3& b);
+// bound of the error of refined_dist2
+double refined_error(const Point3& p, const Point3& a, const Point3& b);
+double dd_sqrt(const DoubleDouble& x);
+
+// Closest segments of a query under a tie policy
+// distances computed in double are within error = ERROR_ULPS * eps * scale of the true ones
+// (scale - the largest coordinate magnitude of the query and of the data), so every segment
+// within the band tolerance + 2 error of the minimum is kept as a candidate, one comparison per segment;
+// resolve() re-evaluates the candidates in double-double only if some of them are near the band edge,
+// and decides the ties in exact (expansion) arithmetic only where the double-double values are within their error bounds
+class ClosestSegments
+{
+public:
+	static constexpr double ERROR_ULPS = 32.;
+
+	ClosestSegments(const TiePolicy& policy, const Point3& p, double data_scale,
+		double upper_bound = std::numeric_limits<double>::max());
+
+	// distance up to which a segment may still be the closest one or tied with it
+	double reach() const { return limit; }
+	double min() const { return min_dist; }
+	// bound of the error of the distances computed in double
+	double error_bound() const { return error; }
+	// a lower bound lb (e.g. of the segments in a box) may still be within reach, up to the error of the computed distances
+	bool may_reach(double lb) const { return lb <= limit + error; }
+	bool empty() const { return candidates.empty(); }
+
+	// the segment [a, b] is copied, so the vertices need not outlive the search (e.g. decoded or paged ones)
+	void add(double d, const Point3* a, const Point3* b, size_t id, const Point3& proj)
+	{
+		if (d > limit)
+			return;
+		candidates.push_back(Candidate{ d, *a, *b, id, proj });
+		if (d < min_dist)
+			lower(d);
+	}
+	// adds the candidates of another search of the same query (e.g. of a parallel task)
+	void merge(const ClosestSegments& other);
+
+	// minimal distance, ids of the closest segments and the projections onto them (NaN and none if no segment found)
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> resolve() const;
+
+private:
+	struct Candidate
+	{
+		double d;
+		Point3 a, b;
+		size_t id;
+		Point3 proj;
+	};
+
+	TiePolicy policy;
+	Point3 p;
+	double error;
+	double min_dist;
+	double limit;
+	std::vector<Candidate> candidates;
+
+	// sets the new minimum, drops the candidates out of its reach
+	void lower(double d);
+};
+
+#endif
@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include "validation.h"
+#include "task_pool.h"
+
+static const char* model_name(GeneratorModel model)
+{
+	switch (model)
+	{
+	case GeneratorModel::UNIFORM: return "uniform";
+	case GeneratorModel::RANDOM_WALK: return "walk";
+	case GeneratorModel::CLUSTERED_TRACKS: return "tracks";
+	case GeneratorModel::HELIX: return "helix";
+	case GeneratorModel::ROAD_GRID: return "roads";
+	case GeneratorModel::DUPLICATES: return "duplicates";
+	}
+	return "unknown";
+}
+
+static const char* index_name(IndexType index)
+{
+	switch (index)
+	{
+	case IndexType::OCTREE: return "octree";
+	case IndexType::HASH_GRID: return "hash grid";
+	case IndexType::FLAT_OCTREE: return "flat octree";
+	case IndexType::FLAT_QUADTREE: return "flat quadtree";
+	}
+	return "unknown";
+}
+
+// the octree reports every construction to std::cout, which would flood the report while minimizing
+struct MuteOutput
+{
+	std::streambuf* saved = std::cout.rdbuf(nullptr);
+	~MuteOutput() { std::cout.rdbuf(saved); }
+};
+
+static double norm(const Point3& v)
+{
+	return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+size_t ValidationReport::total_queries() const
+{
+	size_t n = 0;
+	for (size_t q : queries)
+		n += q;
+	return n;
+}
+
+size_t ValidationReport::total_failed() const
+{
+	size_t n = 0;
+	for (size_t f : failed)
+		n += f;
+	return n;
+}
+
+///____________________________________________________________________________________
+
+Validator::Validator(const ValidationParams& params) : params(params)
+{
+	if (params.n_points < 3)
+		throw std::runtime_error("Validation polylines need at least three points!");
+	if (params.models.empty() || params.indexes.empty())
+		throw std::runtime_error("Nothing to validate!");
+}
+
+const char* Validator::kind_name(QueryKind kind)
+{
+	switch (kind)
+	{
+	case QueryKind::INSIDE: return "inside";
+	case QueryKind::OUTSIDE: return "outside";
+	case QueryKind::VERTEX: return "vertex";
+	case QueryKind::ON_SEGMENT: return "on segment";
+	case QueryKind::EQUIDISTANT: return "equidistant";
+	}
+	return "unknown";
+}
+
+std::string Validator::compare(Polyline& p, Point3& q)
+{
+	auto [dist, ids, projs] = p.locate_point(q);
+	auto [dist_greedy, ids_greedy, projs_greedy] = p.locate_point_greedy(q);
+	std::ostringstream out;
+	out.precision(17);
+	if (std::isnan(dist) || std::isnan(dist_greedy))
+	{
+		if (std::isnan(dist) == std::isnan(dist_greedy))
+			return {};
+		out << "distance " << dist << ", greedy " << dist_greedy;
+		return out.str();
+	}
+
+	// the double distances of the tied segments differ by their rounding, see ClosestSegments
+	double scale = std::max({ std::abs(q.x), std::abs(q.y), std::abs(q.z) });
+	for (auto* found : { &ids, &ids_greedy })
+	{
+		for (size_t id : *found)
+		{
+			auto s = p.get_segment(id);
+			scale = std::max({ scale, std::abs(s->p1->x), std::abs(s->p1->y), std::abs(s->p1->z),
+				std::abs(s->p2->x), std::abs(s->p2->y), std::abs(s->p2->z) });
+		}
+	}
+	double slack = p.get_tie_policy().tolerance(dist_greedy) + 2. * ClosestSegments::ERROR_ULPS * std::numeric_limits<double>::epsilon() * scale;
+	if (std::abs(dist - dist_greedy) > slack)
+	{
+		out << "distance " << dist << ", greedy " << dist_greedy;
+		return out.str();
+	}
+
+	auto sorted = [](std::vector<size_t>& ids, std::vector<Point3>& projs)
+	{
+		std::vector<std::pair<size_t, Point3>> found(ids.size());
+		for (size_t k = 0; k < ids.size(); ++k)
+			found[k] = { ids[k], projs[k] };
+		std::sort(found.begin(), found.end(), [](auto& a, auto& b) { return a.first < b.first; });
+		return found;
+	};
+	auto found = sorted(ids, projs), found_greedy = sorted(ids_greedy, projs_greedy);
+	bool same_ids = found.size() == found_greedy.size() && std::equal(found.begin(), found.end(), found_greedy.begin(),
+		[](auto& a, auto& b) { return a.first == b.first; });
+	if (!same_ids)
+	{
+		out << "segments";
+		for (auto& f : found)
+			out << " " << f.first;
+		out << ", greedy";
+		for (auto& f : found_greedy)
+			out << " " << f.first;
+		return out.str();
+	}
+	for (size_t k = 0; k < found.size(); ++k)
+	{
+		if (found[k].second.euc_dist(found_greedy[k].second) > slack)
+		{
+			auto& a = found[k].second;
+			auto& b = found_greedy[k].second;
+			out << "projection onto segment " << found[k].first << " (" << a.x << ", " << a.y << ", " << a.z
+				<< "), greedy (" << b.x << ", " << b.y << ", " << b.z << ")";
+			return out.str();
+		}
+	}
+	return {};
+}
+
+std::vector<Point3> Validator::minimize(std::vector<Point3> points, const std::function<bool(std::vector<Point3>&)>& fails,
+	size_t max_attempts)
+{
+	size_t attempts = 0;
+	size_t run = std::max(points.size() / 2, size_t(1));
+	while (attempts < max_attempts && points.size() > 2)
+	{
+		bool removed = false;
+		for (size_t begin = 0; begin < points.size() && attempts < max_attempts; )
+		{
+			size_t end = std::min(begin + run, points.size());
+			if (points.size() - (end - begin) < 2)
+			{
+				begin = end;
+				continue;
+			}
+			std::vector<Point3> candidate(points.begin(), points.begin() + begin);
+			candidate.insert(candidate.end(), points.begin() + end, points.end());
+			++attempts;
+			// the next run moves to begin
+			if (fails(candidate))
+			{
+				points = std::move(candidate);
+				removed = true;
+			}
+			else
+				begin = end;
+		}
+		// 1-minimal: no single vertex may be removed
+		if (!removed && run == 1)
+			break;
+		if (!removed)
+			run = std::max(run / 2, size_t(1));
+	}
+	return points;
+}
+
+std::vector<std::pair<QueryKind, Point3>> Validator::make_queries(const std::vector<Point3>& points, size_t n, uint64_t seed) const
+{
+	Point3 lo = points[0], hi = points[0];
+	for (auto& v : points)
+	{
+		lo = Point3{ std::min(lo.x, v.x), std::min(lo.y, v.y), std::min(lo.z, v.z) };
+		hi = Point3{ std::max(hi.x, v.x), std::max(hi.y, v.y), std::max(hi.z, v.z) };
+	}
+	double extent = std::max({ hi.x - lo.x, hi.y - lo.y, hi.z - lo.z, 1. });
+
+	std::mt19937_64 re(seed);
+	std::uniform_real_distribution<double> unif(0., 1.);
+	std::uniform_int_distribution<size_t> vertex(0, points.size() - 1), inner(1, points.size() - 2), axis(0, 5);
+	std::vector<std::pair<QueryKind, Point3>> queries(n);
+	for (size_t i = 0; i < n; ++i)
+	{
+		QueryKind kind = QueryKind(i % QUERY_KINDS);
+		Point3 q;
+		switch (kind)
+		{
+		case QueryKind::INSIDE:
+			q = Point3{ lo.x + unif(re) * (hi.x - lo.x), lo.y + unif(re) * (hi.y - lo.y), lo.z + unif(re) * (hi.z - lo.z) };
+			break;
+		case QueryKind::OUTSIDE:
+		{
+			// one coordinate beyond a face, the others anywhere around the box
+			std::array<double, 3> c;
+			std::array<double, 3> l{ lo.x, lo.y, lo.z }, h{ hi.x, hi.y, hi.z };
+			for (size_t k = 0; k < 3; ++k)
+				c[k] = l[k] - extent + unif(re) * (h[k] - l[k] + 2. * extent);
+			size_t a = axis(re);
+			c[a % 3] = a < 3 ? l[a % 3] - (0.01 + unif(re)) * extent : h[a % 3] + (0.01 + unif(re)) * extent;
+			q = Point3{ c[0], c[1], c[2] };
+			break;
+		}
+		case QueryKind::VERTEX:
+			q = points[vertex(re)];
+			break;
+		case QueryKind::ON_SEGMENT:
+		{
+			size_t k = vertex(re) % (points.size() - 1);
+			q = points[k] + (points[k + 1] - points[k]) * unif(re);
+			break;
+		}
+		case QueryKind::EQUIDISTANT:
+		{
+			size_t k = inner(re);
+			Point3 a = points[k - 1] - points[k], b = points[k + 1] - points[k];
+			double la = norm(a), lb = norm(b);
+			q = points[k];
+			if (la == 0. || lb == 0.)
+				break;
+			Point3 bisector = a * (1. / la) + b * (1. / lb);
+			// straight angle: any perpendicular is equidistant
+			if (norm(bisector) < 1e-9)
+				bisector = std::abs(a.x) < std::abs(a.y) ? Point3{ 0., -a.z, a.y } : Point3{ -a.z, 0., a.x };
+			double lbis = norm(bisector);
+			if (lbis > 0.)
+				q = points[k] + bisector * (unif(re) * std::min(la, lb) / lbis);
+			break;
+		}
+		}
+		queries[i] = { kind, q };
+	}
+	return queries;
+}
+
+ValidationReport Validator::run(std::ostream* log)
+{
+	ValidationReport report;
+	std::unique_ptr<TaskPool> pool = params.n_threads == 1 ? nullptr : std::make_unique<TaskPool>(params.n_threads);
+	size_t n_polylines = params.models.size() * params.indexes.size();
+	size_t polyline = 0;
+
+	for (size_t m = 0; m < params.models.size(); ++m)
+	{
+		GeneratorParams gen;
+		gen.model = params.models[m];
+		gen.n_points = params.n_points;
+		gen.seed = params.seed + m;
+		gen.n_threads = params.n_threads;
+		std::vector<Point3> points = PolylineGenerator(gen).generate();
+
+		for (IndexType index : params.indexes)
+		{
+			size_t n = params.n_queries / n_polylines + (polyline < params.n_queries % n_polylines);
+			std::seed_seq seq{ uint32_t(params.seed), uint32_t(params.seed >> 32), uint32_t(polyline) };
+			std::mt19937_64 seeder(seq);
+			auto queries = make_queries(points, n, seeder());
+			++polyline;
+
+			std::unique_ptr<Polyline> p;
+			{
+				MuteOutput mute;
+				p = std::make_unique<Polyline>(points, index);
+			}
+			std::vector<std::string> reasons(n);
+			auto check = [&](size_t i)
+			{
+				try
+				{
+					reasons[i] = compare(*p, queries[i].second);
+				}
+				catch (std::exception& e)
+				{
+					reasons[i] = std::string("exception: ") + e.what();
+				}
+			};
+			if (pool != nullptr)
+				pool->parallel_for(0, n, 64, check);
+			else
+				for (size_t i = 0; i < n; ++i)
+					check(i);
+
+			size_t failed = 0;
+			for (size_t i = 0; i < n; ++i)
+			{
+				size_t kind = size_t(queries[i].first);
+				++report.queries[kind];
+				if (reasons[i].empty())
+					continue;
+				++report.failed[kind];
+				++failed;
+				if (report.failures.size() >= params.max_reported)
+					continue;
+
+				ValidationFailure failure{ gen.model, index, queries[i].first, reasons[i], queries[i].second, {}, points.size() };
+				failure.points = minimize(points, [&](std::vector<Point3>& candidate)
+					{
+						try
+						{
+							MuteOutput mute;
+							Polyline c(candidate, index);
+							return !compare(c, failure.query).empty();
+						}
+						catch (std::exception&)
+						{
+							// another failure, not the one minimized
+							return false;
+						}
+					}, params.max_attempts);
+				{
+					MuteOutput mute;
+					Polyline c(failure.points, index);
+					std::string reason = compare(c, failure.query);
+					if (!reason.empty())
+						failure.reason = reason;
+				}
+				report.failures.push_back(failure);
+			}
+			if (log != nullptr)
+				*log << model_name(gen.model) << ", " << index_name(index) << ": " << failed << " of " << n << " queries failed\n";
+		}
+	}
+	return report;
+}
+
+void Validator::write_failure(const ValidationFailure& failure, std::ostream& out)
+{
+	auto precision = out.precision(17);
+	out << "model " << model_name(failure.model) << ", index " << index_name(failure.index) << ", "
+		<< kind_name(failure.kind) << " query\n" << failure.reason << "\n";
+	out << "query " << failure.query.x << " " << failure.query.y << " " << failure.query.z << "\n";
+	out << failure.points.size() << " of " << failure.original_points << " vertices:\n";
+	for (auto& v : failure.points)
+		out << v.x << " " << v.y << " " << v.z << "\n";
+	out.precision(precision);
+}
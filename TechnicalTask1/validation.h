@@ -0,0 +1,100 @@
+#pragma once
+#ifndef VALIDATION_H
+#define VALIDATION_H
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "generator.h"
+#include "polyline.h"
+
+// Kinds of the validation queries
+enum class QueryKind
+{
+	// uniform in the polyline bounds
+	INSIDE,
+	// beyond the bounds, by up to the largest side of the bounds
+	OUTSIDE,
+	// exactly at a vertex (a tie of the adjacent segments)
+	VERTEX,
+	// on a segment
+	ON_SEGMENT,
+	// on the bisector of the angle at a vertex, equidistant to the adjacent segments
+	EQUIDISTANT
+};
+constexpr size_t QUERY_KINDS = 5;
+
+struct ValidationParams
+{
+	uint64_t seed = 1;
+	// over all the polylines
+	size_t n_queries = 1000000;
+	// vertices of every generated polyline
+	size_t n_points = 10000;
+	// a polyline of every model is checked with every index
+	std::vector<GeneratorModel> models = { GeneratorModel::UNIFORM, GeneratorModel::RANDOM_WALK, GeneratorModel::CLUSTERED_TRACKS,
+		GeneratorModel::HELIX, GeneratorModel::ROAD_GRID, GeneratorModel::DUPLICATES };
+	std::vector<IndexType> indexes = { IndexType::OCTREE, IndexType::HASH_GRID, IndexType::FLAT_OCTREE };
+	// 0 - all hardware threads, the report does not depend on it
+	size_t n_threads = 0;
+	// failures minimized and reported, the rest are counted only
+	size_t max_reported = 5;
+	// attempts of the minimization of one failure
+	size_t max_attempts = 2000;
+};
+
+struct ValidationFailure
+{
+	GeneratorModel model;
+	IndexType index;
+	QueryKind kind;
+	// the first mismatch found
+	std::string reason;
+	Point3 query;
+	// minimized polyline on which the query still fails
+	std::vector<Point3> points;
+	size_t original_points;
+};
+
+struct ValidationReport
+{
+	std::array<size_t, QUERY_KINDS> queries{};
+	std::array<size_t, QUERY_KINDS> failed{};
+	std::vector<ValidationFailure> failures;
+
+	size_t total_queries() const;
+	size_t total_failed() const;
+};
+
+// Seeded differential validation of Polyline::locate_point against locate_point_greedy:
+// polylines of every model are generated, queries of every kind are checked in parallel,
+// the first failures (in the order of the queries, so for any number of threads) are minimized
+class Validator
+{
+public:
+	Validator(const ValidationParams& params);
+
+	// progress goes to log, if any
+	ValidationReport run(std::ostream* log = nullptr);
+
+	// empty if locate_point agrees with greedy search on the distance (up to the rounding of the double distances),
+	// on the tie set and on the projections, otherwise the mismatch
+	static std::string compare(Polyline& p, Point3& q);
+	// Delta debugging: removes runs of vertices, halving the runs when no run may be removed,
+	// while fails holds, at most max_attempts checks
+	static std::vector<Point3> minimize(std::vector<Point3> points, const std::function<bool(std::vector<Point3>&)>& fails,
+		size_t max_attempts = 2000);
+
+	// the failure and its polyline as "x y z" lines, with full precision
+	static void write_failure(const ValidationFailure& failure, std::ostream& out);
+	static const char* kind_name(QueryKind kind);
+
+private:
+	ValidationParams params;
+
+	std::vector<std::pair<QueryKind, Point3>> make_queries(const std::vector<Point3>& points, size_t n, uint64_t seed) const;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "versioned_polyline.h"
+
+// max segments in an octant, as for Polyline
+static const size_t MAX_OCTANT = 5000;
+
+std::shared_ptr<Segment> PolylineVersion::make_segment(size_t id) const
+{
+	return std::make_shared<Segment>(Segment{ vertex_ptr(id), vertex_ptr(id + 1), id });
+}
+
+AABBox PolylineVersion::segment_box(size_t id) const
+{
+	const Point3& a = vertex(id);
+	const Point3& b = vertex(id + 1);
+	return AABBox{
+		Point3{ std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) },
+		Point3{ std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) } };
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> PolylineVersion::locate_point(Point3& p) const
+{
+	return octree->locate_point_bounded(p, std::numeric_limits<double>::max());
+}
+
+std::tuple<double, std::vector<size_t>, std::vector<Point3>> PolylineVersion::locate_point_greedy(Point3& p) const
+{
+	// the same ties as the octree search of the version
+	ClosestSegments closest(octree->get_tie_policy(), p, octree->data_scale());
+	for (size_t id = 0; id + 1 < n_points; ++id)
+	{
+		auto [d, p_proj] = Segment{ vertex_ptr(id), vertex_ptr(id + 1), id }.euc_dist(p);
+		closest.add(d, vertex_ptr(id), vertex_ptr(id + 1), id, p_proj);
+	}
+	return closest.resolve();
+}
+
+///____________________________________________________________________________________
+
+VersionedPolyline::Snapshot::Snapshot(Snapshot&& other) noexcept : slot(other.slot), version(other.version)
+{
+	other.slot = nullptr;
+}
+
+VersionedPolyline::Snapshot::~Snapshot()
+{
+	if (slot != nullptr)
+		slot->store(0);
+}
+
+VersionedPolyline::Reader::Reader(VersionedPolyline& polyline) : polyline(polyline)
+{
+	for (slot = 0; slot < MAX_READERS; ++slot)
+	{
+		bool used = false;
+		if (polyline.slots[slot].used.compare_exchange_strong(used, true))
+			return;
+	}
+	throw std::runtime_error("Too many readers!");
+}
+
+VersionedPolyline::Reader::~Reader()
+{
+	polyline.slots[slot].epoch.store(0);
+	polyline.slots[slot].used.store(false);
+}
+
+VersionedPolyline::Snapshot VersionedPolyline::Reader::pin()
+{
+	auto& s = polyline.slots[slot];
+	if (s.epoch.load() != 0)
+		throw std::runtime_error("Reader already holds a snapshot!");
+	// a writer either sees the announced epoch before deleting the version, 
+	// or has replaced the version before the load below (all the operations are sequentially consistent)
+	s.epoch.store(polyline.epoch.load());
+	return Snapshot(&s.epoch, polyline.current.load());
+}
+
+///____________________________________________________________________________________
+
+PolylineVersion* VersionedPolyline::build(std::vector<Point3>& v, uint64_t id)
+{
+	auto version = std::make_unique<PolylineVersion>();
+	version->id = id;
+	version->n_points = v.size();
+	for (size_t c = 0; c < v.size(); c += PolylineVersion::CHUNK)
+		version->chunks.push_back(std::make_shared<std::vector<Point3>>(v.begin() + c, v.begin() + std::min(c + PolylineVersion::CHUNK, v.size())));
+
+	AABBox bounds{ v[0], v[0] };
+	for (auto& p : v)
+	{
+		bounds.lMin = Point3{ std::min(bounds.lMin.x, p.x), std::min(bounds.lMin.y, p.y), std::min(bounds.lMin.z, p.z) };
+		bounds.rMax = Point3{ std::max(bounds.rMax.x, p.x), std::max(bounds.rMax.y, p.y), std::max(bounds.rMax.z, p.z) };
+	}
+	std::vector<std::shared_ptr<Segment>> segments(v.size() - 1);
+	for (size_t i = 0; i + 1 < v.size(); ++i)
+		segments[i] = version->make_segment(i);
+	version->octree = std::make_shared<Octree<Segment>>(MAX_OCTANT);
+	version->octree->construct(bounds, segments);
+	return version.release();
+}
+
+VersionedPolyline::VersionedPolyline(const std::vector<Point3>& v)
+{
+	if (v.size() < 2)
+		throw std::runtime_error("Polyline implies at least two points!");
+	std::vector<Point3> copy = v;
+	current.store(build(copy, 1));
+}
+
+VersionedPolyline::~VersionedPolyline()
+{
+	delete current.load();
+	for (auto& [e, version] : retired)
+		delete version;
+}
+
+uint64_t VersionedPolyline::update_vertices(size_t first, std::span<const Point3> v)
+{
+	std::lock_guard<std::mutex> lock(writer_mtx);
+	const PolylineVersion* cur = current.load();
+	if (v.empty())
+		return cur->id;
+	if (first + v.size() > cur->n_points)
+		throw std::runtime_error("Vertex range is out of the polyline!");
+
+	const size_t CHUNK = PolylineVersion::CHUNK;
+	auto next = std::make_unique<PolylineVersion>(*cur);
+	next->id = cur->id + 1;
+	size_t c0 = first / CHUNK, c1 = (first + v.size() - 1) / CHUNK;
+	for (size_t c = c0; c <= c1; ++c)
+	{
+		auto chunk = std::make_shared<std::vector<Point3>>(*cur->chunks[c]);
+		for (size_t i = std::max(first, c * CHUNK); i < std::min(first + v.size(), (c + 1) * CHUNK); ++i)
+			(*chunk)[i - c * CHUNK] = v[i - first];
+		next->chunks[c] = chunk;
+	}
+
+	// the records of all the segments touching the new chunks are replaced, the old ones keep pointing to the old chunks
+	size_t s0 = c0 * CHUNK > 0 ? c0 * CHUNK - 1 : 0;
+	size_t s1 = std::min((c1 + 1) * CHUNK, cur->n_points - 1);
+	std::vector<std::pair<size_t, AABBox>> removed;
+	std::vector<std::shared_ptr<Segment>> inserted;
+	for (size_t id = s0; id < s1; ++id)
+	{
+		removed.emplace_back(id, cur->segment_box(id));
+		inserted.push_back(next->make_segment(id));
+	}
+	next->octree = cur->octree->copy_on_write(removed, inserted);
+	return publish(next.release());
+}
+
+uint64_t VersionedPolyline::reindex()
+{
+	std::lock_guard<std::mutex> lock(writer_mtx);
+	const PolylineVersion* cur = current.load();
+	std::vector<Point3> v(cur->n_points);
+	for (size_t i = 0; i < v.size(); ++i)
+		v[i] = cur->vertex(i);
+	return publish(build(v, cur->id + 1));
+}
+
+uint64_t VersionedPolyline::publish(PolylineVersion* next)
+{
+	PolylineVersion* prev = current.exchange(next);
+	// readers announcing the epoch after the increment load the new version
+	retired.emplace_back(epoch.fetch_add(1), prev);
+	reclaim();
+	return next->id;
+}
+
+void VersionedPolyline::reclaim()
+{
+	uint64_t oldest = std::numeric_limits<uint64_t>::max();
+	for (auto& s : slots)
+	{
+		uint64_t e = s.epoch.load();
+		if (e != 0)
+			oldest = std::min(oldest, e);
+	}
+	// a version retired at epoch e may be held only by the readers pinned at e or before
+	auto it = std::partition(retired.begin(), retired.end(), [&](auto& r) { return r.first >= oldest; });
+	for (auto r = it; r != retired.end(); ++r)
+		delete r->second;
+	retired.erase(it, retired.end());
+}
+
+size_t VersionedPolyline::retired_count()
+{
+	std::lock_guard<std::mutex> lock(writer_mtx);
+	reclaim();
+	return retired.size();
+}
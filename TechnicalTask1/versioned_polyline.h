@@ -0,0 +1,128 @@
+#pragma once
+#ifndef VERSIONED_POLYLINE_H
+#define VERSIONED_POLYLINE_H
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <tuple>
+#include <vector>
+#include "octree.h"
+#include "polyline.h"
+
+// Immutable version of a polyline: the vertices in chunks of CHUNK and the octree over them,
+// the chunks, the octree nodes and the segment records are shared with the other versions where unchanged
+class PolylineVersion
+{
+public:
+	static constexpr size_t CHUNK = 64;
+
+	uint64_t number() const { return id; }
+	size_t size() const { return n_points; }
+	const Point3& vertex(size_t i) const { return (*chunks[i / CHUNK])[i % CHUNK]; }
+
+	// Branch-and-bound search in the octree of the version (exact, ties included)
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point(Point3& p) const;
+	std::tuple<double, std::vector<size_t>, std::vector<Point3>> locate_point_greedy(Point3& p) const;
+
+private:
+	friend class VersionedPolyline;
+
+	uint64_t id = 0;
+	size_t n_points = 0;
+	// not modified once the version is published
+	std::vector<std::shared_ptr<std::vector<Point3>>> chunks;
+	std::shared_ptr<Octree<Segment>> octree;
+
+	Point3* vertex_ptr(size_t i) const { return &(*chunks[i / CHUNK])[i % CHUNK]; }
+	std::shared_ptr<Segment> make_segment(size_t id) const;
+	AABBox segment_box(size_t id) const;
+};
+
+// Polyline with lock-free readers and serialized writers:
+// readers pin the current version (an epoch announcement and a single atomic load) and never block,
+// writers build the next version by copy-on-write of the changed chunks and octree nodes and publish it atomically;
+// a replaced version is retired with the epoch of its replacement and deleted once no reader is pinned at that epoch or before
+class VersionedPolyline
+{
+public:
+	static constexpr size_t MAX_READERS = 64;
+
+	VersionedPolyline(const std::vector<Point3>& v);
+	// no reader may be registered
+	~VersionedPolyline();
+	VersionedPolyline(const VersionedPolyline&) = delete;
+	VersionedPolyline& operator=(const VersionedPolyline&) = delete;
+
+	class Reader;
+
+	// Pinned version, valid until the snapshot is destroyed
+	class Snapshot
+	{
+	public:
+		Snapshot(Snapshot&& other) noexcept;
+		~Snapshot();
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator=(const Snapshot&) = delete;
+
+		const PolylineVersion& operator*() const { return *version; }
+		const PolylineVersion* operator->() const { return version; }
+
+	private:
+		friend class Reader;
+		Snapshot(std::atomic<uint64_t>* slot, const PolylineVersion* version) : slot(slot), version(version) {}
+
+		std::atomic<uint64_t>* slot;
+		const PolylineVersion* version;
+	};
+
+	// Reader slot of one thread, a reader holds at most one snapshot at a time
+	class Reader
+	{
+	public:
+		// throws if all MAX_READERS slots are taken
+		Reader(VersionedPolyline& polyline);
+		~Reader();
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		Snapshot pin();
+
+	private:
+		VersionedPolyline& polyline;
+		size_t slot;
+	};
+
+	// Writers, serialized; they do not wait for the readers
+	// moves the vertices [first, first + v.size()), returns the number of the published version
+	uint64_t update_vertices(size_t first, std::span<const Point3> v);
+	// publishes a version with the octree built anew (the copy-on-write updates only grow the node boxes)
+	uint64_t reindex();
+
+	// retired versions not deleted yet (after an attempt to delete them)
+	size_t retired_count();
+
+private:
+	struct alignas(64) ReaderSlot
+	{
+		// epoch announced by the pinned reader, 0 - not pinned
+		std::atomic<uint64_t> epoch{ 0 };
+		std::atomic<bool> used{ false };
+	};
+
+	std::atomic<PolylineVersion*> current;
+	std::atomic<uint64_t> epoch{ 1 };
+	std::array<ReaderSlot, MAX_READERS> slots;
+
+	std::mutex writer_mtx;
+	// {epoch of the replacement, version}
+	std::vector<std::pair<uint64_t, PolylineVersion*>> retired;
+
+	static PolylineVersion* build(std::vector<Point3>& v, uint64_t id);
+	// replaces the current version, retires the previous one and deletes the versions no reader can hold
+	uint64_t publish(PolylineVersion* next);
+	void reclaim();
+};
+
+#endif